@@ -0,0 +1,348 @@
+/**
+ * @file bench.c
+ * @brief 不依赖硬件的性能测试
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ * 
+ * @par 修改日志:
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "crc_check.h"
+#include "memctrl.h"
+#include "spi_reg.h"
+#include "shm_tlock.h"
+#include "lat_hist.h"
+#include "pp_uart.h"
+#include "bench.h"
+#include "debug.h"
+
+/* 防止编译器把测试的内存操作优化掉 */
+#define BENCH_BARRIER()     __asm__ volatile("" ::: "memory")
+
+static uint64_t _now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* 旧的写帧构建方式: 每次都把整个收发缓冲区刷成0xff */
+static void _frame_build_legacy(uint8_t *tx_buf, uint8_t *rx_buf, const uint8_t *data, uint16_t reg_cnt){
+    uint16_t crc16_val;
+    size_t trans_length = SpiFrame_DataLength(reg_cnt);
+
+    memset(rx_buf, 0xff, SPI_RT_MSG_MAX_SIZE);
+    memset(tx_buf, 0xff, SPI_RT_MSG_MAX_SIZE);
+    crc16_val = SpiFrame_BuildCmd(tx_buf, SPI_CMD_WRITE_REG, 0x1011, reg_cnt);
+    crc16_val = crc16(crc16_val, data, reg_cnt);
+    memcpy(tx_buf, data, reg_cnt);
+    SET_MEM_VAL_TYPE_SYSTEM_TO_BIG(tx_buf+reg_cnt, crc16_val, uint16_t);
+    memset(tx_buf+reg_cnt+WR_CRC_LEN, 0xff, trans_length-reg_cnt-WR_CRC_LEN);
+}
+
+/* 现在的方式: 只填充命令头、尾部CRC和对齐填充，数据直接从调用者缓冲区发出 */
+static void _frame_build(uint8_t *cmd_buf, uint8_t *tail_buf, const uint8_t *data, uint16_t reg_cnt){
+    uint16_t crc16_val;
+    size_t trans_length = SpiFrame_DataLength(reg_cnt);
+
+    crc16_val = SpiFrame_BuildCmd(cmd_buf, SPI_CMD_WRITE_REG, 0x1011, reg_cnt);
+    crc16_val = crc16(crc16_val, data, reg_cnt);
+    SpiFrame_BuildTail(tail_buf, trans_length - reg_cnt, &crc16_val);
+}
+
+/**
+ * @brief 测试每次传输构建帧的开销，对比旧的整缓冲区memset方式
+ * @param  config           config->bench_frame 为每种大小的循环次数
+ * @return int 
+ */
+int bench_frame(RunConfig *config){
+    /* 1: mpu_online_cnt 这种单字节寄存器  4: dtc_map  80: 配置字  960: 60个CAN报文 */
+    static const uint16_t reg_cnt_tab[] = {1, 4, 80, 960};
+    static uint8_t tx_buf[SPI_RT_MSG_MAX_SIZE], rx_buf[SPI_RT_MSG_MAX_SIZE];
+    static uint8_t data[SPI_RT_MSG_MAX_SIZE];
+    uint8_t cmd_buf[SPI_CMD_LEN], tail_buf[SPI_FRAME_TAIL_MAX];
+    uint32_t loops = config->bench_frame;
+    uint32_t i, k;
+    uint64_t start, legacy_ns, new_ns;
+
+    memset(data, 0x5a, sizeof(data));
+    dbg_inforaw("帧构建耗时(每次调用, %u次平均):\n", loops);
+    dbg_inforaw("%8s %12s %12s %8s\n", "reg_cnt", "legacy(ns)", "now(ns)", "speedup");
+    for(k = 0; k < sizeof(reg_cnt_tab)/sizeof(reg_cnt_tab[0]); k++){
+        start = _now_ns();
+        for(i = 0; i < loops; i++){
+            _frame_build_legacy(tx_buf, rx_buf, data, reg_cnt_tab[k]);
+            BENCH_BARRIER();
+        }
+        legacy_ns = _now_ns() - start;
+
+        start = _now_ns();
+        for(i = 0; i < loops; i++){
+            _frame_build(cmd_buf, tail_buf, data, reg_cnt_tab[k]);
+            BENCH_BARRIER();
+        }
+        new_ns = _now_ns() - start;
+
+        dbg_inforaw("%8u %12.1f %12.1f %7.2fx\n", reg_cnt_tab[k], 
+            (double)legacy_ns/loops, (double)new_ns/loops, new_ns ? (double)legacy_ns/new_ns : 0.0);
+    }
+    return 0;
+}
+
+#define BENCH_LOCK_FLOCK_PATH   "/tmp/mcu_reg_wr_bench.lock"
+#define BENCH_LOCK_SHM_PATH     SPIREG_SHM_LOCK_DIR "mcu_reg_wr_bench.tlock"
+#define BENCH_LOCK_MAX_PROCS    8
+#define BENCH_LOCK_HOLD_LOOPS   64          /* 临界区内的空转，模拟很短的寄存器访问 */
+
+/* 所有进程共享的测试状态 */
+typedef struct _BenchLockShared{
+    volatile int            go;
+    volatile uint64_t       counter;        /* 只在锁内非原子地加，用来检查互斥 */
+}BenchLockShared;
+
+static void _bench_lock_hold(BenchLockShared *bs){
+    volatile uint32_t spin;
+    bs->counter = bs->counter + 1;
+    for(spin = 0; spin < BENCH_LOCK_HOLD_LOOPS; spin++);
+}
+
+/* 旧的方式: 进程内互斥锁 + flock, 每个子进程自己打开锁文件(flock 是跟着打开的文件走的) */
+static void _bench_lock_child_flock(BenchLockShared *bs, uint32_t loops){
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    uint32_t i;
+    int fd = open(BENCH_LOCK_FLOCK_PATH, O_CREAT | O_RDWR | O_CLOEXEC, 0666);
+    if(fd < 0) _exit(1);
+    while(!bs->go) sched_yield();
+    for(i = 0; i < loops; i++){
+        pthread_mutex_lock(&mutex);
+        flock(fd, LOCK_EX);
+        _bench_lock_hold(bs);
+        flock(fd, LOCK_UN);
+        pthread_mutex_unlock(&mutex);
+    }
+    close(fd);
+    _exit(0);
+}
+
+static void _bench_lock_child_shm(BenchLockShared *bs, uint32_t loops){
+    ShmTLock l;
+    uint32_t i;
+    if(ShmTLock_Open(&l, BENCH_LOCK_SHM_PATH) < 0) _exit(1);
+    while(!bs->go) sched_yield();
+    for(i = 0; i < loops; i++){
+        ShmTLock_Lock(&l);
+        _bench_lock_hold(bs);
+        ShmTLock_Unlock(&l);
+    }
+    ShmTLock_Close(&l);
+    _exit(0);
+}
+
+/**
+ * @brief 起 nproc 个进程一起抢锁，返回每次加解锁的平均耗时(ns)，互斥失败返回负数
+ */
+static double _bench_lock_run(BenchLockShared *bs, int use_shm, int nproc, uint32_t loops){
+    pid_t pids[BENCH_LOCK_MAX_PROCS];
+    uint64_t start, used;
+    int i, status, failed = 0;
+
+    bs->go = 0;
+    bs->counter = 0;
+    for(i = 0; i < nproc; i++){
+        pids[i] = fork();
+        if(pids[i] == 0){
+            if(use_shm) _bench_lock_child_shm(bs, loops);
+            else _bench_lock_child_flock(bs, loops);
+        }
+        if(pids[i] < 0) { nproc = i; failed = 1; break; }
+    }
+    /* 等子进程都打开锁文件 */
+    usleep(20000);
+    start = _now_ns();
+    bs->go = 1;
+    for(i = 0; i < nproc; i++){
+        if(waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed = 1;
+    }
+    used = _now_ns() - start;
+    if(failed || bs->counter != (uint64_t)nproc * loops)
+        return -1.0;
+    return (double)used / ((double)nproc * loops);
+}
+
+/**
+ * @brief 对比两种进程间仲裁方式在1~8个进程竞争下的开销
+ * @param  config           config->bench_lock 为每个进程的加解锁次数
+ * @return int 
+ */
+int bench_lock(RunConfig *config){
+    BenchLockShared *bs;
+    uint32_t loops = config->bench_lock;
+    double flock_ns, shm_ns;
+    int nproc, ret = 0;
+
+    bs = mmap(NULL, sizeof(BenchLockShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(bs == MAP_FAILED) return -1;
+    unlink(BENCH_LOCK_SHM_PATH);
+
+    dbg_inforaw("加解锁耗时(每次, 每个进程%u次, 临界区空转%d次):\n", loops, BENCH_LOCK_HOLD_LOOPS);
+    dbg_inforaw("%6s %14s %14s %8s\n", "procs", "flock(ns)", "shm-tlock(ns)", "speedup");
+    for(nproc = 1; nproc <= BENCH_LOCK_MAX_PROCS; nproc++){
+        flock_ns = _bench_lock_run(bs, 0, nproc, loops);
+        shm_ns = _bench_lock_run(bs, 1, nproc, loops);
+        if(flock_ns < 0 || shm_ns < 0){
+            dbg_errfl("nproc = %d 互斥检查失败", nproc);
+            ret = -1;
+            break;
+        }
+        dbg_inforaw("%6d %14.1f %14.1f %7.2fx\n", nproc, flock_ns, shm_ns, shm_ns > 0 ? flock_ns/shm_ns : 0.0);
+    }
+    unlink(BENCH_LOCK_FLOCK_PATH);
+    unlink(BENCH_LOCK_SHM_PATH);
+    munmap(bs, sizeof(BenchLockShared));
+    return ret;
+}
+
+#define BENCH_ACK_TIMEOUT_MS    100
+#define BENCH_ACK_WARMUP        100
+
+/* 伪终端主设备一侧扮演MCU，收到一个字节马上回一个ACK */
+typedef struct _BenchAckPeer{
+    int                     fd;
+    volatile int            stop;
+}BenchAckPeer;
+
+static void *_bench_ack_peer(void *arg){
+    BenchAckPeer *peer = (BenchAckPeer *)arg;
+    struct pollfd pfd = {.fd = peer->fd, .events = POLLIN};
+    uint8_t buf[64], ack[64];
+    ssize_t n;
+
+    memset(ack, SPI_ACK, sizeof(ack));
+    while(!peer->stop){
+        if(poll(&pfd, 1, BENCH_ACK_TIMEOUT_MS) <= 0) continue;
+        n = read(peer->fd, buf, sizeof(buf));
+        if(n > 0 && write(peer->fd, ack, (size_t)n) != n) break;
+    }
+    return NULL;
+}
+
+/* 发一个握手收一个ACK，u 不为NULL时走io_uring(同一次提交里写和读) */
+static int _bench_ack_once(int fd, UartUring *u, uint32_t spin_us){
+    uint8_t ch = SPI_CMD_START;
+
+    if(u) return uart_UringWriteRead(u, &ch, 1, &ch, 1, BENCH_ACK_TIMEOUT_MS) == 1 && ch == SPI_ACK;
+    return uart_Write(fd, &ch, 1) == 1 && uart_ReadSpin(fd, &ch, 1, BENCH_ACK_TIMEOUT_MS, spin_us) == 1 && ch == SPI_ACK;
+}
+
+static uint64_t _thread_cpu_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief 在伪终端上测不同忙等时间下从发出握手到收到ACK的延时分布，以及等待线程的CPU占用
+ *        对端回得很快，测的是MPU这一侧的唤醒延时；真实串口还要加上两个字节的传输时间和MCU的处理时间
+ *        编译时打开了 RVM_UART_URING 的话最后再测一行io_uring(不忙等)
+ * @param  config           config->bench_ack 为每档的次数
+ * @return int 
+ */
+int bench_ack(RunConfig *config){
+    static const uint32_t spin_tab[] = {0, 10, 20, 50, 100, 200, 500};
+    uint32_t loops = config->bench_ack;
+    uint32_t rows = sizeof(spin_tab)/sizeof(spin_tab[0]);
+    BenchAckPeer peer;
+    UartUring *u;
+    pthread_t tid;
+    LatHist hist;
+    uint64_t t, wall, cpu, lat, hits;
+    uint32_t i, k, timeouts;
+    char *slave;
+    int fd, ret = 0;
+
+    peer.stop = 0;
+    peer.fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if(peer.fd < 0 || grantpt(peer.fd) < 0 || unlockpt(peer.fd) < 0 || (slave = ptsname(peer.fd)) == NULL){
+        dbg_errfl("创建伪终端失败");
+        if(peer.fd >= 0) close(peer.fd);
+        return -1;
+    }
+    fd = uart_Open(slave, 115200, 8, 1, 'N');
+    if(fd < 0){
+        dbg_errfl("打开 %s 失败", slave);
+        close(peer.fd);
+        return -1;
+    }
+    u = uart_UringOpen(fd);
+    if(pthread_create(&tid, NULL, _bench_ack_peer, &peer) != 0){
+        uart_UringClose(u);
+        close(fd);
+        close(peer.fd);
+        return -1;
+    }
+
+    dbg_inforaw("伪终端ACK延时(每档%u次, 单位us), cpu为等待线程每次ACK的CPU时间, hit为忙等期间收到的比例:\n", loops);
+    dbg_inforaw("%8s %8s %8s %8s %8s %8s %10s %8s %6s\n", 
+        "spin", "avg", "p50", "p99", "p99.9", "max", "cpu/ack", "cpu%", "hit%");
+    for(k = 0; k < rows + (u != NULL); k++){
+        UartUring *ku = k < rows ? NULL : u;
+        uint32_t spin = k < rows ? spin_tab[k] : 0;
+        memset(&hist, 0, sizeof(hist));
+        hits = 0;
+        timeouts = 0;
+        for(i = 0; i < BENCH_ACK_WARMUP; i++) _bench_ack_once(fd, ku, spin);
+        wall = _now_ns();
+        cpu = _thread_cpu_ns();
+        for(i = 0; i < loops; i++){
+            t = _now_ns();
+            if(!_bench_ack_once(fd, ku, spin)){
+                timeouts++;
+                continue;
+            }
+            lat = _now_ns() - t;
+            if(lat <= (uint64_t)spin * 1000ULL) hits++;
+            LatHist_Record(&hist, lat);
+        }
+        cpu = _thread_cpu_ns() - cpu;
+        wall = _now_ns() - wall;
+        if(hist.count == 0){
+            dbg_errfl("%s 全部超时", ku ? "io_uring" : "poll");
+            ret = -1;
+            break;
+        }
+        if(ku){
+            dbg_inforaw("%8s", "uring");
+        }else{
+            dbg_inforaw("%8u", spin);
+        }
+        dbg_inforaw(" %8.1f %8.1f %8.1f %8.1f %8.1f %10.1f %7.1f%% %5.1f%%\n",
+            (double)hist.sum_ns / hist.count / 1000.0, LatHist_Percentile(&hist, 50) / 1000.0,
+            LatHist_Percentile(&hist, 99) / 1000.0, LatHist_Percentile(&hist, 99.9) / 1000.0, hist.max_ns / 1000.0,
+            (double)cpu / loops / 1000.0, wall ? (double)cpu * 100.0 / wall : 0.0, (double)hits * 100.0 / hist.count);
+        if(timeouts) dbg_inforaw("%8s 超时%u次\n", "", timeouts);
+    }
+    peer.stop = 1;
+    pthread_join(tid, NULL);
+    uart_UringClose(u);
+    uart_Close(fd);
+    close(peer.fd);
+    return ret;
+}
@@ -0,0 +1,49 @@
+/**
+ * @file lat_hist.h
+ * @brief 延时直方图，对数线性分桶(HDR风格): 每个2的幂区间再均分 LAT_HIST_SUB_CNT 个桶，
+ *        相对误差不超过 1/LAT_HIST_SUB_CNT，记录只有几次原子加法，不加锁，
+ *        读取时可以和记录同时进行
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ *
+ * @par 修改日志:
+ */
+
+#ifndef _LAT_HIST_H_
+#define _LAT_HIST_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C"{
+#endif
+#endif /* __cplusplus */
+
+#define LAT_HIST_SUB_BITS       4
+#define LAT_HIST_SUB_CNT        (1 << LAT_HIST_SUB_BITS)
+#define LAT_HIST_MAX_BIT        36          /* 最大记录 2^37 ns (约137秒)，更大的记到最后一个桶 */
+#define LAT_HIST_BUCKETS        ((LAT_HIST_MAX_BIT - LAT_HIST_SUB_BITS + 2) << LAT_HIST_SUB_BITS)
+
+typedef struct _LatHist{
+    uint64_t                count;
+    uint64_t                sum_ns;
+    uint64_t                max_ns;
+    uint32_t                bucket[LAT_HIST_BUCKETS];
+}LatHist;
+
+extern void LatHist_Record(LatHist *hist, uint64_t ns);
+extern void LatHist_Snapshot(LatHist *hist, LatHist *out, int reset);
+extern uint64_t LatHist_Percentile(const LatHist *hist, double percent);
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif
+#endif /* __cplusplus */
+
+
+#endif // _LAT_HIST_H_
@@ -15,6 +15,7 @@
 
 
 #include <sys/types.h> 
+#include <stdint.h>
 
 #ifdef __cplusplus
 #if __cplusplus
@@ -26,9 +27,18 @@ extern int uart_Open(const char *uart_name, int speed, int databits, int stopbit
 extern void uart_Close(int fd);
 extern ssize_t uart_Write(int fd, void *data, size_t data_len);
 extern ssize_t uart_Read(int fd,void *data_buf, size_t buf_size, int timeout);
+extern ssize_t uart_ReadSpin(int fd,void *data_buf, size_t buf_size, int timeout, uint32_t spin_us);
+extern int uart_Wait(int fd, int timeout);
 extern void uart_InClean(int fd);
 extern void uart_OutClean(int fd);
 
+/* 串口收发的io_uring实现，编译时定义 PP_UART_URING 才有，否则 uart_UringOpen 总是返回NULL */
+typedef struct _UartUring UartUring;
+extern UartUring *uart_UringOpen(int fd);
+extern void uart_UringClose(UartUring *u);
+extern ssize_t uart_UringRead(UartUring *u, void *data_buf, size_t buf_size, int timeout);
+extern ssize_t uart_UringWriteRead(UartUring *u, const void *tx, size_t tx_len, void *rx, size_t rx_len, int timeout);
+
 #ifdef __cplusplus
 #if __cplusplus
 }
@@ -0,0 +1,72 @@
+/**
+ * @file reactor.h
+ * @brief 单线程事件循环，epoll 等待fd和timerfd定时器，周期性的任务不再各自睡眠轮询
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ *
+ * @par 修改日志:
+ */
+
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C"{
+#endif
+#endif /* __cplusplus */
+
+#define REACTOR_SRC_MAX         16          /* fd和定时器合计的最大数量 */
+
+typedef struct _Reactor Reactor;
+
+/* fd可读写时调用，events 为 EPOLLIN 等 */
+typedef void (*ReactorFdCb)(Reactor *r, int fd, uint32_t events, void *arg);
+/* 定时器到期时调用，expired 为上次回调以来到期的次数，大于1说明回调来迟了 */
+typedef void (*ReactorTimerCb)(Reactor *r, int id, uint64_t expired, void *arg);
+
+typedef struct _ReactorSrc{
+    int                     fd;             /* -1 为空闲 */
+    int                     is_timer;       /* 1: fd 是本模块创建的 timerfd, 关闭时一起关掉 */
+    uint32_t                gen;            /* 每次占用加1, 和事件里带的代数不同说明是旧事件 */
+    ReactorFdCb             fd_cb;
+    ReactorTimerCb          timer_cb;
+    void                    *arg;
+}ReactorSrc;
+
+typedef struct _ReactorStat{
+    uint64_t                wakeups;        /* epoll_wait 返回的次数 */
+    uint64_t                fd_events;
+    uint64_t                timer_events;
+    uint64_t                timer_late;     /* 到期次数大于1的定时器回调 */
+}ReactorStat;
+
+struct _Reactor{
+    int                     epfd;
+    volatile int            stop;
+    ReactorSrc              src[REACTOR_SRC_MAX];
+    ReactorStat             stat;
+};
+
+extern int Reactor_Open(Reactor *r);
+extern void Reactor_Close(Reactor *r);
+extern int Reactor_AddFd(Reactor *r, int fd, uint32_t events, ReactorFdCb cb, void *arg);
+extern int Reactor_AddTimer(Reactor *r, uint32_t period_us, ReactorTimerCb cb, void *arg);
+extern int Reactor_SetTimer(Reactor *r, int id, uint32_t delay_us, uint32_t period_us);
+extern int Reactor_Del(Reactor *r, int id);
+extern int Reactor_Run(Reactor *r);
+extern void Reactor_Stop(Reactor *r);
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif
+#endif /* __cplusplus */
+
+
+#endif // _REACTOR_H_
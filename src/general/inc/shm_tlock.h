@@ -0,0 +1,62 @@
+/**
+ * @file shm_tlock.h
+ * @brief 放在共享内存中的跨进程排队锁(ticket lock)
+ *        按取票顺序先来先得，不竞争时加锁解锁都不进内核，
+ *        持有锁或者排队中的进程死掉后，等待者会跳过它的票
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ *
+ * @par 修改日志:
+ */
+
+#ifndef _SHM_TLOCK_H_
+#define _SHM_TLOCK_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C"{
+#endif
+#endif /* __cplusplus */
+
+#define SHM_TLOCK_SLOTS         64          /* 同时排队的最大数量，排满时取票要等 */
+#define SHM_TLOCK_CHECK_MS      50          /* 等待者多久检查一次持有者是否还活着 */
+#define SHM_TLOCK_FULL_WAIT_US  1000        /* 排满时多久再试一次取票 */
+
+/* 每张票的登记，槽位 = 票号 % SHM_TLOCK_SLOTS，先登记再发票，发出去的票都有登记 */
+typedef struct _ShmTLockSlot{
+    uint64_t                reg;            /* 高32位票号 低32位pid, 一起原子更新，pid为0是从没用过 */
+    uint32_t                wake;           /* 轮到这个槽时加1, 排队者在这上面futex等待，只唤醒下一位 */
+}ShmTLockSlot;
+
+/* 共享内存中的内容，全0就是有效的初始状态 */
+typedef struct _ShmTLockShared{
+    uint32_t                next;           /* 下一张要发的票 */
+    uint32_t                serving;        /* 正在服务的票 */
+    ShmTLockSlot            slot[SHM_TLOCK_SLOTS];
+}ShmTLockShared;
+
+typedef struct _ShmTLock{
+    int                     fd;
+    ShmTLockShared          *sh;
+    uint32_t                ticket;         /* 持有锁时自己的票 */
+}ShmTLock;
+
+extern int ShmTLock_Open(ShmTLock *l, const char *path);
+extern void ShmTLock_Close(ShmTLock *l);
+extern int ShmTLock_Lock(ShmTLock *l);
+extern void ShmTLock_Unlock(ShmTLock *l);
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif
+#endif /* __cplusplus */
+
+
+#endif // _SHM_TLOCK_H_
@@ -0,0 +1,94 @@
+/**
+ * @file lat_hist.c
+ * @brief 延时直方图
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ *
+ * @par 修改日志:
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lat_hist.h"
+
+/* 值所在的桶: 小于 LAT_HIST_SUB_CNT 的值每个值一个桶，之后每个2的幂区间 LAT_HIST_SUB_CNT 个桶 */
+static int _Index(uint64_t ns){
+    int msb, shift, idx;
+    if(ns < LAT_HIST_SUB_CNT) return (int)ns;
+    msb = 63 - __builtin_clzll(ns);
+    shift = msb - LAT_HIST_SUB_BITS;
+    idx = ((shift + 1) << LAT_HIST_SUB_BITS) + (int)((ns >> shift) - LAT_HIST_SUB_CNT);
+    return idx < LAT_HIST_BUCKETS ? idx : LAT_HIST_BUCKETS - 1;
+}
+
+/* 桶的上界，用来报告百分位 */
+static uint64_t _Upper(int idx){
+    int group = idx >> LAT_HIST_SUB_BITS;
+    uint64_t sub = (uint64_t)(idx & (LAT_HIST_SUB_CNT - 1));
+    if(group == 0) return sub;
+    return ((LAT_HIST_SUB_CNT + sub + 1) << (group - 1)) - 1;
+}
+
+/**
+ * @brief 记录一个值，只有原子加法，多个线程同时记录也不会丢
+ * @param  hist             直方图
+ * @param  ns               延时 纳秒
+ */
+void LatHist_Record(LatHist *hist, uint64_t ns){
+    uint64_t max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->bucket[_Index(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum_ns, ns, __ATOMIC_RELAXED);
+    while(ns > max && !__atomic_compare_exchange_n(&hist->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief 取出直方图的内容
+ *        和记录同时进行时各个字段可能相差正在记录的那几次，不影响统计
+ * @param  hist             直方图
+ * @param  out              输出
+ * @param  reset            是否取出的同时清零
+ */
+void LatHist_Snapshot(LatHist *hist, LatHist *out, int reset){
+    int i;
+    if(reset){
+        out->count = __atomic_exchange_n(&hist->count, 0, __ATOMIC_RELAXED);
+        out->sum_ns = __atomic_exchange_n(&hist->sum_ns, 0, __ATOMIC_RELAXED);
+        out->max_ns = __atomic_exchange_n(&hist->max_ns, 0, __ATOMIC_RELAXED);
+        for(i = 0; i < LAT_HIST_BUCKETS; i++)
+            out->bucket[i] = __atomic_exchange_n(&hist->bucket[i], 0, __ATOMIC_RELAXED);
+        return;
+    }
+    out->count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    out->sum_ns = __atomic_load_n(&hist->sum_ns, __ATOMIC_RELAXED);
+    out->max_ns = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+    for(i = 0; i < LAT_HIST_BUCKETS; i++)
+        out->bucket[i] = __atomic_load_n(&hist->bucket[i], __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 计算百分位，在快照上调用
+ * @param  hist             直方图快照
+ * @param  percent          百分位 0~100
+ * @return uint64_t         纳秒，是所在桶的上界，不超过记录到的最大值
+ */
+uint64_t LatHist_Percentile(const LatHist *hist, double percent){
+    uint64_t total = 0, need, acc = 0, upper;
+    int i;
+    for(i = 0; i < LAT_HIST_BUCKETS; i++)
+        total += hist->bucket[i];
+    if(total == 0) return 0;
+    need = (uint64_t)((double)total * percent / 100.0 + 0.5);
+    if(need == 0) need = 1;
+    for(i = 0; i < LAT_HIST_BUCKETS; i++){
+        acc += hist->bucket[i];
+        if(acc >= need) break;
+    }
+    if(i == LAT_HIST_BUCKETS) i--;
+    upper = _Upper(i);
+    return upper < hist->max_ns ? upper : hist->max_ns;
+}
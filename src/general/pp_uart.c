@@ -26,6 +26,7 @@
 #include <termios.h>    /*PPSIX终端控制定义*/
 #include <errno.h>      /*错误号定义*/
 #include <sys/time.h>
+#include <time.h>
 
 static int baudRate_tab[] = {
 	1200,2400,4800,9600, 19200, 38400, 
@@ -253,6 +254,67 @@ ssize_t uart_Read(int fd,void *data_buf, size_t buf_size, int timeout)
 	return  read_p - (char*)data_buf;
 }
 
+/**
+ * @brief 	读串口，先在 spin_us 微秒内反复非阻塞读，没读满再退回 uart_Read 的 poll 等待
+ *          ACK这种很快就到的字节不用等调度器唤醒，代价是忙等期间占满一个CPU
+ * @param  fd               文件描述符，需要是 uart_Open 打开的(O_NONBLOCK)
+ * @param  data_buf         数据缓冲区指针
+ * @param  buf_size         数据缓冲大小
+ * @param  timeout          同 uart_Read
+ * @param  spin_us          忙等的时间(微秒)，0 等同 uart_Read
+ * @return ssize_t 			成功返回读到的字节数，超时返回0，错误返回负数
+ */
+ssize_t uart_ReadSpin(int fd,void *data_buf, size_t buf_size, int timeout, uint32_t spin_us)
+{
+	struct timespec ts;
+	uint64_t now, end;
+	ssize_t rn;
+	char *read_p = (char *)data_buf;
+	char *end_p = read_p + buf_size;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+	end = now + (uint64_t)spin_us * 1000ULL;
+	while(end_p - read_p > 0 && now < end){
+		/* 原始模式 VMIN=0，没有数据时返回0或EAGAIN */
+		rn = read(fd, read_p, end_p-read_p);
+		if(rn > 0){
+			read_p += rn;
+			continue;
+		}
+		if(rn < 0 && errno != EAGAIN && errno != EINTR)
+			return rn;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		now = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+	}
+	if(end_p - read_p > 0){
+		rn = uart_Read(fd, read_p, end_p-read_p, timeout);
+		if(rn < 0)
+			return rn;
+		read_p += rn;
+	}
+	return  read_p - (char*)data_buf;
+}
+
+/**
+ * @brief 	等串口有数据可读，不读走
+ * @param  fd               文件描述符
+ * @param  timeout          毫秒，负数一直等
+ * @return int 				有数据返回1，超时返回0，错误返回负数
+ */
+int uart_Wait(int fd, int timeout)
+{
+	struct pollfd fdset;
+	int ret;
+
+	fdset.fd = fd;
+	fdset.events = POLLIN;
+	ret = poll(&fdset, 1, timeout);
+	if(ret <= 0)
+		return ret;
+	return (fdset.revents & POLLIN) ? 1 : -1;
+}
+
 /**
  * @brief 清空输入缓冲区的数据
  * @param  fd               文件描述符
@@ -271,3 +333,344 @@ void uart_OutClean(int fd){
 
 
 
+/*============================== io_uring ==============================*/
+
+typedef struct _UartUring UartUring;
+
+#ifdef PP_UART_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES		8
+#define URING_BUF_SIZE		256			/* 注册缓冲区大小，握手和ACK都只有几个字节 */
+
+enum{
+	URING_UD_WRITE = 0,
+	URING_UD_POLL,
+	URING_UD_TIMEOUT,
+	URING_UD_READ,
+	URING_UD_CNT,
+	URING_UD_CANCEL = URING_UD_CNT,		/* 取消请求本身的完成，不放进结果 */
+};
+
+struct _UartUring{
+	int 					ring_fd;
+	int 					fd;
+	void 					*ring;
+	size_t 					ring_size;
+	struct io_uring_sqe 	*sqes;
+	size_t 					sqes_size;
+	uint32_t 				*sq_head;
+	uint32_t 				*sq_tail;
+	uint32_t 				*sq_mask;
+	uint32_t 				*sq_array;
+	uint32_t 				*cq_head;
+	uint32_t 				*cq_tail;
+	uint32_t 				*cq_mask;
+	struct io_uring_cqe 	*cqes;
+	uint32_t 				tail;			/* 本地的SQ尾，提交时写给内核 */
+	uint32_t 				inflight;		/* 内核已经取走还没完成的请求数 */
+	struct __kernel_timespec ts;			/* LINK_TIMEOUT 的时间，内核在完成前一直引用 */
+	uint8_t 				tx[URING_BUF_SIZE];
+	uint8_t 				rx[URING_BUF_SIZE];
+};
+
+/* 用到的操作内核都要支持，否则退回poll */
+static int _UringProbe(int ring_fd){
+	static const uint8_t need[] = {IORING_OP_WRITE_FIXED, IORING_OP_READ_FIXED, IORING_OP_POLL_ADD, IORING_OP_LINK_TIMEOUT,
+		IORING_OP_ASYNC_CANCEL};
+	struct io_uring_probe *probe;
+	size_t size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	uint32_t i;
+	int ret = -1;
+
+	probe = calloc(1, size);
+	if(probe == NULL) return -1;
+	if(syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0) goto out;
+	for(i = 0; i < sizeof(need); i++){
+		if(need[i] > probe->last_op || !(probe->ops[need[i]].flags & IO_URING_OP_SUPPORTED)) goto out;
+	}
+	ret = 0;
+out:
+	free(probe);
+	return ret;
+}
+
+static struct io_uring_sqe *_UringSqe(UartUring *u, uint8_t op, uint64_t user_data){
+	uint32_t idx = u->tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = 0;							/* 注册的第0个文件 */
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->user_data = user_data;
+	u->sq_array[idx] = idx;
+	u->tail++;
+	return sqe;
+}
+
+/* 收已经完成的请求，结果按 user_data 放到 res, res 为NULL时丢掉 */
+static void _UringReap(UartUring *u, int32_t *res){
+	uint32_t head = *u->cq_head;
+	uint32_t tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+	for(; head != tail; head++){
+		struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+		if(res && cqe->user_data < URING_UD_CNT) res[cqe->user_data] = cqe->res;
+		u->inflight--;
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* 把SQ里的请求交给内核，顺便等 wait 个完成，返回 io_uring_enter 的结果 */
+static long _UringEnter(UartUring *u, uint32_t wait){
+	uint32_t head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	long ret;
+
+	ret = syscall(__NR_io_uring_enter, u->ring_fd, u->tail - head, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	/* 出错时也可能已经取走了一部分，按内核的SQ头算 */
+	u->inflight += __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) - head;
+	return ret;
+}
+
+/**
+ * @brief 出错后链上的请求可能还在内核里，没提交的收回，提交了的取消并等它们全部完成，
+ *        免得迟到的完成混进下一次的结果
+ * @return int 				收完返回0 还有请求没完成返回负数，下次收发前再试
+ */
+static int _UringAbort(UartUring *u){
+	struct io_uring_sqe *sqe;
+	int i;
+
+	u->tail = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	__atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+	_UringReap(u, NULL);
+	if(u->inflight == 0) return 0;
+	/* 超时跟着被链的请求一起结束，不用单独取消 */
+	for(i = 0; i < URING_UD_CNT; i++){
+		if(i == URING_UD_TIMEOUT) continue;
+		sqe = _UringSqe(u, IORING_OP_ASYNC_CANCEL, URING_UD_CANCEL);
+		sqe->fd = -1;
+		sqe->flags = 0;
+		sqe->addr = (uint64_t)i;
+	}
+	__atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+	while(u->inflight || u->tail != __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE)){
+		if(_UringEnter(u, 1) < 0 && errno != EINTR){
+			/* 没交出去的取消也收回，下次重新取消 */
+			u->tail = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+			__atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+			_UringReap(u, NULL);
+			return -1;
+		}
+		_UringReap(u, NULL);
+	}
+	return 0;
+}
+
+/**
+ * @brief 提交已经填好的请求，等全部完成，结果按 user_data 放到 res
+ * @return int 				成功0 系统调用失败返回负数，这时没完成的请求已经取消并收完
+ */
+static int _UringRun(UartUring *u, int32_t res[URING_UD_CNT]){
+	uint32_t left;
+
+	__atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+	while((left = u->inflight + u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE)) != 0){
+		if(_UringEnter(u, left) < 0 && errno != EINTR){
+			_UringAbort(u);
+			return -1;
+		}
+		_UringReap(u, res);
+	}
+	return 0;
+}
+
+/* 等可读(最多 timeout 毫秒)再读，都链在 WRITE 后面时一次系统调用完成握手 */
+static void _UringPrepRead(UartUring *u, size_t len, int timeout){
+	struct io_uring_sqe *sqe;
+
+	sqe = _UringSqe(u, IORING_OP_POLL_ADD, URING_UD_POLL);
+	sqe->poll32_events = POLLIN;
+	sqe->flags |= IOSQE_IO_LINK;
+	if(timeout >= 0){
+		u->ts.tv_sec = timeout / 1000;
+		u->ts.tv_nsec = (long long)(timeout % 1000) * 1000000LL;
+		sqe = _UringSqe(u, IORING_OP_LINK_TIMEOUT, URING_UD_TIMEOUT);
+		sqe->fd = -1;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->addr = (uint64_t)(uintptr_t)&u->ts;
+		sqe->len = 1;
+	}
+	sqe = _UringSqe(u, IORING_OP_READ_FIXED, URING_UD_READ);
+	sqe->addr = (uint64_t)(uintptr_t)u->rx;
+	sqe->len = (uint32_t)len;
+	sqe->buf_index = 1;
+}
+
+/**
+ * @brief 给串口建一个io_uring，fd和收发缓冲区都预先注册，内核不支持时返回NULL，调用者继续用poll版本
+ * @param  fd               uart_Open 打开的串口
+ * @return UartUring* 
+ */
+UartUring *uart_UringOpen(int fd){
+	struct io_uring_params p;
+	struct iovec iov[2];
+	UartUring *u;
+	size_t sq_size, cq_size;
+
+	u = calloc(1, sizeof(UartUring));
+	if(u == NULL) return NULL;
+	u->fd = fd;
+	memset(&p, 0, sizeof(p));
+	u->ring_fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if(u->ring_fd < 0) goto err_free;
+	/* SQ和CQ共用一次mmap (5.4+) */
+	if(!(p.features & IORING_FEAT_SINGLE_MMAP) || _UringProbe(u->ring_fd) < 0) goto err_close;
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+	u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+	if(u->ring == MAP_FAILED) goto err_close;
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+	if(u->sqes == MAP_FAILED) goto err_unmap;
+	u->sq_head = (uint32_t *)((uint8_t *)u->ring + p.sq_off.head);
+	u->sq_tail = (uint32_t *)((uint8_t *)u->ring + p.sq_off.tail);
+	u->sq_mask = (uint32_t *)((uint8_t *)u->ring + p.sq_off.ring_mask);
+	u->sq_array = (uint32_t *)((uint8_t *)u->ring + p.sq_off.array);
+	u->cq_head = (uint32_t *)((uint8_t *)u->ring + p.cq_off.head);
+	u->cq_tail = (uint32_t *)((uint8_t *)u->ring + p.cq_off.tail);
+	u->cq_mask = (uint32_t *)((uint8_t *)u->ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((uint8_t *)u->ring + p.cq_off.cqes);
+	u->tail = *u->sq_tail;
+
+	iov[0].iov_base = u->tx;
+	iov[0].iov_len = sizeof(u->tx);
+	iov[1].iov_base = u->rx;
+	iov[1].iov_len = sizeof(u->rx);
+	if(syscall(__NR_io_uring_register, u->ring_fd, IORING_REGISTER_FILES, &u->fd, 1) < 0 ||
+		syscall(__NR_io_uring_register, u->ring_fd, IORING_REGISTER_BUFFERS, iov, 2) < 0)
+		goto err_sqes;
+	return u;
+err_sqes:
+	munmap(u->sqes, u->sqes_size);
+err_unmap:
+	munmap(u->ring, u->ring_size);
+err_close:
+	close(u->ring_fd);
+err_free:
+	free(u);
+	return NULL;
+}
+
+void uart_UringClose(UartUring *u){
+	if(u == NULL) return;
+	munmap(u->sqes, u->sqes_size);
+	munmap(u->ring, u->ring_size);
+	close(u->ring_fd);
+	free(u);
+}
+
+static int64_t _UringNowMs(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief 先写 tx 再读 rx，写、等可读、读链在一起一次提交，读的语义同 uart_Read
+ * @param  u                uart_UringOpen 的返回
+ * @param  tx               要写的数据，NULL或长度0时只读
+ * @param  tx_len           最大 URING_BUF_SIZE
+ * @param  rx               读缓冲区
+ * @param  rx_len           没读满时按剩下的长度继续等
+ * @param  timeout          每次等待的毫秒数，同 uart_Read；读到数据才重新计时，可读却读不到(EAGAIN)时只等剩下的时间
+ * @return ssize_t 			成功返回读到的字节数，超时返回0，写失败或错误返回负数
+ */
+ssize_t uart_UringWriteRead(UartUring *u, const void *tx, size_t tx_len, void *rx, size_t rx_len, int timeout){
+	int32_t res[URING_UD_CNT];
+	struct io_uring_sqe *sqe;
+	uint8_t *read_p = (uint8_t *)rx;
+	size_t left = rx_len, len;
+	int64_t deadline = 0;
+	int wait = timeout;
+
+	if(tx_len > URING_BUF_SIZE) return -1;
+	/* 上次出错时没收完的请求先收完 */
+	if(u->inflight && _UringAbort(u) < 0) return -1;
+	if(timeout > 0) deadline = _UringNowMs() + timeout;
+	while(tx_len || left){
+		memset(res, 0, sizeof(res));
+		if(tx_len){
+			memcpy(u->tx, tx, tx_len);
+			sqe = _UringSqe(u, IORING_OP_WRITE_FIXED, URING_UD_WRITE);
+			sqe->addr = (uint64_t)(uintptr_t)u->tx;
+			sqe->len = (uint32_t)tx_len;
+			sqe->buf_index = 0;
+			if(left) sqe->flags |= IOSQE_IO_LINK;
+		}
+		len = left < URING_BUF_SIZE ? left : URING_BUF_SIZE;
+		if(len) _UringPrepRead(u, len, wait);
+		if(_UringRun(u, res) < 0) return -1;
+		if(tx_len){
+			if(res[URING_UD_WRITE] != (int32_t)tx_len) return -1;
+			tx_len = 0;
+		}
+		if(len == 0) break;
+		/* 等待超时，poll和read都被取消 */
+		if(res[URING_UD_POLL] == -ECANCELED) break;
+		if(res[URING_UD_READ] < 0){
+			if(res[URING_UD_READ] != -EAGAIN) return res[URING_UD_READ];
+			if(timeout > 0){
+				wait = (int)(deadline - _UringNowMs());
+				if(wait <= 0) break;
+			}
+			continue;
+		}
+		if(res[URING_UD_READ] == 0) break;
+		memcpy(read_p, u->rx, (size_t)res[URING_UD_READ]);
+		read_p += res[URING_UD_READ];
+		left -= (size_t)res[URING_UD_READ];
+		if(timeout > 0){
+			deadline = _UringNowMs() + timeout;
+			wait = timeout;
+		}
+	}
+	return read_p - (uint8_t *)rx;
+}
+
+/**
+ * @brief 同 uart_Read，等可读和读一次提交
+ */
+ssize_t uart_UringRead(UartUring *u, void *data_buf, size_t buf_size, int timeout){
+	/* 不等待的读直接读，省得和超时抢 */
+	if(timeout == 0) return uart_Read(u->fd, data_buf, buf_size, 0);
+	return uart_UringWriteRead(u, NULL, 0, data_buf, buf_size, timeout);
+}
+
+#else
+
+UartUring *uart_UringOpen(int fd){
+	(void)fd;
+	return NULL;
+}
+
+void uart_UringClose(UartUring *u){
+	(void)u;
+}
+
+ssize_t uart_UringWriteRead(UartUring *u, const void *tx, size_t tx_len, void *rx, size_t rx_len, int timeout){
+	(void)u; (void)tx; (void)tx_len; (void)rx; (void)rx_len; (void)timeout;
+	return -1;
+}
+
+ssize_t uart_UringRead(UartUring *u, void *data_buf, size_t buf_size, int timeout){
+	(void)u; (void)data_buf; (void)buf_size; (void)timeout;
+	return -1;
+}
+
+#endif /* PP_UART_URING */
@@ -0,0 +1,191 @@
+/**
+ * @file reactor.c
+ * @brief 单线程事件循环，epoll 等待fd和timerfd定时器
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ *
+ * @par 修改日志:
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "reactor.h"
+
+#define REACTOR_EVENTS          8
+
+static int _SrcAlloc(Reactor *r){
+    int i;
+    for(i = 0; i < REACTOR_SRC_MAX; i++){
+        if(r->src[i].fd < 0) return i;
+    }
+    return -1;
+}
+
+static int _SrcAdd(Reactor *r, int fd, uint32_t events){
+    struct epoll_event ev;
+    int id = _SrcAlloc(r);
+
+    if(id < 0) return -1;
+    /* 同一批事件里可能还有这个id上一个源的事件，带上代数让 Reactor_Run 认出来跳过 */
+    r->src[id].gen++;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = (uint64_t)(uint32_t)id | (uint64_t)r->src[id].gen << 32;
+    if(epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) return -1;
+    r->src[id].fd = fd;
+    return id;
+}
+
+/**
+ * @brief 创建事件循环
+ * @param  r                事件循环
+ * @return int              成功0 失败负数
+ */
+int Reactor_Open(Reactor *r){
+    int i;
+    memset(r, 0, sizeof(Reactor));
+    for(i = 0; i < REACTOR_SRC_MAX; i++) r->src[i].fd = -1;
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    return r->epfd < 0 ? -1 : 0;
+}
+
+/**
+ * @brief 关闭事件循环和它创建的定时器，AddFd 加进来的fd由调用者自己关闭
+ */
+void Reactor_Close(Reactor *r){
+    int i;
+    for(i = 0; i < REACTOR_SRC_MAX; i++){
+        if(r->src[i].fd >= 0) Reactor_Del(r, i);
+    }
+    if(r->epfd >= 0) close(r->epfd);
+    r->epfd = -1;
+}
+
+/**
+ * @brief 等待一个fd，水平触发，回调里不把数据读完会马上再次回调
+ * @param  r                事件循环
+ * @param  fd               文件描述符
+ * @param  events           EPOLLIN 等
+ * @param  cb               回调
+ * @param  arg              回调参数
+ * @return int              成功返回id 失败负数
+ */
+int Reactor_AddFd(Reactor *r, int fd, uint32_t events, ReactorFdCb cb, void *arg){
+    int id;
+    if(fd < 0 || cb == NULL) return -1;
+    id = _SrcAdd(r, fd, events);
+    if(id < 0) return -1;
+    r->src[id].is_timer = 0;
+    r->src[id].fd_cb = cb;
+    r->src[id].arg = arg;
+    return id;
+}
+
+/**
+ * @brief 添加周期定时器，按单调时钟的绝对周期到期，回调耗时不会让后面的周期往后漂
+ * @param  r                事件循环
+ * @param  period_us        周期 微秒，0:先不启动，之后用 Reactor_SetTimer 启动
+ * @param  cb               回调
+ * @param  arg              回调参数
+ * @return int              成功返回id 失败负数
+ */
+int Reactor_AddTimer(Reactor *r, uint32_t period_us, ReactorTimerCb cb, void *arg){
+    int fd, id;
+    if(cb == NULL) return -1;
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(fd < 0) return -1;
+    id = _SrcAdd(r, fd, EPOLLIN);
+    if(id < 0){
+        close(fd);
+        return -1;
+    }
+    r->src[id].is_timer = 1;
+    r->src[id].timer_cb = cb;
+    r->src[id].arg = arg;
+    if(Reactor_SetTimer(r, id, period_us, period_us) < 0){
+        Reactor_Del(r, id);
+        return -1;
+    }
+    return id;
+}
+
+/**
+ * @brief 重新设置定时器
+ * @param  r                事件循环
+ * @param  id               Reactor_AddTimer 的返回值
+ * @param  delay_us         多久后第一次到期 微秒，0:停止
+ * @param  period_us        之后的周期 微秒，0:只到期一次
+ * @return int              成功0 失败负数
+ */
+int Reactor_SetTimer(Reactor *r, int id, uint32_t delay_us, uint32_t period_us){
+    struct itimerspec its;
+    if(id < 0 || id >= REACTOR_SRC_MAX || r->src[id].fd < 0 || !r->src[id].is_timer) return -1;
+    its.it_value.tv_sec = delay_us / 1000000;
+    its.it_value.tv_nsec = (long)(delay_us % 1000000) * 1000L;
+    its.it_interval.tv_sec = period_us / 1000000;
+    its.it_interval.tv_nsec = (long)(period_us % 1000000) * 1000L;
+    return timerfd_settime(r->src[id].fd, 0, &its, NULL) < 0 ? -1 : 0;
+}
+
+/**
+ * @brief 移除fd或定时器，可以在回调中调用
+ */
+int Reactor_Del(Reactor *r, int id){
+    if(id < 0 || id >= REACTOR_SRC_MAX || r->src[id].fd < 0) return -1;
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, r->src[id].fd, NULL);
+    if(r->src[id].is_timer) close(r->src[id].fd);
+    r->src[id].fd = -1;
+    return 0;
+}
+
+/**
+ * @brief 运行事件循环，直到 Reactor_Stop
+ * @return int              Reactor_Stop 退出返回0 epoll出错返回-1
+ */
+int Reactor_Run(Reactor *r){
+    struct epoll_event ev[REACTOR_EVENTS];
+    ReactorSrc *src;
+    uint64_t expired;
+    uint32_t id;
+    int n, i;
+
+    while(!r->stop){
+        n = epoll_wait(r->epfd, ev, REACTOR_EVENTS, -1);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        r->stat.wakeups++;
+        for(i = 0; i < n && !r->stop; i++){
+            id = (uint32_t)ev[i].data.u64;
+            src = &r->src[id];
+            /* 同一批里前面的回调可能已经把它删掉了，或者删掉后又把id给了新加的源 */
+            if(src->fd < 0 || src->gen != (uint32_t)(ev[i].data.u64 >> 32)) continue;
+            if(!src->is_timer){
+                r->stat.fd_events++;
+                src->fd_cb(r, src->fd, ev[i].events, src->arg);
+                continue;
+            }
+            if(read(src->fd, &expired, sizeof(expired)) != (ssize_t)sizeof(expired)) continue;
+            r->stat.timer_events++;
+            if(expired > 1) r->stat.timer_late++;
+            src->timer_cb(r, (int)id, expired, src->arg);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief 让 Reactor_Run 在当前回调返回后退出，可以在回调或信号处理中调用
+ */
+void Reactor_Stop(Reactor *r){
+    r->stop = 1;
+}
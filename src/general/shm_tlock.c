@@ -0,0 +1,175 @@
+/**
+ * @file shm_tlock.c
+ * @brief 放在共享内存中的跨进程排队锁(ticket lock)
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ *
+ * @par 修改日志:
+ */
+
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shm_tlock.h"
+
+static int _FutexWait(uint32_t *addr, uint32_t val, uint32_t timeout_ms){
+    struct timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+    /* 跨进程共享，不能用 FUTEX_PRIVATE_FLAG */
+    return (int)syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void _FutexWakeAll(uint32_t *addr){
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* 轮到票 s 了，叫醒在它的槽上等待的进程 */
+static void _WakeTicket(ShmTLockShared *sh, uint32_t s){
+    ShmTLockSlot *slot = &sh->slot[s % SHM_TLOCK_SLOTS];
+    __atomic_fetch_add(&slot->wake, 1, __ATOMIC_SEQ_CST);
+    _FutexWakeAll(&slot->wake);
+}
+
+/**
+ * @brief 打开(不存在则创建)锁文件并映射，新建的文件全0就是未加锁状态
+ * @param  l                锁
+ * @param  path             锁文件路径，一般在 /dev/shm 下
+ * @return int              成功0 失败负数
+ */
+int ShmTLock_Open(ShmTLock *l, const char *path){
+    struct stat st;
+    void *p;
+    int fd;
+
+    fd = open(path, O_CREAT | O_RDWR | O_CLOEXEC, 0666);
+    if(fd < 0) return -1;
+    if(fstat(fd, &st) < 0) goto error;
+    /* 多个进程同时创建时都截到同样大小，不会破坏已有内容 */
+    if((size_t)st.st_size < sizeof(ShmTLockShared) && ftruncate(fd, sizeof(ShmTLockShared)) < 0)
+        goto error;
+    p = mmap(NULL, sizeof(ShmTLockShared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(p == MAP_FAILED) goto error;
+    l->fd = fd;
+    l->sh = (ShmTLockShared *)p;
+    l->ticket = 0;
+    return 0;
+error:
+    close(fd);
+    return -1;
+}
+
+void ShmTLock_Close(ShmTLock *l){
+    if(l->sh == NULL) return;
+    munmap(l->sh, sizeof(ShmTLockShared));
+    close(l->fd);
+    l->sh = NULL;
+    l->fd = -1;
+}
+
+#define REG_TICKET(reg)         ((uint32_t)((reg) >> 32))
+#define REG_PID(reg)            ((int32_t)(uint32_t)(reg))
+
+static int _PidDead(int32_t pid){
+    return pid > 0 && kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+/**
+ * @brief 正在服务的票 s 的主人是否已经死掉
+ *        只有登记了票 s 并且进程已经不在的才算，票号对不上时不能说明什么，不算
+ */
+static int _TicketDead(ShmTLockShared *sh, uint32_t s){
+    uint64_t reg = __atomic_load_n(&sh->slot[s % SHM_TLOCK_SLOTS].reg, __ATOMIC_ACQUIRE);
+    return REG_TICKET(reg) == s && _PidDead(REG_PID(reg));
+}
+
+/**
+ * @brief 取票: 先在票对应的槽上登记自己，再把 next 往后推，发出去的票都有登记
+ *        排队的已经有 SHM_TLOCK_SLOTS 个时槽位还被占着，等前面的放锁
+ */
+static uint32_t _TakeTicket(ShmTLockShared *sh){
+    struct timespec ts = { 0, SHM_TLOCK_FULL_WAIT_US * 1000L };
+    uint32_t pid = (uint32_t)getpid();
+    ShmTLockSlot *slot;
+    uint64_t old, reg;
+    uint32_t n;
+
+    while(1){
+        n = __atomic_load_n(&sh->next, __ATOMIC_SEQ_CST);
+        if(n - __atomic_load_n(&sh->serving, __ATOMIC_SEQ_CST) >= SHM_TLOCK_SLOTS){
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        slot = &sh->slot[n % SHM_TLOCK_SLOTS];
+        old = __atomic_load_n(&slot->reg, __ATOMIC_ACQUIRE);
+        /* 槽上可以是从没用过的、上一轮已经服务完的票，或者登记了这张票却没来得及发就死掉的进程 */
+        if(!(REG_PID(old) == 0 || REG_TICKET(old) == n - SHM_TLOCK_SLOTS ||
+            (REG_TICKET(old) == n && _PidDead(REG_PID(old))))){
+            sched_yield();
+            continue;
+        }
+        reg = (uint64_t)n << 32 | pid;
+        if(!__atomic_compare_exchange_n(&slot->reg, &old, reg, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            continue;
+        if(__atomic_compare_exchange_n(&sh->next, &n, n + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return n;
+        /* 读到的 next 已经过时，这张票早就发给别人了，把登记还回去 */
+        __atomic_compare_exchange_n(&slot->reg, &reg, old, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * @brief 加锁，按取票顺序获得锁
+ *        不竞争时只有几次原子操作，排队时在自己票的槽上 futex 等待，放锁时只唤醒下一张票，
+ *        每 SHM_TLOCK_CHECK_MS 检查一次当前票的主人，死掉了就替它放掉
+ * @param  l                锁
+ * @return int              成功0
+ */
+int ShmTLock_Lock(ShmTLock *l){
+    ShmTLockShared *sh = l->sh;
+    ShmTLockSlot *slot;
+    uint32_t t, s, w;
+
+    t = _TakeTicket(sh);
+    slot = &sh->slot[t % SHM_TLOCK_SLOTS];
+
+    while(1){
+        /* 先取唤醒计数再看 serving，放锁的人在两者之间改了 serving 也会改计数，不会漏掉 */
+        w = __atomic_load_n(&slot->wake, __ATOMIC_SEQ_CST);
+        s = __atomic_load_n(&sh->serving, __ATOMIC_SEQ_CST);
+        if(s == t) break;
+        if(_FutexWait(&slot->wake, w, SHM_TLOCK_CHECK_MS) == 0 || errno != ETIMEDOUT)
+            continue;
+        if(_TicketDead(sh, s) &&
+            __atomic_compare_exchange_n(&sh->serving, &s, s + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            _WakeTicket(sh, s + 1);
+    }
+    l->ticket = t;
+    return 0;
+}
+
+/**
+ * @brief 解锁，没人排队时不进内核
+ */
+void ShmTLock_Unlock(ShmTLock *l){
+    ShmTLockShared *sh = l->sh;
+    uint32_t s = l->ticket + 1;
+
+    /* 先放锁再看有没有人排队，两步之间不能重排，否则可能漏掉唤醒 */
+    __atomic_store_n(&sh->serving, s, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&sh->next, __ATOMIC_SEQ_CST) != s)
+        _WakeTicket(sh, s);
+}
@@ -0,0 +1,35 @@
+/**
+ * @file bench.h
+ * @brief 不依赖硬件的性能测试
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ * 
+ * @par 修改日志:
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include "run.h"
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C"{
+#endif
+#endif /* __cplusplus */
+
+extern int bench_frame(RunConfig *config);
+extern int bench_lock(RunConfig *config);
+extern int bench_ack(RunConfig *config);
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif
+#endif /* __cplusplus */
+
+
+#endif // _BENCH_H_
@@ -0,0 +1,120 @@
+/**
+ * @file mcu_sim.h
+ * @brief 软件模拟的MCU，作为 SpiTrans 的一种实现，不需要板子就能跑 spi_reg/regwr_cb/rearview_mcu
+ *        实现了寄存器读写协议(V1/V2/流水线)、CRC、CBREG_XXX 环形缓冲区、MpuBusinessReg 和烧写状态机，
+ *        发出去的CAN报文默认原样回到接收缓冲区
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ *
+ * @par 修改日志:
+ */
+
+#ifndef _MCU_SIM_H_
+#define _MCU_SIM_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "spi_frame.h"
+#include "spi_trans.h"
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C"{
+#endif
+#endif /* __cplusplus */
+
+#define MCU_SIM_REG_SPACE       0x10000     /* 16位寄存器地址空间 */
+#define MCU_SIM_RING_CNT        3
+#define MCU_SIM_RING_SIZE       4096
+#define MCU_SIM_UART_BUF        256
+#define MCU_SIM_MSG_MAX         65536       /* 一次SPI消息的最大长度 */
+#define MCU_SIM_NAME            "mcu_sim"
+#define MCU_SIM_IMPAIR_ENV      "RVMCU_SIM_IMPAIR"  /* 如 "seed=1,delay=200,jitter=300,drop=2000,flip=1000,stall=50" */
+
+/* 链路损伤，概率的单位是百万分之一，同一个seed每次运行得到相同的损伤序列 */
+typedef struct _McuSimImpair{
+    uint64_t                seed;
+    uint32_t                ack_delay_us;   /* 串口回复的固定延时 */
+    uint32_t                ack_jitter_us;  /* 在固定延时上再随机加 0~jitter */
+    uint32_t                ack_drop_ppm;   /* 每个回复字节丢失的概率 */
+    uint32_t                flip_ppm;       /* 每次SPI消息翻转一个bit的概率 */
+    uint32_t                erase_stall_ms; /* 擦除flash期间MCU忙，回复推迟到擦除结束 */
+}McuSimImpair;
+
+/* 环形缓冲区，对应MCU的 common_ringbuffer */
+typedef struct _McuSimRing{
+    uint16_t                cb_addr;        /* CBREG 寄存器起始地址 */
+    uint32_t                head;           /* 读位置 */
+    uint32_t                used;
+    uint8_t                 buf[MCU_SIM_RING_SIZE];
+}McuSimRing;
+
+/* MCU侧的协议状态 */
+typedef enum _McuSimState{
+    MCU_SIM_IDLE,                   /* 等握手 */
+    MCU_SIM_WAIT_CMD,               /* 'S'之后等命令 */
+    MCU_SIM_WAIT_DATA,              /* V1协议收到命令，等数据 */
+    MCU_SIM_PIPE,                   /* 'P'之后每次消息都是命令+数据 */
+    MCU_SIM_QUIET,                  /* 'Q'之后等一帧V2，不回任何ACK */
+}McuSimState;
+
+typedef struct _McuSimStat{
+    uint64_t                frames;
+    uint64_t                nacks;          /* CRC错误或者长度不对 */
+    uint64_t                bytes;
+    uint64_t                can_tx;         /* MPU发出的CAN报文 */
+    uint64_t                burn_bytes;     /* 当前这次烧写收到的固件长度 */
+    uint32_t                resets;
+    uint64_t                ack_drops;      /* 以下为损伤的次数 */
+    uint64_t                flips;
+    uint64_t                stalls;
+    uint64_t                notifies;       /* 发出的 SPI_NOTIFY */
+}McuSimStat;
+
+typedef struct _McuSim{
+    pthread_mutex_t         mutex;
+    McuSimState             state;
+    uint8_t                 tag_start;      /* 收到'T'/'U'，下一个字节是序号, 0没有 */
+    uint8_t                 tag;            /* 当前帧ACK带的序号, SPI_TAG_NONE 不带 */
+    uint8_t                 status_ack;     /* 当前帧最后的ACK带上CAN环形缓冲区的水位 */
+    uint8_t                 notify_armed;   /* 接收缓冲区低于通知水位后才能再通知 */
+    uint8_t                 cmd[SPI_CMD_LEN];
+    uint8_t                 uart_out[MCU_SIM_UART_BUF];     /* 发给MPU还没读走的字节 */
+    uint64_t                uart_out_at[MCU_SIM_UART_BUF];  /* 每个字节可以被读到的时间(ns) */
+    int                     uart_out_len;
+    int                     impaired;
+    McuSimImpair            impair;
+    uint64_t                rng;
+    uint64_t                busy_until;     /* 擦除结束的时间(ns) */
+    int                     can_loopback;   /* 发出的CAN报文放回接收缓冲区 */
+    McuSimRing              ring[MCU_SIM_RING_CNT];
+    McuSimStat              stat;
+    uint8_t                 tx[MCU_SIM_MSG_MAX];
+    uint8_t                 rx[MCU_SIM_MSG_MAX];
+    uint8_t                 reg[MCU_SIM_REG_SPACE];
+}McuSim;
+
+extern McuSim *McuSim_New(void);
+extern void McuSim_Free(McuSim *sim);
+extern void McuSim_UartWrite(McuSim *sim, const uint8_t *data, int len);
+extern int McuSim_UartRead(McuSim *sim, uint8_t *buf, int len);
+extern int64_t McuSim_UartWaitUs(McuSim *sim);
+extern void McuSim_UartInClean(McuSim *sim);
+extern int McuSim_Xfer(McuSim *sim, struct spi_ioc_transfer *xfer, int n);
+extern int McuSim_InjectCan(McuSim *sim, const void *can_msg, uint32_t len);
+extern void McuSim_GetStat(McuSim *sim, McuSimStat *stat);
+extern int McuSim_ParseImpair(const char *str, McuSimImpair *imp);
+extern void McuSim_SetImpair(McuSim *sim, const McuSimImpair *imp);
+extern int SpiTrans_OpenSim(SpiTrans *t);
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif
+#endif /* __cplusplus */
+
+
+#endif // _MCU_SIM_H_
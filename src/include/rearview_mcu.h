@@ -20,6 +20,7 @@
 #include "mcu-reg/mpu-business.h"
 #include "mcu-reg/boot-info.h"
 #include "can-msg.h"
+#include "spi_reg.h"
 
 #ifdef __cplusplus
 #if __cplusplus
@@ -46,6 +47,11 @@ extern int RVMcu_SendCanMsg(PCanMsg *can_msg, uint32_t timeout);
 /* 寄存器读写接口 */
 extern int RVMcu_WriteReg(uint16_t reg_addr, const uint8_t *reg_data, uint16_t reg_cnt, uint32_t timeout);
 extern int RVMcu_ReadReg(uint16_t reg_addr,  uint8_t *reg_data, uint16_t reg_cnt, uint32_t timeout);
+extern int RVMcu_WriteRegEx(uint16_t reg_addr, const uint8_t *reg_data, uint16_t reg_cnt, uint32_t timeout, int prio);
+extern int RVMcu_ReadRegEx(uint16_t reg_addr,  uint8_t *reg_data, uint16_t reg_cnt, uint32_t timeout, int prio);
+extern int RVMcu_Transact(SpiRegOp *ops, int n, uint32_t timeout);
+extern int RVMcu_TransactEx(SpiRegOp *ops, int n, uint32_t timeout, int prio);
+extern int RVMcu_GetPrioStat(int prio, SpiRegPrioStat *stat);
 
 /* 烧写相关接口 */
 extern int RVMcu_BurnMcu(const char* mcu_firmware_path);
@@ -64,6 +70,28 @@ extern int RVMcu_CleanNvm(int nvm_index );
 extern int RVMcu_ShanQiProductionDate(uint8_t production_date[4]);
 extern int RVMcu_ShanQiCmsMsgSet(uint8_t msg_data[8]);
 
+extern int RVMcu_SetSpiProto(int proto_ver);   /* 1:V1协议 2:V2协议 */
+extern int RVMcu_SetLockMode(int mode);        /* SPIREG_LOCK_XXX, 所有进程需一致 */
+extern int RVMcu_SetPipeline(int depth);        /* 需先设置V2协议, 1为关闭 */
+extern int RVMcu_SetAckless(int enable);       /* 需先设置V2协议 */
+extern int RVMcu_GetAckless(SpiRegAckless *stat);
+extern int RVMcu_SetTaggedAck(int enable);
+extern int RVMcu_GetTransCnt(SpiTransCnt *cnt);
+extern int RVMcu_SetStatusAck(uint32_t fresh_us);  /* 微秒 */
+extern int RVMcu_SetCanNotify(uint8_t watermark);  /* CAN报文帧数 0:关闭 */
+extern int RVMcu_WaitCanNotify(uint32_t timeout);
+extern int RVMcu_GetCanNotifyFd(void);              /* 给epoll等待, -1:没有fd */
+extern int RVMcu_SetAckSpin(uint32_t spin_us);  /* 微秒 */
+extern int RVMcu_SetAdaptiveSpeed(int enable, const char *persist_path);
+extern uint32_t RVMcu_GetSpiSpeed(uint32_t *crc_errs, uint32_t *timeouts);       /* 返回当前时钟Hz, 使用代理时返回0 */
+extern int RVMcu_GetLatency(int op, int stage, LatHist *hist, int reset);     /* SPIREG_OP_XXX, SPIREG_STAGE_XXX */
+
+extern void RVMcu_SetFrameSize(uint32_t frame_size);   /* 需在RVMcu_Init前调用 */
+extern void RVMcu_SetBroker(int enable);              /* 需在RVMcu_Init前调用 */
+extern void RVMcu_SetSim(int enable);                 /* 需在RVMcu_Init前调用 */
+extern void RVMcu_SetCapture(const char *path);       /* 需在RVMcu_Init前调用 */
+extern void RVMcu_SetStats(int enable);               /* 需在RVMcu_Init前调用 */
+
 extern int RVMcu_Init(void);
 extern void RVMcu_Exit(void);
 
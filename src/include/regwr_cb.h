@@ -39,6 +39,23 @@ typedef struct _RegWrCbHandle{
     */
     int (*write_reg)(uint16_t addr, const uint8_t *data, uint16_t data_len, uint32_t timeout);
     int (*read_reg)(uint16_t addr, uint8_t *data, uint16_t data_len, uint32_t timeout);
+    /**
+    * @brief  读到容量时通知，可以为NULL
+    * @param  cb_addr          环形缓冲区 寄存器起始地址
+    * @param  is_free          1:可用容量 0:已用容量
+    * @param  size             容量
+    */
+    void (*size_report)(uint16_t cb_addr, int is_free, uint32_t size);
+    /**
+    * @brief  读写前先问这里要容量，有就不再读容量寄存器，可以为NULL
+    *         给出的值只能比实际的小，所以只适用于MCU只往里放的接收缓冲区和MCU只往外取的发送缓冲区，
+    *         并且调用者要保证同一个缓冲区的读写只有一个使用者，不会两个读写共用同一个值
+    * @param  cb_addr          环形缓冲区 寄存器起始地址
+    * @param  is_free          1:可用容量 0:已用容量
+    * @param  size             输出容量
+    * @return int              有返回0 没有返回负数
+    */
+    int (*cached_size)(uint16_t cb_addr, int is_free, uint32_t *size);
 }RegWrCbHandle;
 
 extern int RegWrCb_Size(RegWrCbHandle *h, uint16_t cb_addr, uint32_t timeout);
@@ -21,7 +21,7 @@
  #endif
  #endif /* __cplusplus */
 
-#define WR_BUF_MAX 1024
+#define WR_BUF_MAX 8192
 
 enum RUN_FUN{
     FUN_MPU_ONLINE, 
@@ -43,8 +43,16 @@ enum RUN_FUN{
     FUN_CLEAN_NVM,
     FUN_CAN_ECHO_TEST,
     FUN_WRITE_SHANQI_PRODUCTION_DATE,
+    FUN_BENCH_FRAME,
+    FUN_BENCH_LOCK,
+    FUN_BENCH_ACK,
+    FUN_STATS,
 };
 
+/* 这些模式不需要访问MCU */
+#define RUN_FUN_NO_MCU(mode)    ((mode) == FUN_BENCH_FRAME || (mode) == FUN_BENCH_LOCK || \
+                                 (mode) == FUN_BENCH_ACK || (mode) == FUN_STATS)
+
 typedef struct _RunConfig{
     uint8_t       wr_buf[WR_BUF_MAX];
     uint32_t      reg_addr;            /* 当发送can报文时为CAN ID */
@@ -55,6 +63,27 @@ typedef struct _RunConfig{
     uint32_t      clean_dtc;
     uint32_t      clean_nvm;
     int           mcu_debug_level;
+    int           spi_proto;
+    int           pipeline;
+    int           is_ackless;
+    int           ack_spin_us;
+    int           is_tag_ack;
+    int           status_ack_us;
+    int           can_notify;
+    uint32_t      bench_ack;
+    uint32_t      frame_size;
+    uint32_t      bench_frame;
+    uint32_t      bench_lock;
+    uint32_t      stats_interval;
+    uint32_t      status_interval;
+    int           is_wdog_feed;
+    int           is_verify;
+    int           is_shm_lock;
+    int           is_adaptive_speed;
+    const char   *speed_file;
+    int           is_latency;
+    int           is_sim;
+    const char   *capture;
     int           is_write;
     int           is_show_mcu_info;
     int           is_look_dtc;
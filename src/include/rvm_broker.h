@@ -0,0 +1,113 @@
+/**
+ * @file rvm_broker.h
+ * @brief MCU访问代理: 由一个守护进程独占 SpiRegHandle，其他进程通过它访问MCU
+ *        控制走Unix socket，连接时代理创建一块共享内存(memfd)并把fd传给客户端，
+ *        之后的请求和应答都在共享内存中完成:
+ *          客户端填好槽位 -> 槽号放进请求环 -> 敲门铃(futex)
+ *          代理执行完把结果写回槽位 -> 改槽位状态并唤醒(futex)
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ *
+ * @par 修改日志:
+ */
+
+#ifndef _RVM_BROKER_H_
+#define _RVM_BROKER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "spi_reg.h"
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C"{
+#endif
+#endif /* __cplusplus */
+
+#define RVMB_SOCK_PATH          "/run/rvm_broker.sock"
+#define RVMB_SOCK_ENV           "RVMB_SOCK"         /* 环境变量可以改socket路径 */
+#define RVMB_NO_BROKER_ENV      "RVMCU_NO_BROKER"   /* 设置后 RVMcu_Init 不尝试连接代理 */
+#define RVMB_MAGIC              0x524d4231          /* "RMB1" */
+
+#define RVMB_SLOTS              8                   /* 每个客户端同时进行的请求数 */
+#define RVMB_MAX_OPS            32                  /* 一个槽位里批量操作的最大数量 */
+/* 每个请求的数据区，装得下16位 reg_cnt 的任意读写，以及一整组批量操作的描述 */
+#define RVMB_DATA_MAX           (0x10000 + RVMB_MAX_OPS * 16)
+#define RVMB_WAIT_MARGIN_MS     1000                /* 客户端在请求超时之外多等的时间 */
+
+/* 槽位状态，也是客户端等待的futex字 */
+#define RVMB_SLOT_FREE          0
+#define RVMB_SLOT_FILL          1                   /* 客户端正在填写 */
+#define RVMB_SLOT_REQ           2                   /* 已提交，等代理取走 */
+#define RVMB_SLOT_BUSY          3                   /* 代理正在执行 */
+#define RVMB_SLOT_DONE          4                   /* 结果已写回 */
+#define RVMB_SLOT_ABANDON       5                   /* 客户端等超时放弃了，代理做完后直接释放 */
+
+#define RVMB_OP_READ            0
+#define RVMB_OP_WRITE           1
+#define RVMB_OP_TRANSACT        2
+
+/* 批量操作中每个操作的描述，数据按顺序紧跟在描述数组后面 */
+typedef struct _RvmbOp{
+    uint8_t                 type;           /* SPIREG_OP_XXX */
+    uint8_t                 flags;          /* SPIREG_OPF_XXX */
+    uint16_t                reg_addr;
+    uint16_t                reg_cnt;
+    int32_t                 ret;
+}RvmbOp;
+
+typedef struct _RvmbSlot{
+    uint32_t                state;          /* RVMB_SLOT_XXX */
+    uint8_t                 op;             /* RVMB_OP_XXX */
+    uint8_t                 prio;           /* SpiRegPrio */
+    uint16_t                reg_addr;
+    uint16_t                reg_cnt;        /* 读写的长度，批量操作时是操作数量 */
+    uint32_t                timeout;
+    int32_t                 ret;
+    uint8_t                 data[RVMB_DATA_MAX];
+}RvmbSlot;
+
+/* 共享内存布局 */
+typedef struct _RvmbShared{
+    uint32_t                magic;
+    uint32_t                doorbell;       /* 客户端提交后加1, 代理在这上面futex等待 */
+    uint32_t                req_head;       /* 客户端写 */
+    uint32_t                req_tail;       /* 代理写 */
+    uint32_t                slot_free;      /* 释放槽位时加1, 没有空闲槽位的客户端在这上面futex等待 */
+    uint32_t                slot_waiters;   /* 在 slot_free 上等待的线程数，没人等时释放不用进内核 */
+    uint32_t                req_ring[RVMB_SLOTS];
+    RvmbSlot                slot[RVMB_SLOTS];
+}RvmbShared;
+
+/* 建立连接时代理回复的内容，随后用 SCM_RIGHTS 带上共享内存fd */
+typedef struct _RvmbHello{
+    uint32_t                magic;
+    uint32_t                shm_size;
+}RvmbHello;
+
+typedef struct _RvmbClient{
+    int                     sock_fd;
+    RvmbShared              *sh;
+    pthread_mutex_t         mutex;          /* 客户端多线程提交时保护请求环 */
+}RvmbClient;
+
+extern const char *RvmBroker_SockPath(void);
+extern int RvmBroker_Connect(RvmbClient *c);
+extern void RvmBroker_Close(RvmbClient *c);
+extern int RvmBroker_Read(RvmbClient *c, uint16_t reg_addr, uint8_t *reg_data, uint16_t reg_cnt,
+    uint32_t timeout, SpiRegPrio prio);
+extern int RvmBroker_Write(RvmbClient *c, uint16_t reg_addr, const uint8_t *reg_data, uint16_t reg_cnt,
+    uint32_t timeout, SpiRegPrio prio);
+extern int RvmBroker_Transact(RvmbClient *c, SpiRegOp *ops, int n, uint32_t timeout, SpiRegPrio prio);
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif
+#endif /* __cplusplus */
+
+
+#endif // _RVM_BROKER_H_
@@ -0,0 +1,89 @@
+/**
+ * @file rvm_stats.h
+ * @brief MCU通信的实时统计页，放在共享内存中，监控程序只读映射就能看，不用访问SPI
+ *        同一设备的所有进程累加到同一页，每个计数器单独原子更新，写者之间不加锁，
+ *        SPI路径上记统计不会因为别的进程停在写统计的中途而阻塞；读者逐个原子读，不阻塞写者
+ *        统计页默认不打开，需要 RVMcu_SetStats 或者设置环境变量 RVMCU_STATS
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ *
+ * @par 修改日志:
+ */
+
+#ifndef _RVM_STATS_H_
+#define _RVM_STATS_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C"{
+#endif
+#endif /* __cplusplus */
+
+#define RVMS_PATH               "/dev/shm/rvm_stats"
+#define RVMS_PATH_ENV           "RVMCU_STATS"       /* 环境变量可以改统计页路径 */
+#define RVMS_MAGIC              0x524d5331          /* "RMS1" */
+#define RVMS_VERSION            2                   /* 布局改变时加1, 版本不同的页不使用 */
+#define RVMS_RING_MAX           4                   /* 最多统计的环形缓冲区数量 */
+
+/* 环形缓冲区的水位，来自 RegWrCb_Size / RegWrCb_FreeSize, 都是64位方便原子操作 */
+typedef struct _RvmsRing{
+    uint64_t                cb_addr;        /* 0为未使用，第一个写者用CAS占用 */
+    uint64_t                used;           /* 最近一次看到的已用容量 */
+    uint64_t                free;           /* 最近一次看到的可用容量 */
+    uint64_t                used_max;
+    uint64_t                samples;
+}RvmsRing;
+
+typedef struct _RvmsCounters{
+    uint64_t                frames_read;
+    uint64_t                frames_write;
+    uint64_t                bytes_read;     /* 成功的帧的寄存器字节数 */
+    uint64_t                bytes_write;
+    uint64_t                crc_errs;
+    uint64_t                timeouts;
+    uint64_t                errors;         /* 其他错误 */
+    uint64_t                lock_cnt;
+    uint64_t                lock_wait_ns;   /* 等总线锁的总时间 */
+    uint64_t                lock_wait_max_ns;
+    uint64_t                can_rx;         /* 收到的CAN报文 */
+    uint64_t                can_tx;         /* 发出的CAN报文 */
+    uint64_t                update_ns;      /* 最后一次更新的时间 CLOCK_MONOTONIC */
+    RvmsRing                ring[RVMS_RING_MAX];
+}RvmsCounters;
+
+typedef struct _RvmsPage{
+    uint32_t                magic;
+    uint32_t                version;
+    uint32_t                size;           /* sizeof(RvmsPage) */
+    uint32_t                reserve;
+    RvmsCounters            c;
+}RvmsPage;
+
+typedef struct _RvmStats{
+    int                     fd;
+    RvmsPage                *page;          /* NULL 为没有打开，此时记录函数什么都不做 */
+}RvmStats;
+
+extern const char *RvmStats_Path(void);
+extern int RvmStats_Open(RvmStats *s, int read_only);
+extern void RvmStats_Close(RvmStats *s);
+extern int RvmStats_Snapshot(RvmStats *s, RvmsCounters *out);
+
+extern void RvmStats_Frame(RvmStats *s, int is_write, uint32_t bytes, int ret);
+extern void RvmStats_LockWait(RvmStats *s, uint64_t wait_ns);
+extern void RvmStats_Ring(RvmStats *s, uint16_t cb_addr, int is_free, uint32_t size);
+extern void RvmStats_Can(RvmStats *s, uint32_t rx, uint32_t tx);
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif
+#endif /* __cplusplus */
+
+
+#endif // _RVM_STATS_H_
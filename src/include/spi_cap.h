@@ -0,0 +1,79 @@
+/**
+ * @file spi_cap.h
+ * @brief 链路抓包: 包在任意 SpiTrans 外面，把每个串口字节和每次SPI消息的收发数据连同纳秒时间戳写进文件，
+ *        用 rvm_replay 离线解析出每次传输的时间线和各阶段耗时
+ *        文件格式: SpiCapFileHdr + 若干 (SpiCapRec + 数据)，全部是小端
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ *
+ * @par 修改日志:
+ */
+
+#ifndef _SPI_CAP_H_
+#define _SPI_CAP_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "spi_trans.h"
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C"{
+#endif
+#endif /* __cplusplus */
+
+#define SPI_CAP_MAGIC           0x50414352          /* "RCAP" */
+#define SPI_CAP_VERSION         1
+#define SPI_CAP_ENV             "RVMCU_CAPTURE"     /* 设置后 RVMcu_Init 把抓包写到这个文件 */
+#define SPI_CAP_FILE_BUF        (64 * 1024)         /* 文件缓冲，抓包不应该拖慢传输 */
+#define SPI_CAP_FLUSH_MS        1000                /* 距上次刷新超过这个时间，写完SPI记录后刷到文件 */
+
+/* 记录类型 */
+#define SPI_CAP_UART_TX         1       /* MPU写串口, 数据是写出的字节, arg是返回值 */
+#define SPI_CAP_UART_RX         2       /* MPU读串口, 数据是读到的字节(0个就是超时), arg是超时ms */
+#define SPI_CAP_UART_CLEAN      3       /* 清空串口输入 */
+#define SPI_CAP_SPI             4       /* 一次SPI消息, 数据是 tx[len] + rx[len], arg是返回值 */
+
+typedef struct _SpiCapFileHdr{
+    uint32_t                magic;
+    uint16_t                version;
+    uint16_t                rec_size;       /* sizeof(SpiCapRec) */
+    uint64_t                start_real_ns;  /* 开始抓包的墙上时间(CLOCK_REALTIME) */
+    uint32_t                max_msg;
+    char                    name[SPI_TRANS_NAME_LEN];
+}SpiCapFileHdr;
+
+typedef struct _SpiCapRec{
+    uint64_t                ts_ns;          /* 调用开始时间，相对抓包开始 */
+    uint32_t                dur_ns;         /* 调用耗时 */
+    uint32_t                len;            /* SPI记录是单向长度，后面的数据是 2*len */
+    int32_t                 arg;
+    uint16_t                type;           /* SPI_CAP_XXX */
+    uint16_t                speed_khz;      /* SPI时钟 */
+}SpiCapRec;
+
+/* 包装后的 SpiTrans.priv */
+typedef struct _SpiCap{
+    SpiTrans                inner;
+    FILE                    *fp;
+    uint64_t                start_ns;
+    uint64_t                flush_ns;       /* 上次刷到文件的时间 */
+    uint64_t                recs;
+    uint64_t                bytes;
+    pthread_mutex_t         mutex;          /* 一条记录的头和数据要连续写 */
+}SpiCap;
+
+extern int SpiCap_Wrap(SpiTrans *t, const char *path);
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif
+#endif /* __cplusplus */
+
+
+#endif // _SPI_CAP_H_
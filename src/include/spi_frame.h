@@ -0,0 +1,93 @@
+/**
+ * @file spi_frame.h
+ * @brief MPU与MCU寄存器读写协议的帧格式，发送端和解析端共用
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ * 
+ * @par 修改日志:
+ */
+#ifndef _SPI_FRAME_H_
+#define _SPI_FRAME_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C"{
+#endif
+#endif /* __cplusplus */
+
+#define SPI_CMD_READ_REG                (0x03)
+#define SPI_CMD_WRITE_REG               (0x06)
+#define SPI_CMD_READ_REG_V2             (0x13)      /* V2协议: 命令和数据在同一次SPI传输中 */
+#define SPI_CMD_WRITE_REG_V2            (0x16)
+#define SPI_ACK                         'A'
+#define SPI_NACK                        'N'
+#define SPI_CMD_START                   'S'
+#define SPI_DATA_START                  'D'
+#define SPI_CMD_PIPE_START              'P'         /* 开始一段流水线传输, 之后的帧不再单独握手 */
+#define SPI_CMD_QUIET_START             'Q'         /* 无ACK握手: MCU不回握手ACK，随后的一帧V2也不回ACK */
+#define SPI_CMD_TAG_START               'T'         /* 带序号握手: 后跟1字节序号，这一帧的所有ACK都是 [ACK/NACK, 序号] */
+#define SPI_NOTIFY                      'R'         /* MCU主动发的"有数据"通知，只在两帧之间串口空闲时发，见 MpuBusinessReg.uart_notify */
+#define SPI_CMD_TAG_PIPE_START          'U'         /* 带序号的流水线握手: 后跟1字节序号，握手ACK带这个序号 */
+
+/* 可用的总命令长度，没算'S' */
+#define SPI_CMD_LEN                         8
+
+/* 这里的命令偏移没计算 启动字节 START */
+#define CMD_1BYTE_OFFSET                    0
+#define CMD_WR_ADDR_2BYTE_OFFSET            1
+#define CMD_WR_LEN_2BYTE_OFFSET             3
+#define CMD_WR_CMD_LEN                      5
+#define CMD_SEQ_1BYTE_OFFSET                5       /* 流水线模式下的帧序号, 不参与crc */
+
+/* 带序号的ACK: ACK/NACK + 帧序号 */
+#define SPI_TAG_ACK_LEN                     2
+#define SPI_TAG_MASK                        0x7F
+#define SPI_TAG_NONE                        0xFF    /* 命令中没有序号 */
+/* 序号不能取 ACK/NACK/通知字节的值，否则错开一个字节找ACK时，迟到的'N'和本帧的'A'会被当成一个NACK */
+#define SPI_TAG_IS_CTRL(tag)                ((tag) == SPI_ACK || (tag) == SPI_NACK || (tag) == SPI_NOTIFY)
+/* 'T'握手的序号字节最高位置1时，这一帧最后的ACK后面再跟 SPI_STATUS_LEN 字节状态:
+ * CAN接收环形缓冲区已用字节、CAN发送环形缓冲区可用字节，是MCU处理完这一帧后的值。
+ * 每个值14位，拆成低7位、高7位两个字节，每个字节最高位置1, 这样状态字节不会和ACK/NACK/通知/序号相同，
+ * 迟到的带状态ACK按字节错开找时，状态里不会凑出本帧的 [ACK, 序号] */
+#define SPI_TAG_STATUS                      0x80
+#define SPI_STATUS_LEN                      4
+#define SPI_STATUS_MARK                     0x80
+#define SPI_STATUS_MAX                      0x3FFF  /* 超过的按这个值发 */
+
+#define WR_ACK_1BYTE_OFFSET                 0
+/* 这里的数据偏移没计算ACK字节 */
+#define WR_ACK_DATA_XBYTE_OFFSET            0
+#define WR_ACK_LEN                          1 
+#define WR_CRC_LEN                          2 
+#define WR_DATA_ALIGN_BYTE                  8  /* 传输数据时向8字节取整 */
+
+/* 数据段尾部(CRC+填充)的最大长度 */
+#define SPI_FRAME_TAIL_MAX                  (WR_CRC_LEN + WR_DATA_ALIGN_BYTE - 1)
+
+/* 数据段需要的传输长度(数据+CRC 再向8字节取整) */
+static inline size_t SpiFrame_DataLength(uint32_t reg_cnt){
+    size_t trans_length = reg_cnt + WR_CRC_LEN;
+    return trans_length + (WR_DATA_ALIGN_BYTE - trans_length%WR_DATA_ALIGN_BYTE) % WR_DATA_ALIGN_BYTE;
+}
+
+extern uint16_t SpiFrame_BuildCmd(uint8_t cmd_buf[SPI_CMD_LEN], uint8_t cmd, uint16_t reg_addr, uint16_t reg_cnt);
+extern void SpiFrame_BuildTail(uint8_t *tail_buf, size_t tail_len, const uint16_t *crc16_val);
+extern void SpiFrame_ParseCmd(const uint8_t cmd_buf[SPI_CMD_LEN], uint8_t *cmd, uint16_t *reg_addr, uint16_t *reg_cnt);
+extern uint16_t SpiFrame_GetTailCrc(const uint8_t *tail_buf);
+extern void SpiFrame_BuildStatus(uint8_t status[SPI_STATUS_LEN], uint32_t rx_used, uint32_t tx_free);
+extern int SpiFrame_ParseStatus(const uint8_t status[SPI_STATUS_LEN], uint16_t *rx_used, uint16_t *tx_free);
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif
+#endif /* __cplusplus */
+
+
+#endif // _SPI_FRAME_H_
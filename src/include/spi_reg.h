@@ -12,7 +12,20 @@
  #ifndef _SPI_REG_H_
  #define _SPI_REG_H_
 
-#define SPI_RT_MSG_MAX_SIZE 1024
+#include <stdint.h>
+#include <pthread.h>
+#include "spi_frame.h"
+#include "shm_tlock.h"
+#include "spi_trans.h"
+#include "lat_hist.h"
+#include "rvm_stats.h"
+
+#define SPI_RT_MSG_MAX_SIZE 1024         /* 默认一帧数据段的大小 */
+#define SPIREG_MAX_SEGS     16          /* 一次传输最多的数据分段 */
+#define SPIREG_PIPE_MAX_DEPTH   8       /* 流水线最多未确认的帧 */
+#define SPIREG_ACK_SPIN_MAX_US  10000   /* 等ACK忙等时间的上限 */
+#define SPIREG_FC_MAX_BATCH     32      /* 合并执行时一批最多的请求 */
+#define SPIREG_FC_MAX_ROUND     4       /* 合并者最多连续执行的批数, 避免一直替别人干活 */
 
 #ifdef __cplusplus
 #if __cplusplus
@@ -20,21 +33,247 @@ extern "C"{
 #endif
 #endif /* __cplusplus */
 
+typedef enum _SpiRegProto{
+    SPIREG_PROTO_V1 = 1,        /* 'S'握手 -> 命令 -> ACK -> 数据 -> ACK, 老固件只支持这个 */
+    SPIREG_PROTO_V2 = 2,        /* 'S'握手 -> 命令+数据(一次SPI_IOC_MESSAGE) -> ACK */
+}SpiRegProto;
+
+/* 命令型寄存器，分片时地址不递增(如环形缓冲区的读写命令寄存器) */
+#define SPIREG_ATTR_FIXED_ADDR      0x01
+/* 不能分片(如偷看环形缓冲区，分片会读到重复的数据) */
+#define SPIREG_ATTR_NO_FRAG         0x02
+/* 读写有副作用(如从环形缓冲区取走数据)，出错时不能自动重试 */
+#define SPIREG_ATTR_NON_IDEMPOTENT  0x04
+/* 命令寄存器，MCU按帧起始地址分发命令，不能和相邻寄存器合并成一帧(如环形缓冲区的查询容量) */
+#define SPIREG_ATTR_NO_MERGE        0x08
+
+#define SPIREG_ATTR_TAB_SIZE        24
+
+typedef struct _SpiRegAttr{
+    uint16_t                reg_addr;
+    uint16_t                reg_cnt;
+    uint8_t                 attr;           /* SPIREG_ATTR_XXX */
+}SpiRegAttr;
+
+/* 流水线中已经发出、还在等ACK的帧 */
+typedef struct _SpiRegPend{
+    uint8_t                 tag;
+    uint8_t                 op;             /* SPIREG_OP_XXX, ACK的延时记到这一类 */
+    int                     *ret;           /* 收到ACK后结果写到这里, 只在原来为0时改写 */
+}SpiRegPend;
+
+/* 进程间仲裁方式 */
+typedef enum _SpiRegLockMode{
+    SPIREG_LOCK_FLOCK = 0,          /* 进程内互斥锁 + flock(/run/lock/...)，默认 */
+    SPIREG_LOCK_SHM = 1,            /* 共享内存中的排队锁(/dev/shm/...)，先来先得，进程死掉能恢复 */
+}SpiRegLockMode;
+
+#define SPIREG_SHM_LOCK_DIR         "/dev/shm/"
+#define SPIREG_LOCK_NAME_LEN        128
+
+/* 请求的优先级，数字越小越优先 */
+typedef enum _SpiRegPrio{
+    SPIREG_PRIO_REALTIME = 0,       /* 喂狗这类有时限的 */
+    SPIREG_PRIO_INTERACTIVE = 1,    /* 普通寄存器读写, SpiReg_Read/SpiReg_Write 默认 */
+    SPIREG_PRIO_BULK = 2,           /* 固件烧写、CAN报文收发这类大批量数据 */
+    SPIREG_PRIO_CNT,
+}SpiRegPrio;
+
+/* 大批量请求排队超过这个时间就排到 INTERACTIVE 前面，防止饿死；REALTIME 不参与老化，总是最先执行 */
+#define SPIREG_AGING_BULK_MS            100
+
+/* 每个优先级的排队统计 */
+typedef struct _SpiRegPrioStat{
+    uint64_t                req_cnt;        /* 执行过的请求数量 */
+    uint64_t                aged_cnt;       /* 因为排队太久被提前执行的数量 */
+    uint64_t                wait_ns_total;  /* 从入队到开始执行的总时间 */
+    uint64_t                wait_ns_max;
+}SpiRegPrioStat;
+
+/* 幂等读的自动重试 */
+#define SPIREG_RETRY_MAX            3       /* 默认最多重试次数 */
+#define SPIREG_RETRY_BACKOFF_US     500     /* 第一次重试前的退避 */
+#define SPIREG_RETRY_BACKOFF_MAX_US 8000
+#define SPIREG_RETRY_RANGE          16      /* 按16个寄存器一段统计 */
+#define SPIREG_RETRY_TAB_SIZE       32
+
+typedef struct _SpiRegRetryStat{
+    uint16_t                range_base;     /* 这一段的起始地址，表满后最后一项统计其余所有地址 */
+    uint32_t                retries;        /* 重试次数 */
+    uint32_t                gave_up;        /* 重试用完或时间不够仍失败的次数 */
+}SpiRegRetryStat;
+
+/* 自适应时钟 */
+#define SPIREG_ADAPT_WINDOW         128     /* 每个统计窗口的帧数 */
+#define SPIREG_ADAPT_ERR_DOWN       2       /* 窗口内CRC错误加超时达到这个数就降速 */
+#define SPIREG_ADAPT_UP_WINDOWS     4       /* 连续这么多个干净窗口升一档 */
+#define SPIREG_ADAPT_FAIL_HOLD      4       /* 升回出过错的速度时要多等的倍数 */
+
+typedef struct _SpiRegAdapt{
+    uint8_t                 enabled;
+    uint32_t                min_hz;
+    uint32_t                max_hz;
+    uint32_t                fail_hz;        /* 最近一次出错降速前的速度 */
+    uint32_t                win_frames;
+    uint32_t                win_errs;
+    uint32_t                clean_wins;
+    uint32_t                crc_errs;       /* 累计，不开自适应也统计 */
+    uint32_t                timeouts;
+    char                    path[128];      /* 保存速度的文件 */
+}SpiRegAdapt;
+
+/* 无ACK读: 校准出MCU最慢的握手响应后，读帧用 'Q' 握手并定时等待，不再收握手ACK和最后的ACK，靠CRC兜底 */
+#define SPIREG_ACKLESS_CAL_CNT      32      /* 校准时正常读的帧数 */
+#define SPIREG_ACKLESS_MARGIN_PCT   25      /* 等待时间在测到的最大值上再加的余量 */
+#define SPIREG_ACKLESS_MAX_FAIL     3       /* 连续这么多次CRC错误退回ACK模式 */
+
+typedef struct _SpiRegAckless{
+    uint8_t                 enabled;
+    uint8_t                 calibrating;    /* 校准中，握手耗时记到 hs_max_ns */
+    uint8_t                 quiet;          /* 当前帧走无ACK流程 */
+    uint8_t                 fails;          /* 连续CRC错误次数 */
+    uint64_t                hs_max_ns;      /* 校准测到的 'S'->ACK 最大耗时 */
+    uint64_t                arm_ns;         /* 发出'Q'后到开始SPI传输的等待时间 */
+    uint32_t                frames;         /* 累计无ACK帧数 */
+    uint32_t                errs;           /* 其中失败(已用ACK模式重读)的帧数 */
+    uint32_t                fallbacks;      /* 退回ACK模式的次数 */
+}SpiRegAckless;
+
+/* 最后的ACK带回的CAN环形缓冲区水位，见 SPI_TAG_STATUS */
+typedef struct _SpiRegStatus{
+    uint16_t                rx_used;        /* CAN接收环形缓冲区已用字节 */
+    uint16_t                tx_free;        /* CAN发送环形缓冲区可用字节 */
+    uint32_t                age_us;         /* 距离收到这个状态过了多久 */
+}SpiRegStatus;
+
+/* 一帧传输的各个阶段，分别统计延时 */
+typedef enum _SpiRegStage{
+    SPIREG_STAGE_START = 0,         /* 'S'/'P' 握手 _GotoStartCmd */
+    SPIREG_STAGE_CMD,               /* V1协议单独传命令 */
+    SPIREG_STAGE_CMD_ACK,           /* V1协议命令后的ACK */
+    SPIREG_STAGE_DATA,              /* 数据段传输(V2和流水线时包括命令) */
+    SPIREG_STAGE_ACK,               /* 最后的ACK, 流水线时是收带序号ACK的时间 */
+    SPIREG_STAGE_CRC,               /* 构建命令和计算CRC */
+    SPIREG_STAGE_FRAME,             /* 整帧, 从构建命令到结果确定 */
+    SPIREG_STAGE_CNT,
+}SpiRegStage;
+
+#define SPIREG_LAT_OP_CNT           2       /* 按 SPIREG_OP_READ / SPIREG_OP_WRITE 分开统计 */
+
+struct _SpiRegFcReq;
+
 typedef struct _SpiRegHandle{
-    int                     fd;
+    SpiTrans                trans;          /* 底层传输: spidev+串口 或 软件模拟的MCU */
     int                     lock_fd;
-    int                     uart_fd;
-    uint8_t                 tx_buf[SPI_RT_MSG_MAX_SIZE];
-    uint8_t                 rx_buf[SPI_RT_MSG_MAX_SIZE];
-    uint32_t                speed;
+    char                    lock_name[SPIREG_LOCK_NAME_LEN];    /* spi设备名__串口设备名 */
+    SpiRegLockMode          lock_mode;
+    ShmTLock                tlock;
+    uint8_t                 cmd_tx_buf[SPI_CMD_LEN];
+    uint8_t                 cmd_rx_buf[SPI_CMD_LEN];
+    uint8_t                 tail_tx_buf[SPI_FRAME_TAIL_MAX];
+    uint8_t                 tail_rx_buf[SPI_FRAME_TAIL_MAX];
+    uint8_t                 *tx_buf;        /* frame_size大小 全0xff, 读数据时的发送填充 */
+    uint8_t                 *rx_buf;        /* frame_size大小 8字节对齐 */
+    uint32_t                frame_size;     /* 一帧数据段的最大长度, 初始化时确定 */
+    SpiRegAttr              attr_tab[SPIREG_ATTR_TAB_SIZE];
+    int                     attr_cnt;
+    uint32_t                speed;          /* 当前SPI时钟，每次传输通过 speed_hz 设置 */
+    SpiRegAdapt             adapt;
+    uint8_t                 retry_max;
+    int                     retry_stat_cnt;
+    SpiRegRetryStat         retry_stat[SPIREG_RETRY_TAB_SIZE];
+    SpiRegProto             proto;
+    uint16_t                v2_gap_us;
+    uint8_t                 pipe_depth;     /* 流水线深度, <=1 不使用流水线 */
+    SpiRegAckless           ackless;
+    uint32_t                ack_spin_us;    /* 等ACK时先忙等的微秒数, 0直接poll */
+    uint8_t                 pipe_open;      /* 已经发过 SPI_CMD_PIPE_START */
+    uint8_t                 pipe_seq;       /* 流水线帧和带序号握手共用的滚动序号 */
+    uint8_t                 tag_ack;        /* 所有ACK都带序号，不再清空串口 */
+    uint8_t                 ack_tag;        /* 带序号ACK时当前帧的序号 */
+    uint32_t                status_fresh_us;/* 最后ACK带状态，状态在这段时间内有效, 0不要状态 */
+    uint64_t                status_word;    /* 原子读写: rx_used | tx_free<<16 | 收到时间us<<32, 0无效 */
+    uint8_t                 notify;         /* MCU会在两帧之间发 SPI_NOTIFY */
+    int                     notify_pending; /* 原子读写: 传输中跳过的字节里有 SPI_NOTIFY */
+    uint8_t                 pend_head;
+    uint8_t                 pend_cnt;
+    SpiRegPend              pend[SPIREG_PIPE_MAX_DEPTH];
+    uint8_t                 lat_enabled;    /* 各阶段延时统计，默认打开 */
+    uint8_t                 lat_op;         /* 正在传输的帧的类型 */
+    LatHist                 lat[SPIREG_LAT_OP_CNT][SPIREG_STAGE_CNT];
+    RvmStats                *stats;         /* 共享内存统计页, NULL不统计 */
     pthread_mutex_t 		mutex;
+    /* 合并执行: 等待中的线程把请求按优先级挂到队列上，由当前执行者一起做完 */
+    struct _SpiRegFcReq     *fc_head[SPIREG_PRIO_CNT];
+    struct _SpiRegFcReq     *fc_tail[SPIREG_PRIO_CNT];
+    SpiRegPrioStat          prio_stat[SPIREG_PRIO_CNT];
+    int                     fc_busy;        /* 已经有线程在执行 */
+    pthread_mutex_t         fc_mutex;
+    pthread_cond_t          fc_cond;
 }SpiRegHandle;
 
+/* 一帧数据中的一个分段，数据可以直接在调用者的缓冲区中收发 */
+typedef struct _SpiRegSeg{
+    const uint8_t           *tx;
+    uint8_t                 *rx;
+    uint16_t                len;
+}SpiRegSeg;
+
+#define SPIREG_OP_READ              0
+#define SPIREG_OP_WRITE             1
+
+/* 普通内存型寄存器，地址连续时可以和相邻的同类操作合并成一次传输，环形缓冲区这类命令寄存器不能带此标志 */
+#define SPIREG_OPF_MERGEABLE        0x01
+
+typedef struct _SpiRegOp{
+    uint8_t                 type;           /* SPIREG_OP_READ 或 SPIREG_OP_WRITE */
+    uint8_t                 flags;          /* SPIREG_OPF_XXX */
+    uint16_t                reg_addr;
+    uint16_t                reg_cnt;
+    union{
+        uint8_t             *rdata;         /* 读操作存放数据的地址 */
+        const uint8_t       *wdata;         /* 写操作要写的数据 */
+    };
+    int                     ret;            /* 执行结果 成功0 失败负数，错误码同 SpiReg_Read/SpiReg_Write */
+}SpiRegOp;
+
 
 
 extern int SpiReg_Write(SpiRegHandle *h, uint16_t reg_addr, uint16_t reg_cnt, const uint8_t *reg_data, uint32_t timeout);
 extern int SpiReg_Read(SpiRegHandle *h, uint16_t reg_addr, uint16_t reg_cnt, uint8_t *reg_data, uint32_t timeout);
-extern int SpiReg_Init(SpiRegHandle *h, char* spi_dev, char* uart_dev, uint32_t speed);
+extern int SpiReg_WriteEx(SpiRegHandle *h, uint16_t reg_addr, uint16_t reg_cnt, const uint8_t *reg_data, 
+    uint32_t timeout, SpiRegPrio prio);
+extern int SpiReg_ReadEx(SpiRegHandle *h, uint16_t reg_addr, uint16_t reg_cnt, uint8_t *reg_data, 
+    uint32_t timeout, SpiRegPrio prio);
+extern int SpiReg_GetPrioStat(SpiRegHandle *h, SpiRegPrio prio, SpiRegPrioStat *stat);
+extern int SpiReg_ReadBorrow(SpiRegHandle *h, uint16_t reg_addr, uint16_t reg_cnt, const uint8_t **data, uint32_t timeout);
+extern void SpiReg_Release(SpiRegHandle *h);
+extern int SpiReg_Transact(SpiRegHandle *h, SpiRegOp *ops, int n, uint32_t timeout);
+extern int SpiReg_TransactEx(SpiRegHandle *h, SpiRegOp *ops, int n, uint32_t timeout, SpiRegPrio prio);
+extern int SpiReg_SetProto(SpiRegHandle *h, SpiRegProto proto, uint16_t v2_gap_us);
+extern int SpiReg_SetPipeline(SpiRegHandle *h, uint8_t depth);
+extern int SpiReg_SetAckless(SpiRegHandle *h, int enable, uint16_t probe_addr);
+extern int SpiReg_GetAckless(SpiRegHandle *h, SpiRegAckless *stat);
+extern int SpiReg_SetTaggedAck(SpiRegHandle *h, int enable);
+extern int SpiReg_GetTransCnt(SpiRegHandle *h, SpiTransCnt *cnt);
+extern int SpiReg_SetStatusAck(SpiRegHandle *h, uint32_t fresh_us);
+extern int SpiReg_GetStatus(SpiRegHandle *h, SpiRegStatus *status);
+extern int SpiReg_SetNotify(SpiRegHandle *h, int enable);
+extern int SpiReg_WaitNotify(SpiRegHandle *h, uint32_t timeout);
+extern int SpiReg_GetNotifyFd(SpiRegHandle *h);
+extern int SpiReg_SetAckSpin(SpiRegHandle *h, uint32_t spin_us);
+extern int SpiReg_SetLockMode(SpiRegHandle *h, SpiRegLockMode mode);
+extern int SpiReg_SetRetry(SpiRegHandle *h, uint8_t retry_max);
+extern int SpiReg_GetRetryStat(SpiRegHandle *h, SpiRegRetryStat *stat, int max);
+extern int SpiReg_SetLatency(SpiRegHandle *h, int enable);
+extern int SpiReg_GetLatency(SpiRegHandle *h, int op, SpiRegStage stage, LatHist *hist, int reset);
+extern void SpiReg_SetStats(SpiRegHandle *h, RvmStats *stats);
+extern int SpiReg_SetCapture(SpiRegHandle *h, const char *path);
+extern int SpiReg_SetAdaptive(SpiRegHandle *h, uint32_t min_hz, uint32_t max_hz, const char *persist_path);
+extern uint32_t SpiReg_GetSpeed(SpiRegHandle *h, uint32_t *crc_errs, uint32_t *timeouts);
+extern int SpiReg_SetRegAttr(SpiRegHandle *h, uint16_t reg_addr, uint16_t reg_cnt, uint8_t attr);
+extern int SpiReg_Init(SpiRegHandle *h, char* spi_dev, char* uart_dev, uint32_t speed, uint32_t frame_size);
+extern int SpiReg_InitTrans(SpiRegHandle *h, const SpiTrans *trans, uint32_t spi_speed, uint32_t frame_size);
 extern void SpiReg_Exit(SpiRegHandle *h);
 #ifdef __cplusplus
 #if __cplusplus
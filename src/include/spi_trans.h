@@ -0,0 +1,135 @@
+/**
+ * @file spi_trans.h
+ * @brief SpiReg 的底层传输接口: SPI 传输 + 握手/ACK 用的串口
+ *        spidev+串口是其中一种实现，软件模拟的MCU(mcu_sim.c)是另一种，
+ *        协议、CRC、分片、流水线等都在 spi_reg.c 中，和具体传输无关
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ *
+ * @par 修改日志:
+ */
+
+#ifndef _SPI_TRANS_H_
+#define _SPI_TRANS_H_
+
+#include <stdint.h>
+#include <linux/spi/spidev.h>
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C"{
+#endif
+#endif /* __cplusplus */
+
+#define SPI_TRANS_NAME_LEN      84          /* 用来生成锁文件名 */
+
+/*
+ * 没有板子时 spi 设备可以是 mcu_emu 监听的 Unix socket，一次SPI消息对应一次请求:
+ *   请求: SpiSockHdr + 各段发送数据首尾相接(没有发送缓冲区的段填0)
+ *   应答: int32 结果 + 各段接收数据首尾相接
+ */
+#define SPI_SOCK_MAGIC          0x53504931          /* "SPI1" */
+#define SPI_SOCK_MSG_MAX        65536               /* 一次消息的最大长度 */
+
+typedef struct _SpiSockHdr{
+    uint32_t                magic;
+    uint32_t                len;            /* 各段长度之和 */
+    uint32_t                speed_hz;       /* 第一段的时钟，仅供参考 */
+}SpiSockHdr;
+
+typedef struct _SpiTrans SpiTrans;
+struct _UartUring;
+
+typedef struct _SpiTransOps{
+    /**
+    * @brief  一次SPI消息，n段传输之间片选不断开
+    * @return int              成功返回非负数 失败负数
+    */
+    int     (*xfer)(SpiTrans *t, struct spi_ioc_transfer *xfer, int n);
+    /* 串口，语义同 uart_Write / uart_ReadSpin / uart_InClean, 没有真实串口的实现可以忽略 spin_us */
+    int     (*uart_write)(SpiTrans *t, const uint8_t *data, int len);
+    int     (*uart_read)(SpiTrans *t, uint8_t *buf, int len, int timeout, uint32_t spin_us);
+    /* 写完接着读，可以为NULL(分别调用 uart_write 和 uart_read)，io_uring 实现一次系统调用完成握手 */
+    int     (*uart_xfer)(SpiTrans *t, const uint8_t *tx, int tx_len, uint8_t *rx, int rx_len, int timeout, uint32_t spin_us);
+    void    (*uart_in_clean)(SpiTrans *t);
+    /* 等串口有数据可读但不读走，语义同 uart_Wait, 用来在传输之外等MCU主动发来的字节 */
+    int     (*uart_wait)(SpiTrans *t, int timeout);
+    void    (*close)(SpiTrans *t);
+}SpiTransOps;
+
+/* 各操作的调用次数，真实设备上每次至少一个系统调用(串口读是 poll+read) */
+typedef struct _SpiTransCnt{
+    uint64_t                xfer;
+    uint64_t                uart_write;
+    uint64_t                uart_read;
+    uint64_t                uart_clean;
+    uint64_t                uart_xfer;      /* 写和读合在一起的次数，不再计入 uart_write/uart_read */
+}SpiTransCnt;
+
+struct _SpiTrans{
+    const SpiTransOps       *ops;
+    char                    name[SPI_TRANS_NAME_LEN];   /* 同一个name的句柄之间互斥 */
+    uint32_t                max_msg;        /* 一次SPI消息的最大长度 */
+    uint32_t                uart_baud;      /* 握手串口波特率, 0是没有真实串口(软件模拟) */
+    int                     spi_fd;
+    int                     uart_fd;
+    struct _UartUring       *uring;         /* 串口的io_uring, NULL用poll */
+    void                    *priv;
+    SpiTransCnt             cnt;
+};
+
+static inline int SpiTrans_Xfer(SpiTrans *t, struct spi_ioc_transfer *xfer, int n){
+    t->cnt.xfer++;
+    return t->ops->xfer(t, xfer, n);
+}
+
+static inline int SpiTrans_UartWrite(SpiTrans *t, const uint8_t *data, int len){
+    t->cnt.uart_write++;
+    return t->ops->uart_write(t, data, len);
+}
+
+static inline int SpiTrans_UartRead(SpiTrans *t, uint8_t *buf, int len, int timeout, uint32_t spin_us){
+    t->cnt.uart_read++;
+    return t->ops->uart_read(t, buf, len, timeout, spin_us);
+}
+
+/**
+ * @brief 写 tx 后读 rx，读的语义同 SpiTrans_UartRead
+ * @return int              读到的字节数，写失败返回-1
+ */
+static inline int SpiTrans_UartXfer(SpiTrans *t, const uint8_t *tx, int tx_len, uint8_t *rx, int rx_len, 
+    int timeout, uint32_t spin_us){
+    if(t->ops->uart_xfer == NULL){
+        if(SpiTrans_UartWrite(t, tx, tx_len) != tx_len) return -1;
+        return SpiTrans_UartRead(t, rx, rx_len, timeout, spin_us);
+    }
+    t->cnt.uart_xfer++;
+    return t->ops->uart_xfer(t, tx, tx_len, rx, rx_len, timeout, spin_us);
+}
+
+static inline void SpiTrans_UartInClean(SpiTrans *t){
+    t->cnt.uart_clean++;
+    t->ops->uart_in_clean(t);
+}
+
+static inline int SpiTrans_UartWait(SpiTrans *t, int timeout){
+    return t->ops->uart_wait(t, timeout);
+}
+
+static inline void SpiTrans_Close(SpiTrans *t){
+    t->ops->close(t);
+}
+
+extern int SpiTrans_OpenSpidev(SpiTrans *t, const char *spi_dev, const char *uart_dev, uint32_t speed);
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif
+#endif /* __cplusplus */
+
+
+#endif // _SPI_TRANS_H_
@@ -146,9 +146,49 @@ static int other_argparse_parse(RunConfig* config, int argc, const char* argv[])
     if(config->is_write_shanqi_production_date){
         config->mode = FUN_WRITE_SHANQI_PRODUCTION_DATE;
     }
+    if(config->bench_frame){
+        config->mode = FUN_BENCH_FRAME;
+    }
+    if(config->bench_lock){
+        config->mode = FUN_BENCH_LOCK;
+    }
+    if(config->bench_ack){
+        config->mode = FUN_BENCH_ACK;
+    }
+    if(config->stats_interval){
+        config->mode = FUN_STATS;
+    }
     return 0;
 }
 
+/* 打印各阶段延时分布 单位us */
+static void print_latency(void){
+    static const char *op_name[SPIREG_LAT_OP_CNT] = {"read", "write"};
+    static const char *stage_name[SPIREG_STAGE_CNT] = {"start", "cmd", "cmd_ack", "data", "ack", "crc", "frame"};
+    static LatHist hist;
+    SpiTransCnt cnt;
+    uint64_t frames = 0;
+    int op, stage;
+
+    dbg_infoln("%-6s %-8s %10s %10s %10s %10s %10s", "op", "stage", "count", "p50", "p99", "p99.9", "max");
+    for(op = 0; op < SPIREG_LAT_OP_CNT; op++){
+        for(stage = 0; stage < SPIREG_STAGE_CNT; stage++){
+            if(RVMcu_GetLatency(op, stage, &hist, 0) < 0 || hist.count == 0) continue;
+            dbg_infoln("%-6s %-8s %10llu %10.1f %10.1f %10.1f %10.1f", op_name[op], stage_name[stage], 
+                (unsigned long long)hist.count, 
+                LatHist_Percentile(&hist, 50) / 1000.0, LatHist_Percentile(&hist, 99) / 1000.0,
+                LatHist_Percentile(&hist, 99.9) / 1000.0, hist.max_ns / 1000.0);
+        }
+        if(RVMcu_GetLatency(op, SPIREG_STAGE_FRAME, &hist, 0) == 0)
+            frames += hist.count;
+    }
+    if(frames == 0 || RVMcu_GetTransCnt(&cnt) < 0) return;
+    dbg_infoln("每帧传输层调用: spi %.2f, 串口写 %.2f, 串口读 %.2f, 串口写后读 %.2f, 清空串口 %.2f, 合计 %.2f", 
+        (double)cnt.xfer / frames, (double)cnt.uart_write / frames, (double)cnt.uart_read / frames, 
+        (double)cnt.uart_xfer / frames, (double)cnt.uart_clean / frames, 
+        (double)(cnt.xfer + cnt.uart_write + cnt.uart_read + cnt.uart_xfer + cnt.uart_clean) / frames);
+}
+
 int main(int argc, const char* argv[]){
     int ret;
     struct argparse argparse;
@@ -176,6 +216,22 @@ int main(int argc, const char* argv[]){
         .is_write_shanqi_production_date = 0,
         .rearview_type = 0xFFFFFFFF,
         .mcu_debug_level = -1,
+        .spi_proto = 1,
+        .pipeline = 1,
+        .frame_size = 0,
+        .bench_frame = 0,
+        .bench_lock = 0,
+        .bench_ack = 0,
+        .stats_interval = 0,
+        .status_interval = 0,
+        .is_wdog_feed = 0,
+        .is_verify = 0,
+        .is_shm_lock = 0,
+        .is_adaptive_speed = 0,
+        .speed_file = NULL,
+        .is_latency = 0,
+        .is_sim = 0,
+        .capture = NULL,
     };
     struct argparse_option options[] = {
         OPT_HELP(),
@@ -198,12 +254,34 @@ int main(int argc, const char* argv[]){
         OPT_STRING('u', "update", &run_config.mcu_firmware, "升级固件", NULL, 0, 0),
         OPT_STRING('U', "Update", &run_config.mcu_force_firmware, "强行升级固件", NULL, 0, 0),
         OPT_INTEGER('t', "test", &run_config.test_cnt, "测试模式", NULL, 0, 0),
+        OPT_BOOLEAN(' ', "verify", &run_config.is_verify, "配合-t -w, 每次写完读回来比较", NULL, 0, 0),
         OPT_INTEGER('s', "set-mpu-dtc", &run_config.set_dtc, "设置MPU故障 1-12", NULL, 0, 0),
         OPT_INTEGER('x', "set-rearview-type", &run_config.rearview_type, "设置后视镜类型  0为右镜 1为左镜", NULL, 0, 0),
         OPT_INTEGER('e', "clean-mpu-dtc", &run_config.clean_dtc, "清除MPU故障 1-12", NULL, 0, 0),
         OPT_INTEGER('E', "clean-nvm", &run_config.clean_nvm, "清除NVM分区 1:清除NVM DTC分区 2:清除NVM USER分区", NULL, 0, 0),
         OPT_INTEGER('g', "set-mcu-debug-level", &run_config.mcu_debug_level, 
             "设置MCU串口打印等级 5:DBG_DEBUG 4:DBG_INFO 3:DBG_SYS 2:DBG_WARNING 1:DBG_ERR", NULL, 0, 0),
+        OPT_INTEGER(' ', "bench-frame", &run_config.bench_frame, "测试每次传输构建帧的开销(不需要MCU)，参数为循环次数", NULL, 0, 0),
+        OPT_INTEGER(' ', "bench-lock", &run_config.bench_lock, "对比flock和共享内存排队锁在1~8个进程竞争下的开销(不需要MCU)，参数为每个进程的加锁次数", NULL, 0, 0),
+        OPT_INTEGER(' ', "bench-ack", &run_config.bench_ack, "在伪终端上测不同忙等时间下ACK延时分布和CPU占用(不需要MCU)，参数为每档次数", NULL, 0, 0),
+        OPT_INTEGER(' ', "stats", &run_config.stats_interval, "从共享内存统计页打印通信速率(不访问MCU)，参数为间隔毫秒", NULL, 0, 0),
+        OPT_GROUP("通信选项"),
+        OPT_INTEGER('P', "spi-proto", &run_config.spi_proto, "SPI协议版本 1:V1(默认) 2:V2命令数据一次传输,需MCU固件支持", NULL, 0, 0),
+        OPT_INTEGER(' ', "frame-size", &run_config.frame_size, "一帧数据段大小(默认1024)，更大的读写自动分片，受spidev bufsiz限制", NULL, 0, 0),
+        OPT_BOOLEAN(' ', "shm-lock", &run_config.is_shm_lock, "进程间用共享内存排队锁代替flock，使用同一设备的所有进程都要加此选项", NULL, 0, 0),
+        OPT_BOOLEAN(' ', "adaptive-speed", &run_config.is_adaptive_speed, "SPI时钟根据CRC错误和超时自动升降", NULL, 0, 0),
+        OPT_STRING(' ', "speed-file", &run_config.speed_file, "配合--adaptive-speed, 保存选出的时钟，下次从这个速度开始", NULL, 0, 0),
+        OPT_BOOLEAN(' ', "sim", &run_config.is_sim, "不访问硬件，使用进程内模拟的MCU(也可设置环境变量RVMCU_SIM)", NULL, 0, 0),
+        OPT_STRING(' ', "capture", &run_config.capture, "串口和SPI收发抓包到文件，用rvm_replay分析(也可设置环境变量RVMCU_CAPTURE)", NULL, 0, 0),
+        OPT_BOOLEAN(' ', "latency", &run_config.is_latency, "结束时打印SPI传输各阶段的延时分布", NULL, 0, 0),
+        OPT_INTEGER(' ', "pipeline", &run_config.pipeline, "流水线深度 1:关闭(默认) 最大8,需要-P 2和MCU固件支持", NULL, 0, 0),
+        OPT_BOOLEAN(' ', "tag-ack", &run_config.is_tag_ack, "ACK带序号，迟到的ACK在用户态跳过，不再清空串口，需要MCU固件支持", NULL, 0, 0),
+        OPT_INTEGER(' ', "status-ack", &run_config.status_ack_us, "最后的ACK带回CAN缓冲区水位，在这么多微秒内收发CAN不再查询容量，需要MCU固件支持", NULL, 0, 0),
+        OPT_INTEGER(' ', "can-notify", &run_config.can_notify, "配合-d/-T, 接收缓冲区达到这么多帧时MCU通过串口通知，空闲时睡眠等待不再轮询，需要MCU固件支持", NULL, 0, 0),
+        OPT_INTEGER(' ', "status-interval", &run_config.status_interval, "常驻运行(默认的喂狗和-d)时每隔这么多毫秒打印一次状态", NULL, 0, 0),
+        OPT_BOOLEAN(' ', "wdog-feed", &run_config.is_wdog_feed, "配合-d, 收CAN的同时在同一个线程里喂狗", NULL, 0, 0),
+        OPT_INTEGER(' ', "ack-spin", &run_config.ack_spin_us, "等ACK时先忙等的微秒数，减少唤醒延时但占用CPU，0:不忙等(默认)", NULL, 0, 0),
+        OPT_BOOLEAN(' ', "ackless", &run_config.is_ackless, "读寄存器不等ACK，按初始化时校准的时间等待MCU，CRC出错自动退回，需要-P 2和MCU固件支持", NULL, 0, 0),
         OPT_END(),
     };
     debug_init();
@@ -220,12 +298,91 @@ int main(int argc, const char* argv[]){
     if(ret)
         goto help;
 
+    if(RUN_FUN_NO_MCU(run_config.mode))
+        return run(&run_config);
+
+    RVMcu_SetFrameSize(run_config.frame_size);
+    if(run_config.is_sim) RVMcu_SetSim(1);
+    if(run_config.capture) RVMcu_SetCapture(run_config.capture);
     ret = RVMcu_Init();
     if(ret < 0){
         dbg_errfl("RVMcu_Init :%d",ret);
         return ret;
     }
+    if(run_config.is_shm_lock){
+        ret = RVMcu_SetLockMode(SPIREG_LOCK_SHM);
+        if(ret < 0){
+            dbg_errfl("RVMcu_SetLockMode :%d",ret);
+            RVMcu_Exit();
+            return ret;
+        }
+    }
+    ret = RVMcu_SetSpiProto(run_config.spi_proto);
+    if(ret < 0){
+        dbg_errfl("RVMcu_SetSpiProto :%d",ret);
+        RVMcu_Exit();
+        return ret;
+    }
+    ret = RVMcu_SetPipeline(run_config.pipeline);
+    if(ret < 0){
+        dbg_errfl("RVMcu_SetPipeline :%d",ret);
+        RVMcu_Exit();
+        return ret;
+    }
+    if(run_config.is_tag_ack){
+        ret = RVMcu_SetTaggedAck(1);
+        if(ret < 0){
+            dbg_errfl("RVMcu_SetTaggedAck :%d",ret);
+            RVMcu_Exit();
+            return ret;
+        }
+    }
+    if(run_config.status_ack_us){
+        ret = RVMcu_SetStatusAck((uint32_t)run_config.status_ack_us);
+        if(ret < 0){
+            dbg_errfl("RVMcu_SetStatusAck :%d",ret);
+            RVMcu_Exit();
+            return ret;
+        }
+    }
+    if(run_config.ack_spin_us){
+        ret = RVMcu_SetAckSpin((uint32_t)run_config.ack_spin_us);
+        if(ret < 0){
+            dbg_errfl("RVMcu_SetAckSpin :%d",ret);
+            RVMcu_Exit();
+            return ret;
+        }
+    }
+    if(run_config.is_ackless){
+        ret = RVMcu_SetAckless(1);
+        if(ret < 0){
+            dbg_errfl("RVMcu_SetAckless :%d",ret);
+            RVMcu_Exit();
+            return ret;
+        }
+    }
+    if(run_config.is_adaptive_speed){
+        ret = RVMcu_SetAdaptiveSpeed(1, run_config.speed_file);
+        if(ret < 0){
+            dbg_errfl("RVMcu_SetAdaptiveSpeed :%d",ret);
+            RVMcu_Exit();
+            return ret;
+        }
+    }
     ret = run(&run_config);
+    if(run_config.is_adaptive_speed){
+        uint32_t crc_errs = 0, timeouts = 0;
+        uint32_t speed = RVMcu_GetSpiSpeed(&crc_errs, &timeouts);
+        dbg_infoln("spi speed: %u Hz, crc errors: %u, timeouts: %u", speed, crc_errs, timeouts);
+    }
+    if(run_config.is_ackless){
+        SpiRegAckless al;
+        if(RVMcu_GetAckless(&al) == 0)
+            dbg_infoln("ackless: %s, wait %lluus, frames: %u, errors: %u, fallbacks: %u", al.enabled ? "on" : "off",
+                (unsigned long long)(al.arm_ns / 1000), al.frames, al.errs, al.fallbacks);
+    }
+    if(run_config.is_latency)
+        print_latency();
     RVMcu_Exit();
     return ret;
 help:
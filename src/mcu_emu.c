@@ -0,0 +1,322 @@
+/**
+ * @file mcu_emu.c
+ * @brief 独立运行的MCU模拟器，不需要板子就能跑完整的 mcu_reg_wr:
+ *        握手/ACK串口是一个伪终端，SPI由一个Unix socket代替，MCU的行为来自 mcu_sim.c
+ *        mcu_reg_wr 通过环境变量 RVMCU_SPI_DEV / RVMCU_UART_DEV 指向这两个路径，
+ *        串口这一侧仍然走 pp_uart.c 的 termios 和 poll
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ *
+ * @par 修改日志:
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "debug.h"
+#include "argparse.h"
+#include "spi_trans.h"
+#include "mcu_sim.h"
+#include "can-msg.h"
+
+#define EMU_UART_PATH           "/tmp/rvm_emu_tty"
+#define EMU_SPI_PATH            "/tmp/rvm_emu_spi"
+#define EMU_MAX_CLIENTS         16
+
+static const char* const usages[] = {
+    "mcu_emu [options]",
+    NULL,
+};
+
+static volatile sig_atomic_t emu_exit = 0;
+static McuSim *emuSim;
+static int pty_fd = -1;
+static uint8_t emu_buf[SPI_SOCK_MSG_MAX];
+
+static uint64_t _NowNs(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* 模拟总线上按固定速率收到CAN报文，数据是放进接收缓冲区时的 CLOCK_MONOTONIC 微秒，MPU侧可以算出延时 */
+static void _CanInject(uint64_t *next_ns, uint64_t period_ns){
+    PCanMsg msg;
+    uint64_t now = _NowNs(), us;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.can_id = 0x7ff;
+    msg.can_len = 8;
+    while(*next_ns <= now){
+        us = now / 1000ULL;
+        memcpy(msg.can_data, &us, sizeof(us));
+        msg.can_time = (uint16_t)(now / 1000000ULL);
+        McuSim_InjectCan(emuSim, &msg, sizeof(msg));
+        *next_ns += period_ns;
+    }
+}
+
+static void _OnSignal(int sig){
+    (void)sig;
+    emu_exit = 1;
+}
+
+/**
+ * @brief 打开伪终端，从设备软链接到 link_path，
+ *        自己也打开一次从设备，mcu_reg_wr 退出后主设备不会一直报POLLHUP
+ * @return int              成功返回从设备fd 失败负数
+ */
+static int _PtyOpen(const char *link_path){
+    struct termios opt;
+    char *slave;
+    int slave_fd;
+
+    pty_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if(pty_fd < 0 || grantpt(pty_fd) < 0 || unlockpt(pty_fd) < 0) return -1;
+    slave = ptsname(pty_fd);
+    if(slave == NULL) return -1;
+    slave_fd = open(slave, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if(slave_fd < 0) return -1;
+    /* 对端 uart_Open 也会设置成原始模式，这里先设好，避免它打开之前的数据被回显 */
+    tcgetattr(slave_fd, &opt);
+    cfmakeraw(&opt);
+    tcsetattr(slave_fd, TCSANOW, &opt);
+    unlink(link_path);
+    if(symlink(slave, link_path) < 0){
+        close(slave_fd);
+        return -1;
+    }
+    return slave_fd;
+}
+
+/* 模拟器要发给MPU的字节(ACK等)写进伪终端，有损伤时只写已经到时间的 */
+static void _UartFlush(void){
+    uint8_t buf[MCU_SIM_UART_BUF];
+    int n;
+    while((n = McuSim_UartRead(emuSim, buf, sizeof(buf))) > 0){
+        if(write(pty_fd, buf, (size_t)n) != n)
+            dbg_errfl("pty write: %s", strerror(errno));
+    }
+}
+
+static void _UartInput(void){
+    uint8_t buf[MCU_SIM_UART_BUF];
+    ssize_t n;
+    n = read(pty_fd, buf, sizeof(buf));
+    if(n <= 0) return;
+    McuSim_UartWrite(emuSim, buf, (int)n);
+    _UartFlush();
+}
+
+static int _ReadAll(int fd, void *data, size_t len){
+    uint8_t *p = (uint8_t *)data;
+    ssize_t n;
+    while(len){
+        n = recv(fd, p, len, 0);
+        if(n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int _WriteAll(int fd, const void *data, size_t len){
+    const uint8_t *p = (const uint8_t *)data;
+    ssize_t n;
+    while(len){
+        n = send(fd, p, len, MSG_NOSIGNAL);
+        if(n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * @brief 处理一次SPI消息，ACK先写进伪终端再回应答，
+ *        对端从ioctl返回后再去读串口，和真实MCU的时序一致
+ * @return int              成功0 连接断开或者格式错误返回-1
+ */
+static int _SpiMessage(int fd){
+    struct spi_ioc_transfer xfer;
+    SpiSockHdr hdr;
+    int32_t ret;
+
+    if(_ReadAll(fd, &hdr, sizeof(hdr)) < 0 || hdr.magic != SPI_SOCK_MAGIC || hdr.len > SPI_SOCK_MSG_MAX)
+        return -1;
+    if(_ReadAll(fd, emu_buf, hdr.len) < 0) return -1;
+    memset(&xfer, 0, sizeof(xfer));
+    xfer.tx_buf = (unsigned long)emu_buf;
+    xfer.rx_buf = (unsigned long)emu_buf;
+    xfer.len = hdr.len;
+    xfer.speed_hz = hdr.speed_hz;
+    ret = McuSim_Xfer(emuSim, &xfer, 1);
+    _UartFlush();
+    if(_WriteAll(fd, &ret, sizeof(ret)) < 0 || _WriteAll(fd, emu_buf, hdr.len) < 0)
+        return -1;
+    return 0;
+}
+
+static int _Listen(const char *path){
+    struct sockaddr_un addr;
+    int fd;
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, EMU_MAX_CLIENTS) < 0){
+        close(fd);
+        return -1;
+    }
+    chmod(path, 0666);
+    return fd;
+}
+
+int main(int argc, const char* argv[]){
+    struct argparse argparse;
+    struct pollfd pfd[2 + EMU_MAX_CLIENTS];
+    struct sigaction sa;
+    struct timespec ts;
+    McuSimStat stat;
+    const char *uart_path = EMU_UART_PATH;
+    const char *spi_path = EMU_SPI_PATH;
+    const char *impair = NULL;
+    McuSimImpair imp;
+    int64_t wait;
+    uint64_t can_next = 0, can_period = 0, now;
+    int no_loopback = 0, can_rate = 0;
+    int slave_fd = -1, listen_fd = -1, nfds = 2, ret = -1, i, fd;
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_STRING('u', "uart", &uart_path, "伪终端软链接路径(默认" EMU_UART_PATH ")", NULL, 0, 0),
+        OPT_STRING('s', "spi", &spi_path, "代替SPI的Unix socket路径(默认" EMU_SPI_PATH ")", NULL, 0, 0),
+        OPT_BOOLEAN(' ', "no-loopback", &no_loopback, "发出的CAN报文不放回接收缓冲区", NULL, 0, 0),
+        OPT_INTEGER(' ', "can-rate", &can_rate, "每秒往接收缓冲区放这么多帧CAN报文，数据是放入时的单调时钟微秒，用来测接收延时", NULL, 0, 0),
+        OPT_STRING(' ', "impair", &impair, "链路损伤 seed=N,delay=us,jitter=us,drop=ppm,flip=ppm,stall=ms (也可设置环境变量RVMCU_SIM_IMPAIR)", NULL, 0, 0),
+        OPT_END(),
+    };
+    debug_init();
+
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "\nMCU模拟器，mcu_reg_wr 设置 RVMCU_SPI_DEV / RVMCU_UART_DEV 后连接到这里 ", NULL);
+    argc = argparse_parse(&argparse, argc, argv);
+    if(argc < 0) return 1;
+
+    emuSim = McuSim_New();
+    if(emuSim == NULL) return 1;
+    emuSim->can_loopback = !no_loopback;
+    if(impair){
+        if(McuSim_ParseImpair(impair, &imp) < 0){
+            dbg_errfl("损伤配置错误: %s", impair);
+            goto exit_sim;
+        }
+        McuSim_SetImpair(emuSim, &imp);
+    }
+
+    slave_fd = _PtyOpen(uart_path);
+    if(slave_fd < 0){
+        dbg_errfl("创建伪终端 %s 失败: %s", uart_path, strerror(errno));
+        goto exit_sim;
+    }
+    listen_fd = _Listen(spi_path);
+    if(listen_fd < 0){
+        dbg_errfl("监听 %s 失败: %s", spi_path, strerror(errno));
+        goto exit_pty;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = _OnSignal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("export RVMCU_SPI_DEV=%s RVMCU_UART_DEV=%s RVMCU_NO_BROKER=1\n", spi_path, uart_path);
+    fflush(stdout);
+
+    pfd[0].fd = pty_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = listen_fd;
+    pfd[1].events = POLLIN;
+    if(can_rate > 0){
+        can_period = 1000000000ULL / (uint64_t)can_rate;
+        can_next = _NowNs() + can_period;
+    }
+    while(!emu_exit){
+        /* 有推迟的回复时，到时间醒来写进伪终端 */
+        wait = McuSim_UartWaitUs(emuSim);
+        if(can_period){
+            now = _NowNs();
+            if(can_next <= now) wait = 0;
+            else if(wait < 0 || (uint64_t)wait * 1000ULL > can_next - now) wait = (int64_t)((can_next - now) / 1000ULL);
+        }
+        /* 按微秒等，推迟的回复和注入的报文不会被拖到下一个毫秒 */
+        ts.tv_sec = (time_t)(wait / 1000000);
+        ts.tv_nsec = (long)(wait % 1000000) * 1000;
+        if(ppoll(pfd, (nfds_t)nfds, wait < 0 ? NULL : &ts, NULL) < 0){
+            if(errno == EINTR) continue;
+            dbg_errfl("poll: %s", strerror(errno));
+            break;
+        }
+        if(can_period) _CanInject(&can_next, can_period);
+        _UartFlush();
+        if(pfd[0].revents & POLLIN)
+            _UartInput();
+        if(pfd[1].revents & POLLIN){
+            fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if(fd >= 0 && nfds < 2 + EMU_MAX_CLIENTS){
+                pfd[nfds].fd = fd;
+                pfd[nfds].events = POLLIN;
+                pfd[nfds].revents = 0;
+                nfds++;
+            }else if(fd >= 0){
+                close(fd);
+            }
+        }
+        for(i = 2; i < nfds; i++){
+            if(pfd[i].revents == 0) continue;
+            if((pfd[i].revents & POLLIN) && _SpiMessage(pfd[i].fd) == 0) continue;
+            /* 断开的连接用最后一个补上 */
+            close(pfd[i].fd);
+            pfd[i] = pfd[--nfds];
+            i--;
+        }
+    }
+
+    McuSim_GetStat(emuSim, &stat);
+    printf("frames:%llu nacks:%llu bytes:%llu can_tx:%llu resets:%u ack_drops:%llu flips:%llu stalls:%llu notifies:%llu\n",
+        (unsigned long long)stat.frames, (unsigned long long)stat.nacks,
+        (unsigned long long)stat.bytes, (unsigned long long)stat.can_tx, stat.resets,
+        (unsigned long long)stat.ack_drops, (unsigned long long)stat.flips, (unsigned long long)stat.stalls,
+        (unsigned long long)stat.notifies);
+    ret = 0;
+    for(i = 2; i < nfds; i++)
+        close(pfd[i].fd);
+    close(listen_fd);
+    unlink(spi_path);
+exit_pty:
+    if(slave_fd >= 0) close(slave_fd);
+    if(pty_fd >= 0) close(pty_fd);
+    unlink(uart_path);
+exit_sim:
+    McuSim_Free(emuSim);
+    return ret;
+}
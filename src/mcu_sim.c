@@ -0,0 +1,699 @@
+/**
+ * @file mcu_sim.c
+ * @brief 软件模拟的MCU
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ *
+ * @par 修改日志:
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc_check.h"
+#include "memctrl.h"
+#include "spi_frame.h"
+#include "regwr_cb.h"
+#include "can-msg.h"
+#include "mcu_sim.h"
+#include "mcu-reg/mcu-info.h"
+#include "mcu-reg/mpu-burn-mcu.h"
+#include "mcu-reg/mpu-business.h"
+
+#define SIM_RING_SEND_CAN       0
+#define SIM_RING_RECEIVE_CAN    1
+#define SIM_RING_BURN           2
+
+/* 等MCU主动发的字节时，没有待发字节的检查间隔 */
+#define SIM_UART_WAIT_POLL_US   200
+
+/*============================== 损伤 ==============================*/
+
+static uint64_t _NowNs(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* xorshift64*, 只依赖seed, 保证可以复现 */
+static uint64_t _Rand(McuSim *sim){
+    sim->rng ^= sim->rng >> 12;
+    sim->rng ^= sim->rng << 25;
+    sim->rng ^= sim->rng >> 27;
+    return sim->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static int _Chance(McuSim *sim, uint32_t ppm){
+    if(ppm == 0) return 0;
+    return _Rand(sim) % 1000000 < ppm;
+}
+
+/* MCU开始擦除flash，这段时间内的回复都推迟 */
+static void _Stall(McuSim *sim){
+    if(!sim->impaired || sim->impair.erase_stall_ms == 0) return;
+    sim->busy_until = _NowNs() + (uint64_t)sim->impair.erase_stall_ms * 1000000ULL;
+    sim->stat.stalls++;
+}
+
+/*============================== 环形缓冲区 ==============================*/
+
+static uint32_t _RingWrite(McuSimRing *r, const uint8_t *data, uint32_t len){
+    uint32_t i, tail;
+    if(len > MCU_SIM_RING_SIZE - r->used) len = MCU_SIM_RING_SIZE - r->used;
+    tail = (r->head + r->used) % MCU_SIM_RING_SIZE;
+    for(i = 0; i < len; i++)
+        r->buf[(tail + i) % MCU_SIM_RING_SIZE] = data[i];
+    r->used += len;
+    return len;
+}
+
+/* data 为NULL时只丢掉数据(crb_ReadAir), consume 为0时不取走(crb_Peep) */
+static uint32_t _RingRead(McuSimRing *r, uint8_t *data, uint32_t len, int consume){
+    uint32_t i;
+    if(len > r->used) len = r->used;
+    if(data){
+        for(i = 0; i < len; i++)
+            data[i] = r->buf[(r->head + i) % MCU_SIM_RING_SIZE];
+    }
+    if(consume){
+        r->head = (r->head + len) % MCU_SIM_RING_SIZE;
+        r->used -= len;
+    }
+    return len;
+}
+
+static McuSimRing *_FindRing(McuSim *sim, uint16_t reg_addr){
+    int i;
+    for(i = 0; i < MCU_SIM_RING_CNT; i++){
+        if(reg_addr >= sim->ring[i].cb_addr && reg_addr < sim->ring[i].cb_addr + CBREG_SIZE)
+            return &sim->ring[i];
+    }
+    return NULL;
+}
+
+/* MPU读环形缓冲区的命令寄存器 */
+static void _RingRegRead(McuSimRing *r, uint8_t cmd, uint8_t *data, uint16_t len){
+    uint32_t val;
+    memset(data, 0, len);
+    switch(cmd){
+    case CBREG_CMD_GET_SIZE:
+    case CBREG_CMD_GET_FREESIZE:
+        val = cmd == CBREG_CMD_GET_SIZE ? r->used : MCU_SIM_RING_SIZE - r->used;
+        memcpy(data, &val, len < sizeof(val) ? len : sizeof(val));
+        break;
+    case CBREG_CMD_READ:
+        _RingRead(r, data, len, 1);
+        break;
+    case CBREG_CMD_PEEP:
+        _RingRead(r, data, len, 0);
+        break;
+    default:
+        break;
+    }
+}
+
+/* MPU写环形缓冲区的命令寄存器 */
+static void _RingRegWrite(McuSimRing *r, uint8_t cmd, const uint8_t *data, uint16_t len){
+    uint32_t val = 0;
+    switch(cmd){
+    case CBREG_CMD_WRITE:
+        _RingWrite(r, data, len);
+        break;
+    case CBREG_CMD_CLEAN:
+        r->head = r->used = 0;
+        break;
+    case CBREG_CMD_READAIR:
+        memcpy(&val, data, len < sizeof(val) ? len : sizeof(val));
+        _RingRead(r, NULL, val, 1);
+        break;
+    default:
+        break;
+    }
+}
+
+/*============================== 寄存器 ==============================*/
+
+static void _InitRegs(McuSim *sim){
+    McuInfo *info = (McuInfo *)(sim->reg + ROREG_INFO_START);
+    MpuBusinessReg *biz = (MpuBusinessReg *)(sim->reg + RWREG_MPU_BUSINESS_REG_START);
+    BurnStaReg *burn = (BurnStaReg *)(sim->reg + RWREG_BURN_START);
+
+    memset(sim->reg, 0, sizeof(sim->reg));
+    info->software_version.major = 1;
+    strcpy(info->sn, "SIM00000000");
+    info->partition = BFP_APP_A;
+    strcpy(info->software_model, MCU_SIM_NAME);
+    biz->is_allow_send = 1;
+    burn->burn_mode = BURNMODE_FORBID;
+}
+
+/* 烧写状态机，MPU写了 RWREG_BURN_START 之后运行 */
+static void _BurnProc(McuSim *sim){
+    BurnStaReg *burn = (BurnStaReg *)(sim->reg + RWREG_BURN_START);
+    McuInfo *info = (McuInfo *)(sim->reg + ROREG_INFO_START);
+    McuSimRing *r = &sim->ring[SIM_RING_BURN];
+
+    switch(burn->burn_mode){
+    case BURNMODE_APP_GOTO_BOOTLOADER:
+        /* 模拟器直接"重启"到bootloader, 不限制烧写分区 */
+        info->partition = BFP_BOOT;
+        burn->burn_mode = BURNMODE_WAIT_BURN;
+        burn->parameter = 0;
+        break;
+    case BURNMODE_START_ERASE:
+        _Stall(sim);
+        sim->stat.burn_bytes = 0;
+        burn->burn_mode = BURNMODE_ERASE_OK;
+        burn->parameter = MBMERROR_OK;
+        break;
+    case BURNMODE_START_BURN:
+        r->head = r->used = 0;
+        break;
+    case BURNMODE_FINISH_TRANSFER:
+        sim->stat.burn_bytes += _RingRead(r, NULL, r->used, 1);
+        burn->burn_mode = sim->stat.burn_bytes ? BURNMODE_FINISH_BURN : BURNMODE_BURN_ERROR;
+        burn->parameter = sim->stat.burn_bytes ? MBMERROR_OK : MBMERROR_OTHER_ERROR;
+        break;
+    case BURNMODE_EXIT_BURN:
+        info->partition = BFP_APP_A;
+        burn->burn_mode = BURNMODE_FORBID;
+        burn->parameter = 0;
+        break;
+    default:
+        break;
+    }
+}
+
+/* MpuBusinessReg 中需要MCU响应的字段 */
+static void _BusinessProc(McuSim *sim){
+    MpuBusinessReg *biz = (MpuBusinessReg *)(sim->reg + RWREG_MPU_BUSINESS_REG_START);
+    if(biz->reset_mcu){
+        biz->reset_mcu = 0;
+        sim->stat.resets++;
+    }
+    /* 擦除立即完成，只有设置了损伤时MCU忙一段时间 */
+    if(biz->nvm_erase != MNES_IDLE){
+        _Stall(sim);
+        biz->nvm_erase = MNES_IDLE;
+    }
+}
+
+/* 写入后MCU侧的处理: 发出的CAN报文、烧写数据 */
+static void _AfterWrite(McuSim *sim, uint16_t reg_addr, uint16_t reg_cnt){
+    McuSimRing *send = &sim->ring[SIM_RING_SEND_CAN];
+    McuSimRing *burn_ring = &sim->ring[SIM_RING_BURN];
+    BurnStaReg *burn = (BurnStaReg *)(sim->reg + RWREG_BURN_START);
+    uint8_t buf[MCU_SIM_RING_SIZE];
+    uint32_t len;
+
+    if(send->used){
+        len = _RingRead(send, buf, send->used, 1);
+        sim->stat.can_tx += len / sizeof(PCanMsg);
+        if(sim->can_loopback)
+            _RingWrite(&sim->ring[SIM_RING_RECEIVE_CAN], buf, len);
+    }
+    if(burn->burn_mode == BURNMODE_START_BURN && burn_ring->used)
+        sim->stat.burn_bytes += _RingRead(burn_ring, NULL, burn_ring->used, 1);
+
+    if(reg_addr < RWREG_BURN_START + sizeof(BurnStaReg) && reg_addr + reg_cnt > RWREG_BURN_START)
+        _BurnProc(sim);
+    if(reg_addr < RWREG_MPU_BUSINESS_REG_START + sizeof(MpuBusinessReg) &&
+        reg_addr + reg_cnt > RWREG_MPU_BUSINESS_REG_START)
+        _BusinessProc(sim);
+}
+
+static void _RegRead(McuSim *sim, uint16_t reg_addr, uint8_t *data, uint16_t reg_cnt){
+    McuSimRing *r = _FindRing(sim, reg_addr);
+    uint32_t cnt;
+    if(r){
+        _RingRegRead(r, (uint8_t)(reg_addr - r->cb_addr), data, reg_cnt);
+        return;
+    }
+    cnt = reg_addr + reg_cnt > MCU_SIM_REG_SPACE ? MCU_SIM_REG_SPACE - reg_addr : reg_cnt;
+    memcpy(data, sim->reg + reg_addr, cnt);
+    memset(data + cnt, 0, reg_cnt - cnt);
+}
+
+static void _RegWrite(McuSim *sim, uint16_t reg_addr, const uint8_t *data, uint16_t reg_cnt){
+    McuSimRing *r = _FindRing(sim, reg_addr);
+    uint32_t cnt;
+    if(r){
+        _RingRegWrite(r, (uint8_t)(reg_addr - r->cb_addr), data, reg_cnt);
+    }else{
+        cnt = reg_addr + reg_cnt > MCU_SIM_REG_SPACE ? MCU_SIM_REG_SPACE - reg_addr : reg_cnt;
+        memcpy(sim->reg + reg_addr, data, cnt);
+    }
+    _AfterWrite(sim, reg_addr, reg_cnt);
+}
+
+/*============================== 协议 ==============================*/
+
+/* 放进串口发送队列，有损伤时按字节丢弃，并给每个字节定好可以读到的时间 */
+static void _UartOut(McuSim *sim, const uint8_t *data, int len){
+    uint64_t at = 0;
+    int i;
+    if(sim->uart_out_len + len > MCU_SIM_UART_BUF) return;
+    if(sim->impaired){
+        at = _NowNs() + (uint64_t)sim->impair.ack_delay_us * 1000ULL;
+        if(sim->impair.ack_jitter_us)
+            at += (_Rand(sim) % ((uint64_t)sim->impair.ack_jitter_us + 1)) * 1000ULL;
+        if(at < sim->busy_until) at = sim->busy_until;
+        /* 串口是按顺序发的，不能早于前面的字节 */
+        if(sim->uart_out_len && at < sim->uart_out_at[sim->uart_out_len - 1])
+            at = sim->uart_out_at[sim->uart_out_len - 1];
+    }
+    for(i = 0; i < len; i++){
+        if(sim->impaired && _Chance(sim, sim->impair.ack_drop_ppm)){
+            sim->stat.ack_drops++;
+            continue;
+        }
+        sim->uart_out[sim->uart_out_len] = data[i];
+        sim->uart_out_at[sim->uart_out_len] = at;
+        sim->uart_out_len++;
+    }
+}
+
+static void _Ack(McuSim *sim, uint8_t ack, uint8_t tag){
+    uint8_t buf[SPI_TAG_ACK_LEN] = {ack, tag};
+    _UartOut(sim, buf, tag == SPI_TAG_NONE ? 1 : SPI_TAG_ACK_LEN);
+}
+
+/* 一帧最后的ACK，握手要求时后面带上CAN收发环形缓冲区的水位 */
+static void _FinalAck(McuSim *sim, uint8_t ack){
+    uint8_t buf[SPI_TAG_ACK_LEN + SPI_STATUS_LEN];
+    uint16_t rx_used = (uint16_t)sim->ring[SIM_RING_RECEIVE_CAN].used;
+    uint16_t tx_free = (uint16_t)(MCU_SIM_RING_SIZE - sim->ring[SIM_RING_SEND_CAN].used);
+
+    if(!sim->status_ack){
+        _Ack(sim, ack, sim->tag);
+        return;
+    }
+    buf[0] = ack;
+    buf[1] = sim->tag;
+    SpiFrame_BuildStatus(buf + SPI_TAG_ACK_LEN, rx_used, tx_free);
+    _UartOut(sim, buf, sizeof(buf));
+}
+
+/**
+ * @brief 处理一帧的数据段
+ * @param  cmd              命令
+ * @param  data_tx          MPU发来的数据段
+ * @param  data_rx          回给MPU的数据段
+ * @param  len              数据段长度(含CRC和填充)
+ * @return uint8_t          SPI_ACK 或 SPI_NACK
+ */
+static uint8_t _Frame(McuSim *sim, const uint8_t *cmd, const uint8_t *data_tx, uint8_t *data_rx, size_t len){
+    uint8_t code;
+    uint16_t reg_addr, reg_cnt, crc16_val;
+
+    SpiFrame_ParseCmd(cmd, &code, &reg_addr, &reg_cnt);
+    memset(data_rx, 0xff, len);
+    sim->stat.frames++;
+    if(len != SpiFrame_DataLength(reg_cnt)) goto nack;
+    crc16_val = crc16(0xffff, cmd, CMD_WR_CMD_LEN);
+
+    if(code == SPI_CMD_READ_REG || code == SPI_CMD_READ_REG_V2){
+        _RegRead(sim, reg_addr, data_rx, reg_cnt);
+        crc16_val = crc16(crc16_val, data_rx, reg_cnt);
+        SET_MEM_VAL_TYPE_SYSTEM_TO_BIG(data_rx + reg_cnt, crc16_val, uint16_t);
+    }else if(code == SPI_CMD_WRITE_REG || code == SPI_CMD_WRITE_REG_V2){
+        crc16_val = crc16(crc16_val, data_tx, reg_cnt);
+        if(SpiFrame_GetTailCrc(data_tx + reg_cnt) != crc16_val) goto nack;
+        _RegWrite(sim, reg_addr, data_tx, reg_cnt);
+    }else{
+        goto nack;
+    }
+    sim->stat.bytes += reg_cnt;
+    return SPI_ACK;
+nack:
+    sim->stat.nacks++;
+    return SPI_NACK;
+}
+
+/* 接收缓冲区到了 uart_notify 水位就通知MPU一次，读到水位以下再重新允许通知，只在两帧之间发 */
+static void _NotifyCheck(McuSim *sim){
+    MpuBusinessReg *biz = (MpuBusinessReg *)(sim->reg + RWREG_MPU_BUSINESS_REG_START);
+    uint32_t mark = (uint32_t)biz->uart_notify * sizeof(PCanMsg);
+    uint8_t ch = SPI_NOTIFY;
+
+    if(mark == 0) return;
+    if(sim->ring[SIM_RING_RECEIVE_CAN].used < mark){
+        sim->notify_armed = 1;
+        return;
+    }
+    if(!sim->notify_armed || sim->state != MCU_SIM_IDLE) return;
+    sim->notify_armed = 0;
+    sim->stat.notifies++;
+    _UartOut(sim, &ch, 1);
+}
+
+/* 一次SPI消息(片选期间)的处理，sim->tx 是MPU发来的全部数据，回复写到 sim->rx */
+static void _Message(McuSim *sim, size_t total){
+    uint8_t code, ack, tag;
+
+    memset(sim->rx, 0xff, total);
+    switch(sim->state){
+    case MCU_SIM_WAIT_CMD:
+        if(total < SPI_CMD_LEN) break;
+        memcpy(sim->cmd, sim->tx, SPI_CMD_LEN);
+        code = sim->cmd[CMD_1BYTE_OFFSET];
+        if(code == SPI_CMD_READ_REG || code == SPI_CMD_WRITE_REG){
+            /* V1: 先只收命令，回ACK后再收数据 */
+            if(total != SPI_CMD_LEN) break;
+            sim->state = MCU_SIM_WAIT_DATA;
+            _Ack(sim, SPI_ACK, sim->tag);
+            return;
+        }
+        ack = _Frame(sim, sim->cmd, sim->tx + SPI_CMD_LEN, sim->rx + SPI_CMD_LEN, total - SPI_CMD_LEN);
+        _FinalAck(sim, ack);
+        break;
+    case MCU_SIM_WAIT_DATA:
+        ack = _Frame(sim, sim->cmd, sim->tx, sim->rx, total);
+        _FinalAck(sim, ack);
+        break;
+    case MCU_SIM_PIPE:
+        if(total < SPI_CMD_LEN) return;
+        memcpy(sim->cmd, sim->tx, SPI_CMD_LEN);
+        tag = sim->cmd[CMD_SEQ_1BYTE_OFFSET] & SPI_TAG_MASK;
+        /* 序号和控制字节相同时MPU分不清ACK，不执行 */
+        if(SPI_TAG_IS_CTRL(tag)){
+            _Ack(sim, SPI_NACK, SPI_TAG_NONE);
+            return;
+        }
+        ack = _Frame(sim, sim->cmd, sim->tx + SPI_CMD_LEN, sim->rx + SPI_CMD_LEN, total - SPI_CMD_LEN);
+        _Ack(sim, ack, tag);
+        /* 流水线一直持续到下一次握手 */
+        return;
+    case MCU_SIM_QUIET:
+        if(total < SPI_CMD_LEN) break;
+        memcpy(sim->cmd, sim->tx, SPI_CMD_LEN);
+        code = sim->cmd[CMD_1BYTE_OFFSET];
+        if(code != SPI_CMD_READ_REG_V2 && code != SPI_CMD_WRITE_REG_V2) break;
+        /* 结果只靠MPU校验CRC */
+        _Frame(sim, sim->cmd, sim->tx + SPI_CMD_LEN, sim->rx + SPI_CMD_LEN, total - SPI_CMD_LEN);
+        break;
+    default:
+        /* 没有握手，MCU不理会 */
+        return;
+    }
+    sim->state = MCU_SIM_IDLE;
+    _NotifyCheck(sim);
+}
+
+/**
+ * @brief MPU通过串口发给MCU的字节(握手)
+ */
+void McuSim_UartWrite(McuSim *sim, const uint8_t *data, int len){
+    int i;
+    pthread_mutex_lock(&sim->mutex);
+    for(i = 0; i < len; i++){
+        if(sim->tag_start){
+            /* 带序号握手的第二个字节 */
+            sim->tag = data[i] & SPI_TAG_MASK;
+            if(SPI_TAG_IS_CTRL(sim->tag)){
+                /* 和控制字节相同的序号分不清，拒绝这次握手 */
+                sim->tag = SPI_TAG_NONE;
+                sim->state = MCU_SIM_IDLE;
+                sim->tag_start = 0;
+                _Ack(sim, SPI_NACK, SPI_TAG_NONE);
+                continue;
+            }
+            sim->status_ack = sim->tag_start == SPI_CMD_TAG_START && (data[i] & SPI_TAG_STATUS);
+            sim->state = sim->tag_start == SPI_CMD_TAG_START ? MCU_SIM_WAIT_CMD : MCU_SIM_PIPE;
+            sim->tag_start = 0;
+            _Ack(sim, SPI_ACK, sim->tag);
+            continue;
+        }
+        if(data[i] == SPI_CMD_TAG_START || data[i] == SPI_CMD_TAG_PIPE_START){
+            sim->tag_start = data[i];
+            continue;
+        }
+        if(data[i] == SPI_CMD_START || data[i] == SPI_CMD_PIPE_START || data[i] == SPI_CMD_QUIET_START){
+            sim->tag = SPI_TAG_NONE;
+            sim->status_ack = 0;
+        }
+        if(data[i] == SPI_CMD_START){
+            sim->state = MCU_SIM_WAIT_CMD;
+            _Ack(sim, SPI_ACK, SPI_TAG_NONE);
+        }else if(data[i] == SPI_CMD_PIPE_START){
+            sim->state = MCU_SIM_PIPE;
+            _Ack(sim, SPI_ACK, SPI_TAG_NONE);
+        }else if(data[i] == SPI_CMD_QUIET_START){
+            sim->state = MCU_SIM_QUIET;
+        }
+    }
+    pthread_mutex_unlock(&sim->mutex);
+}
+
+/**
+ * @brief MPU读MCU通过串口回复的字节，MCU是同步处理的，没有数据就是超时
+ *        有损伤时只读到已经到时间的字节
+ * @return int              读到的字节数
+ */
+int McuSim_UartRead(McuSim *sim, uint8_t *buf, int len){
+    uint64_t now;
+    int ready;
+    pthread_mutex_lock(&sim->mutex);
+    ready = sim->uart_out_len;
+    if(sim->impaired){
+        now = _NowNs();
+        for(ready = 0; ready < sim->uart_out_len && sim->uart_out_at[ready] <= now; ready++);
+    }
+    if(len > ready) len = ready;
+    memcpy(buf, sim->uart_out, len);
+    memmove(sim->uart_out, sim->uart_out + len, sim->uart_out_len - len);
+    memmove(sim->uart_out_at, sim->uart_out_at + len, (sim->uart_out_len - len) * sizeof(uint64_t));
+    sim->uart_out_len -= len;
+    pthread_mutex_unlock(&sim->mutex);
+    return len;
+}
+
+/**
+ * @brief 离下一个回复字节可以读到还有多久
+ * @return int64_t          微秒, 0为已经可以读 没有待发的字节返回-1
+ */
+int64_t McuSim_UartWaitUs(McuSim *sim){
+    uint64_t now;
+    int64_t ret = -1;
+    pthread_mutex_lock(&sim->mutex);
+    if(sim->uart_out_len){
+        now = _NowNs();
+        ret = sim->uart_out_at[0] > now ? (int64_t)((sim->uart_out_at[0] - now + 999) / 1000) : 0;
+    }
+    pthread_mutex_unlock(&sim->mutex);
+    return ret;
+}
+
+void McuSim_UartInClean(McuSim *sim){
+    pthread_mutex_lock(&sim->mutex);
+    sim->uart_out_len = 0;
+    pthread_mutex_unlock(&sim->mutex);
+}
+
+/**
+ * @brief 一次SPI消息，各段拼起来处理后再按段回填 rx
+ * @return int              传输的总长度 超过 MCU_SIM_MSG_MAX 返回-1
+ */
+int McuSim_Xfer(McuSim *sim, struct spi_ioc_transfer *xfer, int n){
+    size_t total = 0, off = 0;
+    uint64_t bit = 0;
+    int i, flip;
+
+    for(i = 0; i < n; i++)
+        total += xfer[i].len;
+    if(total > MCU_SIM_MSG_MAX) return -1;
+
+    pthread_mutex_lock(&sim->mutex);
+    for(i = 0; i < n; i++){
+        if(xfer[i].tx_buf) memcpy(sim->tx + off, (const void *)(uintptr_t)xfer[i].tx_buf, xfer[i].len);
+        else memset(sim->tx + off, 0, xfer[i].len);
+        off += xfer[i].len;
+    }
+    /* 翻转的bit落在MPU发出的数据上由MCU发现，落在回复上由MPU发现 */
+    flip = sim->impaired && total && _Chance(sim, sim->impair.flip_ppm);
+    if(flip){
+        bit = _Rand(sim) % (total * 16);     /* 最低位选方向，其余是bit位置 */
+        sim->stat.flips++;
+        if(bit & 1) sim->tx[bit / 16] ^= (uint8_t)(1u << (bit / 2 % 8));
+    }
+    _Message(sim, total);
+    if(flip && !(bit & 1)) sim->rx[bit / 16] ^= (uint8_t)(1u << (bit / 2 % 8));
+    for(i = 0, off = 0; i < n; i++){
+        if(xfer[i].rx_buf) memcpy((void *)(uintptr_t)xfer[i].rx_buf, sim->rx + off, xfer[i].len);
+        off += xfer[i].len;
+    }
+    pthread_mutex_unlock(&sim->mutex);
+    return (int)total;
+}
+
+/**
+ * @brief 模拟总线上收到CAN报文，放进接收缓冲区
+ * @return int              放进去的字节数
+ */
+int McuSim_InjectCan(McuSim *sim, const void *can_msg, uint32_t len){
+    int ret;
+    pthread_mutex_lock(&sim->mutex);
+    ret = (int)_RingWrite(&sim->ring[SIM_RING_RECEIVE_CAN], (const uint8_t *)can_msg, len);
+    _NotifyCheck(sim);
+    pthread_mutex_unlock(&sim->mutex);
+    return ret;
+}
+
+void McuSim_GetStat(McuSim *sim, McuSimStat *stat){
+    pthread_mutex_lock(&sim->mutex);
+    *stat = sim->stat;
+    pthread_mutex_unlock(&sim->mutex);
+}
+
+/**
+ * @brief 解析损伤配置，格式 key=value 用逗号分隔，没写的为0
+ *        seed delay(us) jitter(us) drop(ppm) flip(ppm) stall(ms)
+ * @return int              成功0 有不认识的key返回-1
+ */
+int McuSim_ParseImpair(const char *str, McuSimImpair *imp){
+    char buf[256], *tok, *save = NULL, *val;
+    unsigned long long v;
+
+    memset(imp, 0, sizeof(McuSimImpair));
+    strncpy(buf, str, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    for(tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+        val = strchr(tok, '=');
+        if(val == NULL) return -1;
+        *val++ = '\0';
+        v = strtoull(val, NULL, 0);
+        if(strcmp(tok, "seed") == 0) imp->seed = v;
+        else if(strcmp(tok, "delay") == 0) imp->ack_delay_us = (uint32_t)v;
+        else if(strcmp(tok, "jitter") == 0) imp->ack_jitter_us = (uint32_t)v;
+        else if(strcmp(tok, "drop") == 0) imp->ack_drop_ppm = (uint32_t)v;
+        else if(strcmp(tok, "flip") == 0) imp->flip_ppm = (uint32_t)v;
+        else if(strcmp(tok, "stall") == 0) imp->erase_stall_ms = (uint32_t)v;
+        else return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 设置链路损伤，随机序列从seed重新开始
+ * @param  imp              NULL关闭损伤
+ */
+void McuSim_SetImpair(McuSim *sim, const McuSimImpair *imp){
+    pthread_mutex_lock(&sim->mutex);
+    sim->impaired = imp != NULL;
+    if(imp){
+        sim->impair = *imp;
+        sim->rng = imp->seed ? imp->seed : 1;
+    }
+    pthread_mutex_unlock(&sim->mutex);
+}
+
+McuSim *McuSim_New(void){
+    McuSimImpair imp;
+    const char *env;
+    McuSim *sim = (McuSim *)calloc(1, sizeof(McuSim));
+    if(sim == NULL) return NULL;
+    pthread_mutex_init(&sim->mutex, NULL);
+    sim->state = MCU_SIM_IDLE;
+    sim->tag = SPI_TAG_NONE;
+    sim->notify_armed = 1;
+    sim->can_loopback = 1;
+    sim->ring[SIM_RING_SEND_CAN].cb_addr = RWREG_CB_MPU_BUSINESS_SEND_CAN_START;
+    sim->ring[SIM_RING_RECEIVE_CAN].cb_addr = RWREG_CB_MPU_BUSINESS_RECEIVE_CAN_START;
+    sim->ring[SIM_RING_BURN].cb_addr = RWREG_CB_BURN_START;
+    _InitRegs(sim);
+    env = getenv(MCU_SIM_IMPAIR_ENV);
+    if(env && env[0] && McuSim_ParseImpair(env, &imp) == 0)
+        McuSim_SetImpair(sim, &imp);
+    return sim;
+}
+
+void McuSim_Free(McuSim *sim){
+    if(sim == NULL) return;
+    pthread_mutex_destroy(&sim->mutex);
+    free(sim);
+}
+
+/*============================== SpiTrans ==============================*/
+
+static int _SimXfer(SpiTrans *t, struct spi_ioc_transfer *xfer, int n){
+    return McuSim_Xfer((McuSim *)t->priv, xfer, n);
+}
+
+static int _SimUartWrite(SpiTrans *t, const uint8_t *data, int len){
+    McuSim_UartWrite((McuSim *)t->priv, data, len);
+    return len;
+}
+
+/* 没有损伤时同步返回，有损伤时按回复字节的时间等待，等不到就和真实串口一样超时，不区分忙等 */
+static int _SimUartRead(SpiTrans *t, uint8_t *buf, int len, int timeout, uint32_t spin_us){
+    McuSim *sim = (McuSim *)t->priv;
+    int64_t wait;
+    (void)spin_us;
+    if(!sim->impaired) return McuSim_UartRead(sim, buf, len);
+    wait = McuSim_UartWaitUs(sim);
+    if(wait < 0 || wait > (int64_t)timeout * 1000){
+        if(timeout > 0) usleep((useconds_t)timeout * 1000);
+        return McuSim_UartRead(sim, buf, len);
+    }
+    if(wait > 0) usleep((useconds_t)wait);
+    return McuSim_UartRead(sim, buf, len);
+}
+
+static void _SimUartInClean(SpiTrans *t){
+    McuSim_UartInClean((McuSim *)t->priv);
+}
+
+/* 没有fd可以poll，按回复字节的时间睡，没有待发的字节时隔一段时间看一次 */
+static int _SimUartWait(SpiTrans *t, int timeout){
+    McuSim *sim = (McuSim *)t->priv;
+    uint64_t end = _NowNs() + (uint64_t)(timeout < 0 ? 0 : timeout) * 1000000ULL, now;
+    int64_t wait;
+
+    while(1){
+        wait = McuSim_UartWaitUs(sim);
+        if(wait == 0) return 1;
+        now = _NowNs();
+        if(timeout >= 0 && now >= end) return 0;
+        if(wait < 0 || wait > SIM_UART_WAIT_POLL_US) wait = SIM_UART_WAIT_POLL_US;
+        if(timeout >= 0 && (uint64_t)wait * 1000ULL > end - now) wait = (int64_t)((end - now + 999) / 1000);
+        usleep((useconds_t)wait);
+    }
+}
+
+static void _SimClose(SpiTrans *t){
+    McuSim_Free((McuSim *)t->priv);
+    t->priv = NULL;
+}
+
+static const SpiTransOps sim_ops = {
+    .xfer = _SimXfer,
+    .uart_write = _SimUartWrite,
+    .uart_read = _SimUartRead,
+    .uart_in_clean = _SimUartInClean,
+    .uart_wait = _SimUartWait,
+    .close = _SimClose,
+};
+
+/**
+ * @brief 打开一个进程内的模拟MCU作为传输，锁文件名带上pid, 不同进程的模拟器互不影响
+ * @param  t                传输
+ * @return int              成功0 失败负数
+ */
+int SpiTrans_OpenSim(SpiTrans *t){
+    memset(t, 0, sizeof(SpiTrans));
+    t->priv = McuSim_New();
+    if(t->priv == NULL) return -1;
+    snprintf(t->name, sizeof(t->name), "%s.%d", MCU_SIM_NAME, (int)getpid());
+    t->max_msg = MCU_SIM_MSG_MAX;
+    t->spi_fd = t->uart_fd = -1;
+    t->ops = &sim_ops;
+    return 0;
+}
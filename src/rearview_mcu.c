@@ -13,13 +13,22 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <fcntl.h>
 #include <unistd.h>
 
 #include "spi_reg.h"
+#include "rvm_broker.h"
+#include "rvm_stats.h"
+#include "mcu_sim.h"
+#include "spi_cap.h"
 #include "regwr_cb.h"
 #include "debug.h"
 
@@ -32,14 +41,160 @@
 #define RVM_SPI_PATH "/dev/spidev3.0"
 #define RVM_UART_PATH "/dev/ttyS1"
 #define RVM_SPI_SPEED 10000000
+#define RVM_SIM_ENV "RVMCU_SIM"
+/* 设备路径可以用环境变量改，例如指向 mcu_emu 的socket和伪终端 */
+#define RVM_SPI_DEV_ENV "RVMCU_SPI_DEV"
+#define RVM_UART_DEV_ENV "RVMCU_UART_DEV"
+/* 自适应时钟的范围 */
+#define RVM_SPI_SPEED_MIN 2000000
+#define RVM_SPI_SPEED_MAX 20000000
+/* CAN收发缓冲区的使用权: /run/lock/<spi设备名>__<串口设备名>.ring.lock */
+#define RVM_RING_LOCK_DIR "/run/lock/"
 
 static SpiRegHandle spiRegHandle;
+static uint32_t rvm_frame_size = SPI_RT_MSG_MAX_SIZE;
+/* 代理在运行时所有访问都转给代理，不直接打开设备 */
+static RvmbClient rvmbClient;
+static int rvm_allow_broker = 1;
+static int rvm_on_broker = 0;
+/* 不访问硬件，用进程内的模拟MCU */
+static int rvm_use_sim = 0;
+static const char *rvm_capture = NULL;
+static int rvm_stats = 0;
+/* 共享内存统计页，打不开时不统计 */
+static RvmStats rvmStats = { .fd = -1, .page = NULL };
+
+/* 环形缓冲区用于CAN报文和固件烧写这类大批量数据，排在低优先级 */
+static int _ReadRegBulk(uint16_t reg_addr,  uint8_t *reg_data, uint16_t reg_cnt, uint32_t timeout){
+    return RVMcu_ReadRegEx(reg_addr, reg_data, reg_cnt, timeout, SPIREG_PRIO_BULK);
+}
+
+static int _WriteRegBulk(uint16_t reg_addr, const uint8_t *reg_data, uint16_t reg_cnt, uint32_t timeout){
+    return RVMcu_WriteRegEx(reg_addr, reg_data, reg_cnt, timeout, SPIREG_PRIO_BULK);
+}
+
+static void _RingSizeReport(uint16_t cb_addr, int is_free, uint32_t size){
+    RvmStats_Ring(&rvmStats, cb_addr, is_free, size);
+}
+
+/* 
+ * CAN收发缓冲区的使用权，进程间用锁文件协调:
+ * 普通进程第一次收发CAN时加共享锁，打开带状态的ACK的进程加独占锁，
+ * 独占时其他进程不能再收发CAN，缓存的容量只会被本进程消耗
+ */
+typedef enum{
+    RVM_RING_NONE = 0,                  /* 还没有收发过CAN */
+    RVM_RING_SHARED,                    /* 和其他进程共用 */
+    RVM_RING_OWNED,                     /* 本进程独占 */
+    RVM_RING_BUSY,                      /* 被其他进程独占 */
+}RvmRingState;
+
+enum{
+    RVM_RING_SEND = 0,
+    RVM_RING_RECEIVE,
+    RVM_RING_CNT,
+};
+
+static int rvm_ring_fd = -1;
+static int rvm_ring_state = RVM_RING_NONE;
+static pthread_mutex_t rvm_ring_state_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* 取容量和随后的读写之间不能有本进程的其他线程插进来 */
+static pthread_mutex_t rvm_ring_mutex[RVM_RING_CNT] = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER};
+
+static const char *_DevBase(const char *path){
+    const char *p = strrchr(path, '/');
+    return p ? p + 1 : path;
+}
 
+static char *_DevPath(const char *env, const char *def){
+    const char *path = getenv(env);
+    return (char *)((path && path[0]) ? path : def);
+}
+
+/* 加锁文件，调用时持有 rvm_ring_state_mutex。模拟的MCU在进程内，缓冲区本来就是独占的 */
+static int _RingLockLocked(int exclusive){
+    char path[256];
+    if(rvm_use_sim || getenv(RVM_SIM_ENV)){
+        __atomic_store_n(&rvm_ring_state, exclusive ? RVM_RING_OWNED : RVM_RING_SHARED, __ATOMIC_RELEASE);
+        return 0;
+    }
+    if(rvm_ring_fd < 0){
+        snprintf(path, sizeof(path), "%s%s__%s.ring.lock", RVM_RING_LOCK_DIR, 
+            _DevBase(_DevPath(RVM_SPI_DEV_ENV, RVM_SPI_PATH)), _DevBase(_DevPath(RVM_UART_DEV_ENV, RVM_UART_PATH)));
+        rvm_ring_fd = open(path, O_CREAT | O_RDWR | O_CLOEXEC, 0666);
+        if(rvm_ring_fd < 0){
+            /* 没有锁文件就没法知道有没有其他使用者，只能共用 */
+            if(!exclusive) __atomic_store_n(&rvm_ring_state, RVM_RING_SHARED, __ATOMIC_RELEASE);
+            return exclusive ? -1 : 0;
+        }
+    }
+    if(flock(rvm_ring_fd, (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB) == 0){
+        __atomic_store_n(&rvm_ring_state, exclusive ? RVM_RING_OWNED : RVM_RING_SHARED, __ATOMIC_RELEASE);
+        return 0;
+    }
+    if(errno != EWOULDBLOCK) return -1;
+    /* 共享锁换独占失败时内核已经放掉了原来的锁，重新加上 */
+    if(exclusive && rvm_ring_state == RVM_RING_SHARED && flock(rvm_ring_fd, LOCK_SH | LOCK_NB) == 0)
+        return -1;
+    if(!exclusive || rvm_ring_state == RVM_RING_SHARED)
+        __atomic_store_n(&rvm_ring_state, RVM_RING_BUSY, __ATOMIC_RELEASE);
+    return -1;
+}
+
+/* 开始一次CAN收发缓冲区操作，被其他进程独占时返回-1，独占的进程退出后自动恢复 */
+static int _RingEnter(int ring){
+    int state = __atomic_load_n(&rvm_ring_state, __ATOMIC_ACQUIRE);
+    if(state == RVM_RING_NONE || state == RVM_RING_BUSY){
+        pthread_mutex_lock(&rvm_ring_state_mutex);
+        if(rvm_ring_state == RVM_RING_NONE || rvm_ring_state == RVM_RING_BUSY) _RingLockLocked(0);
+        state = rvm_ring_state;
+        pthread_mutex_unlock(&rvm_ring_state_mutex);
+    }
+    if(state == RVM_RING_BUSY){
+        rvm_debug("CAN收发缓冲区被其他进程独占");
+        return -1;
+    }
+    pthread_mutex_lock(&rvm_ring_mutex[ring]);
+    return 0;
+}
+
+static int _RingLeave(int ring, int ret){
+    pthread_mutex_unlock(&rvm_ring_mutex[ring]);
+    return ret;
+}
+
+/**
+ * CAN收发缓冲区的容量用最后ACK带回的状态，其他缓冲区照常查询。
+ * 只有独占缓冲区时才用: 每帧开始时状态就作废，只由这一帧的ACK补上，
+ * 所以留下的总是本进程最近一次操作之后的水位，之后只有MCU往接收缓冲区放、从发送缓冲区取
+ */
+static int _RingCachedSize(uint16_t cb_addr, int is_free, uint32_t *size){
+    SpiRegStatus status;
+    if(__atomic_load_n(&rvm_ring_state, __ATOMIC_ACQUIRE) != RVM_RING_OWNED ||
+        rvm_on_broker || SpiReg_GetStatus(&spiRegHandle, &status) < 0) return -1;
+    if(cb_addr == RWREG_CB_MPU_BUSINESS_RECEIVE_CAN_START && !is_free){
+        *size = status.rx_used;
+        return 0;
+    }
+    if(cb_addr == RWREG_CB_MPU_BUSINESS_SEND_CAN_START && is_free){
+        *size = status.tx_free;
+        return 0;
+    }
+    return -1;
+}
 static RegWrCbHandle regWrCbHandle = {
-    .read_reg = &RVMcu_ReadReg,
-    .write_reg = &RVMcu_WriteReg
+    .read_reg = &_ReadRegBulk,
+    .write_reg = &_WriteRegBulk,
+    .size_report = &_RingSizeReport,
+    .cached_size = &_RingCachedSize,
 };
 
+/* CAN收发的返回值是报文数量，顺便计数 */
+static int _CanCount(int ret, int is_tx){
+    if(ret > 0) RvmStats_Can(&rvmStats, is_tx ? 0 : (uint32_t)ret, is_tx ? (uint32_t)ret : 0);
+    return ret;
+}
+
 /* 获取烧写固件分区,成功返回分区枚举 */
 static int _GetBurnFirmwarePart(const char* mcu_firmware_path){
     uint8_t  head_data[0x1000];
@@ -164,7 +319,18 @@ burn_out:
 }
 
 int RVMcu_ReadReg(uint16_t reg_addr,  uint8_t *reg_data, uint16_t reg_cnt, uint32_t timeout){
-    return SpiReg_Read(&spiRegHandle, reg_addr, reg_cnt, reg_data, timeout);
+    return RVMcu_ReadRegEx(reg_addr, reg_data, reg_cnt, timeout, SPIREG_PRIO_INTERACTIVE);
+}
+
+/**
+ * @brief  按指定优先级读MCU寄存器
+ * @param  prio             SPIREG_PRIO_XXX
+ * @return int 
+ */
+int RVMcu_ReadRegEx(uint16_t reg_addr,  uint8_t *reg_data, uint16_t reg_cnt, uint32_t timeout, int prio){
+    if(rvm_on_broker)
+        return RvmBroker_Read(&rvmbClient, reg_addr, reg_data, reg_cnt, timeout, (SpiRegPrio)prio);
+    return SpiReg_ReadEx(&spiRegHandle, reg_addr, reg_cnt, reg_data, timeout, (SpiRegPrio)prio);
 }
 
 /**
@@ -176,7 +342,52 @@ int RVMcu_ReadReg(uint16_t reg_addr,  uint8_t *reg_data, uint16_t reg_cnt, uint3
  * @return int 
  */
 int RVMcu_WriteReg(uint16_t reg_addr, const uint8_t *reg_data, uint16_t reg_cnt, uint32_t timeout){
-    return SpiReg_Write(&spiRegHandle, reg_addr, reg_cnt, reg_data, timeout);
+    return RVMcu_WriteRegEx(reg_addr, reg_data, reg_cnt, timeout, SPIREG_PRIO_INTERACTIVE);
+}
+
+/**
+ * @brief  按指定优先级写MCU寄存器
+ * @param  prio             SPIREG_PRIO_XXX
+ * @return int 
+ */
+int RVMcu_WriteRegEx(uint16_t reg_addr, const uint8_t *reg_data, uint16_t reg_cnt, uint32_t timeout, int prio){
+    if(rvm_on_broker)
+        return RvmBroker_Write(&rvmbClient, reg_addr, reg_data, reg_cnt, timeout, (SpiRegPrio)prio);
+    return SpiReg_WriteEx(&spiRegHandle, reg_addr, reg_cnt, reg_data, timeout, (SpiRegPrio)prio);
+}
+
+/**
+ * @brief  批量读写MCU寄存器，只加一次锁，地址连续的普通寄存器会合并成一次传输
+ * @param  ops              操作数组，每个操作的结果在 ops[i].ret
+ * @param  n                操作数量
+ * @param  timeout          通信超时时间
+ * @return int              全部成功返回0，否则返回第一个失败的错误码
+ */
+int RVMcu_Transact(SpiRegOp *ops, int n, uint32_t timeout){
+    return RVMcu_TransactEx(ops, n, timeout, SPIREG_PRIO_INTERACTIVE);
+}
+
+/**
+ * @brief  按指定优先级批量读写MCU寄存器
+ * @param  prio             SPIREG_PRIO_XXX
+ * @return int 
+ */
+int RVMcu_TransactEx(SpiRegOp *ops, int n, uint32_t timeout, int prio){
+    if(rvm_on_broker)
+        return RvmBroker_Transact(&rvmbClient, ops, n, timeout, (SpiRegPrio)prio);
+    return SpiReg_TransactEx(&spiRegHandle, ops, n, timeout, (SpiRegPrio)prio);
+}
+
+/**
+ * @brief  获取某个优先级的请求排队统计
+ * @param  prio             SPIREG_PRIO_XXX
+ * @param  stat             统计输出
+ * @return int 
+ */
+int RVMcu_GetPrioStat(int prio, SpiRegPrioStat *stat){
+    /* 统计在代理进程里 */
+    if(rvm_on_broker) return -1;
+    return SpiReg_GetPrioStat(&spiRegHandle, (SpiRegPrio)prio, stat);
 }
 
 /**
@@ -186,8 +397,9 @@ int RVMcu_WriteReg(uint16_t reg_addr, const uint8_t *reg_data, uint16_t reg_cnt,
  * @return int              成功返回1 无数据0 错误负数
  */
 int RVMcu_SendCanMsg(PCanMsg *can_msg, uint32_t timeout){
-    return RegWrCb_GranWrite(&regWrCbHandle, RWREG_CB_MPU_BUSINESS_SEND_CAN_START, 
-            (uint8_t*)can_msg, sizeof(PCanMsg), 1, timeout);
+    if(_RingEnter(RVM_RING_SEND) < 0) return -1;
+    return _RingLeave(RVM_RING_SEND, _CanCount(RegWrCb_GranWrite(&regWrCbHandle, RWREG_CB_MPU_BUSINESS_SEND_CAN_START, 
+            (uint8_t*)can_msg, sizeof(PCanMsg), 1, timeout), 1));
 }
 
 /**
@@ -197,8 +409,9 @@ int RVMcu_SendCanMsg(PCanMsg *can_msg, uint32_t timeout){
  * @return int              成功返回写报文的数量，失败返回负数
  */
 int RVMcu_SendCanMsgBlock(PCanMsg *can_msg, uint32_t cnt, uint32_t timeout){
-    return RegWrCb_GranWrite(&regWrCbHandle, RWREG_CB_MPU_BUSINESS_SEND_CAN_START, 
-            (uint8_t*)can_msg, sizeof(PCanMsg), cnt, timeout);
+    if(_RingEnter(RVM_RING_SEND) < 0) return -1;
+    return _RingLeave(RVM_RING_SEND, _CanCount(RegWrCb_GranWrite(&regWrCbHandle, RWREG_CB_MPU_BUSINESS_SEND_CAN_START, 
+            (uint8_t*)can_msg, sizeof(PCanMsg), cnt, timeout), 1));
 }
 
 
@@ -209,8 +422,9 @@ int RVMcu_SendCanMsgBlock(PCanMsg *can_msg, uint32_t cnt, uint32_t timeout){
  * @return int              成功返回1 无数据0 错误负数
  */
 int RVMcu_ReceiveCanMsg(PCanMsg *can_msg, uint32_t timeout){
-    return RegWrCb_GranRead(&regWrCbHandle, RWREG_CB_MPU_BUSINESS_RECEIVE_CAN_START, 
-        (uint8_t*)can_msg, sizeof(PCanMsg), 1, timeout);
+    if(_RingEnter(RVM_RING_RECEIVE) < 0) return -1;
+    return _RingLeave(RVM_RING_RECEIVE, _CanCount(RegWrCb_GranRead(&regWrCbHandle, RWREG_CB_MPU_BUSINESS_RECEIVE_CAN_START, 
+        (uint8_t*)can_msg, sizeof(PCanMsg), 1, timeout), 0));
 }
 
 /**
@@ -221,8 +435,9 @@ int RVMcu_ReceiveCanMsg(PCanMsg *can_msg, uint32_t timeout){
  * @return int 
  */
 int RVMcu_ReceiveCanMsgBlock(PCanMsg *can_msg, uint32_t cnt,  uint32_t timeout){
-    return RegWrCb_GranRead(&regWrCbHandle, RWREG_CB_MPU_BUSINESS_RECEIVE_CAN_START, 
-        (uint8_t*)can_msg, sizeof(PCanMsg), cnt, timeout);
+    if(_RingEnter(RVM_RING_RECEIVE) < 0) return -1;
+    return _RingLeave(RVM_RING_RECEIVE, _CanCount(RegWrCb_GranRead(&regWrCbHandle, RWREG_CB_MPU_BUSINESS_RECEIVE_CAN_START, 
+        (uint8_t*)can_msg, sizeof(PCanMsg), cnt, timeout), 0));
 }
 
 /**
@@ -230,7 +445,8 @@ int RVMcu_ReceiveCanMsgBlock(PCanMsg *can_msg, uint32_t cnt,  uint32_t timeout){
  * @return int 
  */
 int RVMcu_CleanRxFifo(uint32_t timeout){
-    return RegWrCb_Clean(&regWrCbHandle, RWREG_CB_MPU_BUSINESS_RECEIVE_CAN_START, timeout);
+    if(_RingEnter(RVM_RING_RECEIVE) < 0) return -1;
+    return _RingLeave(RVM_RING_RECEIVE, RegWrCb_Clean(&regWrCbHandle, RWREG_CB_MPU_BUSINESS_RECEIVE_CAN_START, timeout));
 }
 
 
@@ -346,19 +562,27 @@ int RVMcu_WdogGetSta(int *is_on_wdog){
  * @return int 
  */
 int RVMcu_WdogConfig(int is_on_wdog){
-        int ret;
     uint8_t sta = (uint8_t) !!is_on_wdog;
     uint8_t mpu_online_cnt = 0;
-
-    RVMcu_ReadReg(RWREG_MPU_BUSINESS_REG_START + offsetof(MpuBusinessReg, mpu_online_cnt), 
+    int ret;
+    /* mpu_online_cnt 和 offline_timeout_reset 地址相邻，合并成一次写 */
+    SpiRegOp ops[2] = {
+        {.type = SPIREG_OP_WRITE, .flags = SPIREG_OPF_MERGEABLE, 
+         .reg_addr = RWREG_MPU_BUSINESS_REG_START + offsetof(MpuBusinessReg, mpu_online_cnt),
+         .reg_cnt = sizeof(mpu_online_cnt), .wdata = &mpu_online_cnt},
+        {.type = SPIREG_OP_WRITE, .flags = SPIREG_OPF_MERGEABLE, 
+         .reg_addr = RWREG_MPU_BUSINESS_REG_START + offsetof(MpuBusinessReg, offline_timeout_reset),
+         .reg_cnt = sizeof(sta), .wdata = &sta},
+    };
+
+    ret = RVMcu_ReadReg(RWREG_MPU_BUSINESS_REG_START + offsetof(MpuBusinessReg, mpu_online_cnt), 
         (uint8_t*)&mpu_online_cnt, sizeof(mpu_online_cnt), 200);
+    if(ret < 0) return ret;
     mpu_online_cnt++;
-    RVMcu_WriteReg(RWREG_MPU_BUSINESS_REG_START + offsetof(MpuBusinessReg, mpu_online_cnt), 
-        (uint8_t*)&mpu_online_cnt, sizeof(mpu_online_cnt), 200);
 
-    ret = RVMcu_WriteReg(RWREG_MPU_BUSINESS_REG_START + offsetof(MpuBusinessReg, offline_timeout_reset) ,
-         &sta, sizeof(sta), 200);
-    return ret;
+    /* 加锁或者代理失败时一个操作都没执行, ops[1].ret 还是初值0 */
+    ret = RVMcu_Transact(ops, 2, 200);
+    return ret < 0 ? ret : ops[1].ret;
 }
 
 /**
@@ -368,13 +592,14 @@ int RVMcu_WdogConfig(int is_on_wdog){
 int RVMcu_WdogFeed(void){
     static uint8_t last_cnt = 0xff;
     int ret;
+    /* 喂狗有时限，排在其他请求前面 */
     if(last_cnt == 0xff){
-        RVMcu_ReadReg(RWREG_MPU_BUSINESS_REG_START + offsetof(MpuBusinessReg, mpu_online_cnt), 
-        (uint8_t*)&last_cnt, sizeof(last_cnt), 200);
+        RVMcu_ReadRegEx(RWREG_MPU_BUSINESS_REG_START + offsetof(MpuBusinessReg, mpu_online_cnt), 
+            (uint8_t*)&last_cnt, sizeof(last_cnt), 200, SPIREG_PRIO_REALTIME);
         last_cnt++;
     }
-    ret = RVMcu_WriteReg(RWREG_MPU_BUSINESS_REG_START + offsetof(MpuBusinessReg, mpu_online_cnt), 
-        (uint8_t*)&last_cnt, sizeof(last_cnt), 200);
+    ret = RVMcu_WriteRegEx(RWREG_MPU_BUSINESS_REG_START + offsetof(MpuBusinessReg, mpu_online_cnt), 
+        (uint8_t*)&last_cnt, sizeof(last_cnt), 200, SPIREG_PRIO_REALTIME);
     last_cnt++;
     return ret;
 }
@@ -505,10 +730,285 @@ int RVMcu_SetSupplyVoltage(uint32_t mv){
         (uint8_t*)&mv, sizeof(mv), 200);
 }
 
+/**
+ * @brief 设置与MCU通信的协议版本，需要MCU固件支持
+ * @param  proto_ver        1:V1协议(默认) 2:V2协议,命令和数据一次传输
+ * @return int 
+ */
+int RVMcu_SetSpiProto(int proto_ver){
+    /* 通信参数由代理决定 */
+    if(rvm_on_broker) return 0;
+    return SpiReg_SetProto(&spiRegHandle, (SpiRegProto)proto_ver, 0);
+}
+
+/**
+ * @brief 设置进程间的仲裁方式，需要在 RVMcu_Init 之后、开始通信之前调用
+ * @param  mode             SPIREG_LOCK_FLOCK(默认) SPIREG_LOCK_SHM
+ * @return int 
+ */
+int RVMcu_SetLockMode(int mode){
+    /* 通信参数由代理决定 */
+    if(rvm_on_broker) return 0;
+    return SpiReg_SetLockMode(&spiRegHandle, (SpiRegLockMode)mode);
+}
+
+/**
+ * @brief 设置流水线深度，需要先切到V2协议，MCU固件需要支持带序号的ACK
+ * @param  depth            最多未确认的帧数量 1为关闭
+ * @return int 
+ */
+int RVMcu_SetPipeline(int depth){
+    /* 通信参数由代理决定 */
+    if(rvm_on_broker) return 0;
+    if(depth <= 0 || depth > SPIREG_PIPE_MAX_DEPTH) return -1;
+    return SpiReg_SetPipeline(&spiRegHandle, (uint8_t)depth);
+}
+
+/**
+ * @brief 打开或关闭无ACK读，需要先切到V2协议，MCU固件需要支持'Q'握手
+ *        打开时会用ACK模式读几十次MCU信息校准等待时间
+ * @param  enable           1:打开 0:关闭
+ * @return int 
+ */
+int RVMcu_SetAckless(int enable){
+    /* 通信参数由代理决定 */
+    if(rvm_on_broker) return 0;
+    return SpiReg_SetAckless(&spiRegHandle, enable, ROREG_INFO_START);
+}
+
+/**
+ * @brief 获取无ACK读的校准结果和统计
+ * @return int              使用代理时返回-1
+ */
+int RVMcu_GetAckless(SpiRegAckless *stat){
+    if(rvm_on_broker) return -1;
+    return SpiReg_GetAckless(&spiRegHandle, stat);
+}
+
+/**
+ * @brief 打开或关闭带序号的ACK，需要MCU固件支持'T'握手，打开后传输中不再清空串口
+ * @param  enable           1:打开 0:关闭(默认)
+ * @return int 
+ */
+int RVMcu_SetTaggedAck(int enable){
+    /* 通信参数由代理决定 */
+    if(rvm_on_broker) return 0;
+    return SpiReg_SetTaggedAck(&spiRegHandle, enable);
+}
+
+/**
+ * @brief 打开或关闭带状态的ACK，每帧最后的ACK带回CAN收发缓冲区的水位，
+ *        收发CAN报文时在有效期内不再单独查询容量，需要MCU固件支持
+ *        缓存的容量只有一个使用者时才准，打开时本进程独占CAN收发缓冲区，之后其他进程收发CAN会失败
+ * @param  fresh_us         状态有效的微秒数 0:关闭(默认)，同时放开独占
+ * @return int              成功0 其他进程正在使用CAN收发缓冲区或设置失败返回-1
+ */
+int RVMcu_SetStatusAck(uint32_t fresh_us){
+    int ret;
+    /* 通信参数由代理决定 */
+    if(rvm_on_broker) return 0;
+    pthread_mutex_lock(&rvm_ring_state_mutex);
+    ret = _RingLockLocked(fresh_us != 0);
+    pthread_mutex_unlock(&rvm_ring_state_mutex);
+    if(ret < 0){
+        rvm_debug("CAN收发缓冲区有其他进程在用，不能独占");
+        return -1;
+    }
+    return SpiReg_SetStatusAck(&spiRegHandle, fresh_us);
+}
+
+/**
+ * @brief 打开或关闭MCU的"有数据"通知: 接收缓冲区达到水位或有新的CAN事件时，MCU在串口空闲时发一个字节，
+ *        没有CAN报文时用 RVMcu_WaitCanNotify 睡眠等待，不用轮询。需要MCU固件支持，会同时打开带序号的ACK
+ * @param  watermark        接收缓冲区达到多少帧CAN报文时通知 0:关闭(默认)
+ * @return int              使用代理时通知到不了本进程，返回-1
+ */
+int RVMcu_SetCanNotify(uint8_t watermark){
+    int ret;
+    if(rvm_on_broker) return -1;
+    /* 先准备好收通知，再让MCU开始发 */
+    if(watermark && SpiReg_SetNotify(&spiRegHandle, 1) < 0) return -1;
+    ret = RVMcu_WriteReg(RWREG_MPU_BUSINESS_REG_START + offsetof(MpuBusinessReg, uart_notify), 
+        &watermark, sizeof(watermark), 200);
+    if(ret < 0 || watermark == 0) SpiReg_SetNotify(&spiRegHandle, 0);
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ * @brief 等MCU的"有数据"通知，需要先 RVMcu_SetCanNotify
+ * @param  timeout          毫秒
+ * @return int              收到通知返回1 超时返回0 失败负数
+ */
+int RVMcu_WaitCanNotify(uint32_t timeout){
+    if(rvm_on_broker) return -1;
+    return SpiReg_WaitNotify(&spiRegHandle, timeout);
+}
+
+/**
+ * @brief 取等MCU通知的fd, 放进自己的事件循环，可读后调用 RVMcu_WaitCanNotify(0)
+ * @return int              使用代理、模拟器或没有打开通知时返回-1, 这时只能定时查询
+ */
+int RVMcu_GetCanNotifyFd(void){
+    if(rvm_on_broker) return -1;
+    return SpiReg_GetNotifyFd(&spiRegHandle);
+}
+
+/**
+ * @brief 获取传输层各操作的累计调用次数
+ * @return int              使用代理时返回-1
+ */
+int RVMcu_GetTransCnt(SpiTransCnt *cnt){
+    if(rvm_on_broker) return -1;
+    return SpiReg_GetTransCnt(&spiRegHandle, cnt);
+}
+
+/**
+ * @brief 设置等ACK时先忙等的时间，MCU回ACK很快时减少唤醒延时，代价是CPU占用
+ * @param  spin_us          微秒 0:不忙等(默认)
+ * @return int 
+ */
+int RVMcu_SetAckSpin(uint32_t spin_us){
+    /* 通信参数由代理决定 */
+    if(rvm_on_broker) return 0;
+    return SpiReg_SetAckSpin(&spiRegHandle, spin_us);
+}
+
+/**
+ * @brief 打开或关闭SPI时钟自适应，需要在 RVMcu_Init 之后调用
+ * @param  enable           1:在 RVM_SPI_SPEED_MIN~RVM_SPI_SPEED_MAX 之间自适应 0:固定 RVM_SPI_SPEED
+ * @param  persist_path     保存速度的文件，下次从这个速度开始，NULL不保存
+ * @return int 
+ */
+int RVMcu_SetAdaptiveSpeed(int enable, const char *persist_path){
+    if(rvm_on_broker) return 0;
+    if(!enable) return SpiReg_SetAdaptive(&spiRegHandle, 0, 0, NULL);
+    return SpiReg_SetAdaptive(&spiRegHandle, RVM_SPI_SPEED_MIN, RVM_SPI_SPEED_MAX, persist_path);
+}
+
+/**
+ * @brief 获取当前SPI时钟和累计的CRC错误、超时次数
+ * @return uint32_t         当前时钟(Hz) 使用代理时返回0
+ */
+uint32_t RVMcu_GetSpiSpeed(uint32_t *crc_errs, uint32_t *timeouts){
+    if(rvm_on_broker) return 0;
+    return SpiReg_GetSpeed(&spiRegHandle, crc_errs, timeouts);
+}
+
+/**
+ * @brief 获取SPI传输某个阶段的延时直方图
+ * @param  op               SPIREG_OP_READ 或 SPIREG_OP_WRITE
+ * @param  stage            SPIREG_STAGE_XXX
+ * @param  hist             输出
+ * @param  reset            取出的同时清零
+ * @return int              使用代理时统计在代理进程里，返回-1
+ */
+int RVMcu_GetLatency(int op, int stage, LatHist *hist, int reset){
+    if(rvm_on_broker) return -1;
+    return SpiReg_GetLatency(&spiRegHandle, op, (SpiRegStage)stage, hist, reset);
+}
+
+/**
+ * @brief 设置一帧数据段的大小，需要在 RVMcu_Init 之前调用，MCU固件需要支持对应的长度
+ * @param  frame_size       0为默认 SPI_RT_MSG_MAX_SIZE
+ */
+void RVMcu_SetFrameSize(uint32_t frame_size){
+    rvm_frame_size = frame_size;
+}
+
+/* 登记环形缓冲区命令寄存器的属性，让传输层能正确分片，有副作用的命令出错不重试 */
+static void _RegisterCbAttr(uint16_t cb_addr){
+    SpiReg_SetRegAttr(&spiRegHandle, cb_addr + CBREG_CMD_GET_SIZE, 1, SPIREG_ATTR_NO_MERGE);
+    SpiReg_SetRegAttr(&spiRegHandle, cb_addr + CBREG_CMD_GET_FREESIZE, 1, SPIREG_ATTR_NO_MERGE);
+    SpiReg_SetRegAttr(&spiRegHandle, cb_addr + CBREG_CMD_READ, 1, SPIREG_ATTR_FIXED_ADDR | SPIREG_ATTR_NON_IDEMPOTENT);
+    SpiReg_SetRegAttr(&spiRegHandle, cb_addr + CBREG_CMD_WRITE, 1, SPIREG_ATTR_FIXED_ADDR | SPIREG_ATTR_NON_IDEMPOTENT);
+    SpiReg_SetRegAttr(&spiRegHandle, cb_addr + CBREG_CMD_CLEAN, 1, SPIREG_ATTR_NON_IDEMPOTENT);
+    SpiReg_SetRegAttr(&spiRegHandle, cb_addr + CBREG_CMD_READAIR, 1, SPIREG_ATTR_NON_IDEMPOTENT);
+    SpiReg_SetRegAttr(&spiRegHandle, cb_addr + CBREG_CMD_PEEP, 1, SPIREG_ATTR_NO_FRAG);
+}
+
+/**
+ * @brief 使用进程内的模拟MCU代替硬件，需在RVMcu_Init前调用
+ *        也可以设置环境变量 RVMCU_SIM 打开
+ * @param  enable           1:模拟MCU 0:硬件(默认)
+ */
+void RVMcu_SetSim(int enable){
+    rvm_use_sim = enable;
+}
+
+/**
+ * @brief 把串口和SPI的收发抓包到文件，用 rvm_replay 离线分析，需在RVMcu_Init前调用
+ *        也可以设置环境变量 RVMCU_CAPTURE，抓包时直接访问设备，不经过代理
+ * @param  path             抓包文件 NULL不抓包(默认)
+ */
+void RVMcu_SetCapture(const char *path){
+    rvm_capture = path;
+}
+
+/**
+ * @brief 把通信统计记到共享内存统计页，给 mcu_reg_wr --stats 看，需在RVMcu_Init前调用
+ *        也可以设置环境变量 RVMCU_STATS(统计页路径，空为默认路径)打开
+ * @param  enable           1:记录 0:不记录(默认)
+ */
+void RVMcu_SetStats(int enable){
+    rvm_stats = enable;
+}
+
+/**
+ * @brief 是否允许 RVMcu_Init 连接代理，代理自己需要关掉，需在RVMcu_Init前调用
+ *        也可以设置环境变量 RVMCU_NO_BROKER 关掉
+ * @param  enable           0:直接访问设备 1:代理在运行时使用代理(默认)
+ */
+void RVMcu_SetBroker(int enable){
+    rvm_allow_broker = enable;
+}
+
 int RVMcu_Init(void){
-    return SpiReg_Init(&spiRegHandle, RVM_SPI_PATH, RVM_UART_PATH, RVM_SPI_SPEED);
+    const char *capture = rvm_capture ? rvm_capture : getenv(SPI_CAP_ENV);
+    int ret;
+    /* 统计页只是辅助，打不开也继续 */
+    if(rvm_stats || getenv(RVMS_PATH_ENV)) RvmStats_Open(&rvmStats, 0);
+    if(rvm_allow_broker && !rvm_use_sim && getenv(RVMB_NO_BROKER_ENV) == NULL && getenv(RVM_SIM_ENV) == NULL &&
+        (capture == NULL || capture[0] == '\0') &&
+        RvmBroker_Connect(&rvmbClient) == 0){
+        rvm_on_broker = 1;
+        return 0;
+    }
+    if(rvm_use_sim || getenv(RVM_SIM_ENV)){
+        SpiTrans trans;
+        ret = SpiTrans_OpenSim(&trans);
+        if(ret == 0){
+            ret = SpiReg_InitTrans(&spiRegHandle, &trans, RVM_SPI_SPEED, rvm_frame_size);
+            if(ret < 0) SpiTrans_Close(&trans);
+        }
+    }else{
+        ret = SpiReg_Init(&spiRegHandle, _DevPath(RVM_SPI_DEV_ENV, RVM_SPI_PATH),
+            _DevPath(RVM_UART_DEV_ENV, RVM_UART_PATH), RVM_SPI_SPEED, rvm_frame_size);
+    }
+    if(ret < 0){
+        RvmStats_Close(&rvmStats);
+        return ret;
+    }
+    if(rvmStats.page) SpiReg_SetStats(&spiRegHandle, &rvmStats);
+    /* 抓包只是辅助，打不开也继续 */
+    if(capture && capture[0] && SpiReg_SetCapture(&spiRegHandle, capture) < 0)
+        rvm_debug("抓包文件 %s 打开失败", capture);
+    _RegisterCbAttr(RWREG_CB_MPU_BUSINESS_SEND_CAN_START);
+    _RegisterCbAttr(RWREG_CB_MPU_BUSINESS_RECEIVE_CAN_START);
+    _RegisterCbAttr(RWREG_CB_BURN_START);
+    return 0;
 }
 
 void RVMcu_Exit(void){
-    SpiReg_Exit(&spiRegHandle);
+    if(rvm_on_broker){
+        RvmBroker_Close(&rvmbClient);
+        rvm_on_broker = 0;
+    }else{
+        SpiReg_Exit(&spiRegHandle);
+    }
+    RvmStats_Close(&rvmStats);
+    pthread_mutex_lock(&rvm_ring_state_mutex);
+    if(rvm_ring_fd >= 0) close(rvm_ring_fd);
+    rvm_ring_fd = -1;
+    __atomic_store_n(&rvm_ring_state, RVM_RING_NONE, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&rvm_ring_state_mutex);
 }
\ No newline at end of file
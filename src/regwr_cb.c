@@ -42,6 +42,7 @@ int RegWrCb_Size(RegWrCbHandle *h, uint16_t cb_addr, uint32_t timeout){
     int size;
     ret = h->read_reg(cb_addr+CBREG_CMD_GET_SIZE, (uint8_t*)&size, 4, timeout);
     if(ret < 0) return ret;
+    if(h->size_report) h->size_report(cb_addr, 0, (uint32_t)size);
     return size;
 }
 
@@ -56,9 +57,18 @@ int RegWrCb_FreeSize(RegWrCbHandle *h, uint16_t cb_addr, uint32_t timeout){
     int size;
     ret = h->read_reg(cb_addr+CBREG_CMD_GET_FREESIZE, (uint8_t*)&size, 4, timeout);
     if(ret < 0) return ret;
+    if(h->size_report) h->size_report(cb_addr, 1, (uint32_t)size);
     return size;
 }
 
+/* 读写前取容量，优先用缓存的值，省一帧 */
+static int _CbSize(RegWrCbHandle *h, uint16_t cb_addr, int is_free, uint32_t timeout){
+    uint32_t size;
+    if(h->cached_size && h->cached_size(cb_addr, is_free, &size) == 0)
+        return (int)size;
+    return is_free ? RegWrCb_FreeSize(h, cb_addr, timeout) : RegWrCb_Size(h, cb_addr, timeout);
+}
+
 /**
  * @brief                   读环形缓冲区
  * @param  h                句柄
@@ -70,7 +80,7 @@ int RegWrCb_FreeSize(RegWrCbHandle *h, uint16_t cb_addr, uint32_t timeout){
 int RegWrCb_Read(RegWrCbHandle *h, uint16_t cb_addr, uint8_t *buf, uint32_t buf_size, uint32_t timeout){
     int ret;
     uint16_t r_len = (uint16_t)buf_size;
-    ret = RegWrCb_Size(h, cb_addr, timeout);
+    ret = _CbSize(h, cb_addr, 0, timeout);
     if(ret < 0) return ret;
     if(ret == 0) return 0;
     r_len = r_len > ret ? ret : r_len;
@@ -93,7 +103,7 @@ int RegWrCb_GranRead(RegWrCbHandle *h, uint16_t cb_addr, uint8_t *data, uint32_t
     int ret;
     uint16_t r_num = nmemb;
     uint16_t r_len;
-    ret = RegWrCb_Size(h, cb_addr, timeout);
+    ret = _CbSize(h, cb_addr, 0, timeout);
     if(ret < 0) return ret;
     r_num = (ret/gran_size) > r_num ? r_num : (ret/gran_size);
     if(r_num == 0) return 0;
@@ -115,7 +125,7 @@ int RegWrCb_GranRead(RegWrCbHandle *h, uint16_t cb_addr, uint8_t *data, uint32_t
 int RegWrCb_Write(RegWrCbHandle *h, uint16_t cb_addr, const uint8_t *data, uint32_t data_size, uint32_t timeout){
     int ret;
     uint16_t w_len = (uint16_t)data_size;
-    ret = RegWrCb_FreeSize(h, cb_addr, timeout);
+    ret = _CbSize(h, cb_addr, 1, timeout);
     if(ret < 0) return ret;
     if(ret == 0) return 0;
     w_len = w_len > ret ? ret : w_len;
@@ -138,7 +148,7 @@ int RegWrCb_GranWrite(RegWrCbHandle *h, uint16_t cb_addr, const uint8_t *data, u
     int ret;
     uint16_t w_num = nmemb;
     uint16_t w_len;
-    ret = RegWrCb_FreeSize(h, cb_addr, timeout);
+    ret = _CbSize(h, cb_addr, 1, timeout);
     if(ret < 0) return ret;
     w_num = (ret/gran_size) > w_num ? w_num : (ret/gran_size);
     if(w_num == 0) return 0;
@@ -172,7 +182,7 @@ int RegWrCb_Clean(RegWrCbHandle *h, uint16_t cb_addr, uint32_t timeout){
 int RegWrCb_ReadAir(RegWrCbHandle *h, uint16_t cb_addr, uint32_t read_size, uint32_t timeout){
     int ret;
     uint32_t r_len = (uint16_t)read_size;
-    ret = RegWrCb_Size(h, cb_addr, timeout);
+    ret = _CbSize(h, cb_addr, 0, timeout);
     if(ret < 0) return ret;
     if(ret == 0) return 0;
     r_len = r_len > (uint32_t)ret ? (uint32_t)ret : r_len;
@@ -194,7 +204,7 @@ int RegWrCb_ReadAir(RegWrCbHandle *h, uint16_t cb_addr, uint32_t read_size, uint
 int RegWrCb_Peep(RegWrCbHandle *h, uint16_t cb_addr, uint8_t *buf, uint32_t buf_size, uint32_t timeout){
     int ret;
     uint16_t r_len = (uint16_t)buf_size;
-    ret = RegWrCb_Size(h, cb_addr, timeout);
+    ret = _CbSize(h, cb_addr, 0, timeout);
     if(ret < 0) return ret;
     if(ret == 0) return 0;
     r_len = r_len > ret ? ret : r_len;
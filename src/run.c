@@ -16,6 +16,7 @@
 #include <stddef.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/epoll.h>
 
 #include "bits.h"
 #include "mcu-reg/can-event.h"
@@ -25,6 +26,9 @@
 #include "debug.h"
 #include "typedef.h"
 #include "rearview_mcu.h"
+#include "bench.h"
+#include "rvm_stats.h"
+#include "reactor.h"
 
 
 static void make_data(uint8_t* wr_buf, uint16_t cnt ){
@@ -37,16 +41,26 @@ static void make_data(uint8_t* wr_buf, uint16_t cnt ){
 }
 
 static int _run_test(RunConfig *config){
+    static uint8_t rd_buf[WR_BUF_MAX];
     uint32_t i;
     int err_cnt = 0;
     int ret;
     uint32_t start_time;
+    float sec;
     start_time = GET_TICK();
     for(i=0;i<config->test_cnt;i++){
         
         if(config->is_write){
             make_data(config->wr_buf, config->reg_cnt);
             ret = RVMcu_WriteReg((uint16_t)config->reg_addr, config->wr_buf, config->reg_cnt, 400);
+            /* 读回来比较，只适合普通的读写寄存器 */
+            if(ret >= 0 && config->is_verify){
+                ret = RVMcu_ReadReg((uint16_t)config->reg_addr, rd_buf, config->reg_cnt, 400);
+                if(ret >= 0 && memcmp(rd_buf, config->wr_buf, config->reg_cnt) != 0){
+                    dbg_infoln("第%d次测试:读回的数据不一致",i);
+                    ret = -1;
+                }
+            }
         }else{
             ret = RVMcu_ReadReg((uint16_t)config->reg_addr, config->wr_buf, config->reg_cnt, 400);
         }
@@ -56,8 +70,13 @@ static int _run_test(RunConfig *config){
         if(ret<0)
             err_cnt++;
     }
+    sec = ((float)(GET_TICK()-start_time))/1000;
     dbg_infoln("测试%s:%d次,失败:%d次,耗时%.3fs", config->is_write?"写":"读", 
-        config->test_cnt, err_cnt, ((float)(GET_TICK()-start_time))/1000);
+        config->test_cnt, err_cnt, sec);
+    /* 只算成功的次数，链路有损伤时能看出恢复的快慢 */
+    if(sec > 0)
+        dbg_infoln("吞吐:%.0f次/s, %.1fKB/s", (config->test_cnt - err_cnt) / sec,
+            (float)(config->test_cnt - err_cnt) * config->reg_cnt / 1024 / sec);
     return 0;
 }
 
@@ -114,11 +133,19 @@ static int fun_show_mcu_can_event(RunConfig *config){
     int i;
     int valid_max_event = 0;
     RoRegCanEvent can_event = {0};
+    /* 有效位图和事件寄存器是连续的，一次传输全部读出 */
+    SpiRegOp ops[2] = {
+        {.type = SPIREG_OP_READ, .flags = SPIREG_OPF_MERGEABLE, .reg_addr = ROREG_CAN_EVENT_START,
+         .reg_cnt = sizeof(can_event.period_event_valid), .rdata = can_event.period_event_valid},
+        {.type = SPIREG_OP_READ, .flags = SPIREG_OPF_MERGEABLE, 
+         .reg_addr = ROREG_CAN_EVENT_START + sizeof(can_event.period_event_valid),
+         .reg_cnt = sizeof(can_event.event), .rdata = can_event.event},
+    };
     (void) config;
     
-    ret = RVMcu_ReadReg(ROREG_CAN_EVENT_START, (uint8_t*)&can_event, sizeof(can_event.period_event_valid), 200);
+    ret = RVMcu_Transact(ops, 2, 200);
     if(ret < 0){
-        dbg_errfl("SpiReg_Read error! ret = %d",ret);
+        dbg_errfl("RVMcu_Transact error! ret = %d",ret);
         return -1;
     }
 
@@ -127,11 +154,6 @@ static int fun_show_mcu_can_event(RunConfig *config){
             valid_max_event = i;
     }
     if(valid_max_event == 0) return 0;
-    ret = RVMcu_ReadReg(ROREG_CAN_EVENT_START+ sizeof(can_event.period_event_valid), (uint8_t*)can_event.event, valid_max_event+1, 200);
-    if(ret < 0){
-        dbg_errfl("SpiReg_Read error! ret = %d",ret);
-        return -1;
-    }
 
     if(Get_Bit(can_event.period_event_valid, CET_IGNITION_POSITION))
         dbg_infoln("点火位置： %s", can_event.event[CET_IGNITION_POSITION] == CIPE_OFF ?     "OFF":
@@ -317,15 +339,6 @@ static int fun_set_or_clean_mpu_dtc(RunConfig *config){
     return 0;
 }
 
-static int fun_mpu_online(RunConfig *config){
-    (void) config;
-    while(1){
-        usleep(100000);
-        RVMcu_WdogFeed();
-    }
-    return 0;
-}
-
 static int fun_show_mpu_dtc(RunConfig *config){
     int ret;
     uint32_t dtc_map;
@@ -363,72 +376,240 @@ static int fun_send_can_msg(RunConfig *config){
 }
 
 #define TEST_CAN_BUF_SIZE (64-4)
-static int fun_loop_receive_can_msg(RunConfig *config){
-    int ret,i;
-    (void) config;
-    PCanMsg can_msg[TEST_CAN_BUF_SIZE] = {0};
-    PCanMsg *can_msg_p;
-    int is_once = 1;
-    uint16_t last_rtime;
-    double   rtime;
+/* 通知丢了(比如被别的进程清掉)也不会一直睡下去 */
+#define CAN_NOTIFY_WAIT_MS  100
 
-    RVMcu_CleanRxFifo(200);
-    while(1){
+/* 打开MCU的"有数据"通知，打不开就还是轮询 */
+static void _CanNotifySetup(RunConfig *config){
+    if(config->can_notify == 0) return;
+    if(RVMcu_SetCanNotify((uint8_t)config->can_notify) < 0){
+        dbg_errfl("RVMcu_SetCanNotify 失败，退回轮询");
+        config->can_notify = 0;
+    }
+}
+
+/* 接收缓冲区空了: 打开了通知就睡到MCU通知，否则隔一会再查 */
+static void _CanIdleWait(RunConfig *config){
+    if(config->can_notify && RVMcu_WaitCanNotify(CAN_NOTIFY_WAIT_MS) >= 0) return;
+    usleep(500);
+}
+
+/*============================== 常驻服务 ==============================*/
+
+#define WDOG_FEED_US        100000
+/* 没有通知时按这个周期查接收缓冲区，一直收不到报文时间隔翻倍到 CAN_POLL_MAX_US，收到报文后回到 CAN_POLL_US */
+#define CAN_POLL_US         500
+#define CAN_POLL_MAX_US     16000
+/* 一次唤醒最多收这么多批，剩下的让出来给其他任务后马上再收 */
+#define CAN_DRAIN_ROUNDS    16
+
+#define SERVICE_WDOG        (1 << 0)        /* 喂狗 */
+#define SERVICE_CAN         (1 << 1)        /* 收CAN报文并打印 */
+
+/* 常驻服务的所有任务在一个线程的事件循环里跑，不再各自睡眠轮询 */
+typedef struct _Service{
+    RunConfig               *config;
+    Reactor                 reactor;
+    int                     can_timer;
+    uint32_t                can_period_us;  /* 基本周期 */
+    uint32_t                can_poll_us;    /* 当前的查询间隔 */
+    int                     can_backoff;    /* 1: 没有通知，空闲时查询间隔退避 */
+    /* asc 格式的相对时间 */
+    int                     is_once;
+    uint16_t                last_rtime;
+    double                  rtime;
+    /* 状态打印用的计数 */
+    uint64_t                can_rx;
+    uint64_t                can_rx_last;
+    uint32_t                feed_ok;
+    uint32_t                feed_err;
+    uint32_t                can_err;
+    uint32_t                notifies;
+}Service;
+
+static void _CanPrint(Service *svc, const PCanMsg *can_msg, int cnt){
+    const PCanMsg *can_msg_p;
+    int i;
+    for(i=0;i<cnt;i++){
+        can_msg_p = can_msg+i;
+        if(svc->config->is_can_print_asc){
+            if(svc->is_once){
+                svc->is_once = 0;
+                svc->rtime = 0.0;
+                svc->last_rtime = can_msg_p->can_time;
+            }else{
+                svc->rtime += (double)(((uint16_t)(can_msg_p->can_time - svc->last_rtime))/1000.0 + 0.000001);
+                svc->last_rtime = can_msg_p->can_time;
+            }
+
+            dbg_inforaw("%.6f 1 %08xx Rx d %d %02x %02x %02x %02x %02x %02x %02x %02x\n", svc->rtime, 
+                can_msg_p->can_id, can_msg_p->can_len,
+                can_msg_p->can_data[0], can_msg_p->can_data[1], can_msg_p->can_data[2], can_msg_p->can_data[3],
+                can_msg_p->can_data[4], can_msg_p->can_data[5], can_msg_p->can_data[6], can_msg_p->can_data[7] );
+        }else{
+            dbg_inforaw(" MCUCAN  %08x  [%d]  %02x %02x %02x %02x %02x %02x %02x %02x \n", can_msg_p->can_id, can_msg_p->can_len, 
+                can_msg_p->can_data[0], can_msg_p->can_data[1], can_msg_p->can_data[2], can_msg_p->can_data[3],
+                can_msg_p->can_data[4], can_msg_p->can_data[5], can_msg_p->can_data[6], can_msg_p->can_data[7] );
+        }
+    }
+}
+
+static void _OnWdogFeed(Reactor *r, int id, uint64_t expired, void *arg){
+    Service *svc = (Service *)arg;
+    (void)r;
+    (void)id;
+    (void)expired;
+    if(RVMcu_WdogFeed() < 0) svc->feed_err++;
+    else svc->feed_ok++;
+}
+
+/* 没有通知时，收空了查询间隔翻倍，收到报文马上回到基本周期，空闲时几乎不占CPU */
+static void _CanPollAdjust(Service *svc, int got){
+    uint32_t us = svc->can_poll_us;
+
+    if(!svc->can_backoff) return;
+    if(got) us = svc->can_period_us;
+    else if(us < CAN_POLL_MAX_US) us = us * 2 > CAN_POLL_MAX_US ? CAN_POLL_MAX_US : us * 2;
+    if(us == svc->can_poll_us) return;
+    svc->can_poll_us = us;
+    Reactor_SetTimer(&svc->reactor, svc->can_timer, us, us);
+}
+
+/* 把接收缓冲区收空，收不完就让定时器马上再来一次 */
+static void _CanDrain(Service *svc){
+    PCanMsg can_msg[TEST_CAN_BUF_SIZE];
+    int ret, round, got = 0;
+
+    for(round = 0; round < CAN_DRAIN_ROUNDS; round++){
         /* spi单次多传输点优势大些 */
         ret = RVMcu_ReceiveCanMsgBlock(can_msg, TEST_CAN_BUF_SIZE, 200);
         if(ret < 0){
             dbg_errfl("RVMcu_ReceiveCanMsgBlock error! ret = %d",ret);
-            continue;
-        }
-        if(ret == 0){
-            usleep(500);
-            continue;
-        }
-        /* 成功接收到 */
-        for(i=0;i<ret;i++){
-            can_msg_p = can_msg+i;
-            if(config->is_can_print_asc){
-                if(is_once){
-                    is_once = 0;
-                    rtime = 0.0;
-                    last_rtime = can_msg_p->can_time;
-                }else{
-                    rtime += (double)(((uint16_t)(can_msg_p->can_time - last_rtime))/1000.0 + 0.000001);
-                    last_rtime = can_msg_p->can_time;
-                }
-
-                dbg_inforaw("%.6f 1 %08xx Rx d %d %02x %02x %02x %02x %02x %02x %02x %02x\n", rtime, 
-                    can_msg_p->can_id, can_msg_p->can_len,
-                    can_msg_p->can_data[0], can_msg_p->can_data[1], can_msg_p->can_data[2], can_msg_p->can_data[3],
-                    can_msg_p->can_data[4], can_msg_p->can_data[5], can_msg_p->can_data[6], can_msg_p->can_data[7] );
-            }else{
-                dbg_inforaw(" MCUCAN  %08x  [%d]  %02x %02x %02x %02x %02x %02x %02x %02x \n", can_msg_p->can_id, can_msg_p->can_len, 
-                    can_msg_p->can_data[0], can_msg_p->can_data[1], can_msg_p->can_data[2], can_msg_p->can_data[3],
-                    can_msg_p->can_data[4], can_msg_p->can_data[5], can_msg_p->can_data[6], can_msg_p->can_data[7] );
-            }
+            svc->can_err++;
+            return;
         }
+        if(ret == 0) break;
+        got += ret;
+        svc->can_rx += ret;
+        _CanPrint(svc, can_msg, ret);
+    }
+    if(round < CAN_DRAIN_ROUNDS){
+        _CanPollAdjust(svc, got);
+        return;
     }
+    svc->can_poll_us = svc->can_period_us;
+    Reactor_SetTimer(&svc->reactor, svc->can_timer, 1, svc->can_period_us);
+}
+
+static void _OnCanTimer(Reactor *r, int id, uint64_t expired, void *arg){
+    (void)r;
+    (void)id;
+    (void)expired;
+    _CanDrain((Service *)arg);
+}
+
+/* 串口可读: 收走通知(和迟到的ACK)，是通知就收CAN */
+static void _OnCanNotify(Reactor *r, int fd, uint32_t events, void *arg){
+    Service *svc = (Service *)arg;
+    (void)r;
+    (void)fd;
+    (void)events;
+    if(RVMcu_WaitCanNotify(0) <= 0) return;
+    svc->notifies++;
+    _CanDrain(svc);
+}
 
+static void _OnStatus(Reactor *r, int id, uint64_t expired, void *arg){
+    Service *svc = (Service *)arg;
+    uint32_t speed, crc_errs = 0, timeouts = 0;
+    double sec = svc->config->status_interval * (double)expired / 1000.0;
+    (void)id;
+
+    speed = RVMcu_GetSpiSpeed(&crc_errs, &timeouts);
+    dbg_infoln("canrx/s %.1f, 喂狗 %u/%u, CAN错误 %u, 通知 %u, SPI %uHz crc %u tmo %u, 唤醒 %llu 迟到 %llu", 
+        (svc->can_rx - svc->can_rx_last) / sec, svc->feed_ok, svc->feed_ok + svc->feed_err, svc->can_err, 
+        svc->notifies, speed, crc_errs, timeouts, 
+        (unsigned long long)r->stat.wakeups, (unsigned long long)r->stat.timer_late);
+    svc->can_rx_last = svc->can_rx;
+    fflush(stdout);
+}
+
+/**
+ * @brief 常驻服务：喂狗、收CAN、状态打印都是事件循环里的任务
+ *        打开了MCU通知且有真实串口时收CAN由串口可读触发，否则按 CAN_POLL_US 定时查询，空闲时退避到 CAN_POLL_MAX_US
+ * @param  config           config->status_interval 不为0时按这个间隔(毫秒)打印状态
+ * @param  tasks            SERVICE_XXX
+ * @return int              只在出错时返回
+ */
+static int _RunService(RunConfig *config, int tasks){
+    Service svc;
+    int notify_fd, ret = -1;
+
+    memset(&svc, 0, sizeof(svc));
+    svc.config = config;
+    svc.is_once = 1;
+    svc.can_timer = -1;
+    if(Reactor_Open(&svc.reactor) < 0){
+        dbg_errfl("Reactor_Open 失败");
+        return -1;
+    }
+    if((tasks & SERVICE_WDOG) && Reactor_AddTimer(&svc.reactor, WDOG_FEED_US, _OnWdogFeed, &svc) < 0) goto out;
+    if(tasks & SERVICE_CAN){
+        _CanNotifySetup(config);
+        RVMcu_CleanRxFifo(200);
+        notify_fd = RVMcu_GetCanNotifyFd();
+        if(notify_fd >= 0 && Reactor_AddFd(&svc.reactor, notify_fd, EPOLLIN, _OnCanNotify, &svc) < 0) goto out;
+        /* 有通知时定时器只是兜底，防止通知丢了一直收不到 */
+        svc.can_period_us = notify_fd >= 0 ? CAN_NOTIFY_WAIT_MS * 1000 : CAN_POLL_US;
+        svc.can_poll_us = svc.can_period_us;
+        svc.can_backoff = notify_fd < 0;
+        svc.can_timer = Reactor_AddTimer(&svc.reactor, svc.can_period_us, _OnCanTimer, &svc);
+        if(svc.can_timer < 0) goto out;
+    }
+    if(config->status_interval && 
+        Reactor_AddTimer(&svc.reactor, config->status_interval * 1000, _OnStatus, &svc) < 0) goto out;
+    ret = Reactor_Run(&svc.reactor);
+out:
+    if(ret < 0) dbg_errfl("事件循环出错");
+    Reactor_Close(&svc.reactor);
     return ret;
 }
 
+static int fun_mpu_online(RunConfig *config){
+    return _RunService(config, SERVICE_WDOG);
+}
+
+static int fun_loop_receive_can_msg(RunConfig *config){
+    return _RunService(config, SERVICE_CAN | (config->is_wdog_feed ? SERVICE_WDOG : 0));
+}
+
 static int fun_loop_can_echo_test(RunConfig *config){
 
     int ret;
-    (void) config;
     uint32_t test_msg_cnt = 0;
+    uint32_t report_time = GET_TICK(), report_cnt = 0, err_cnt = 0, now;
     PCanMsg can_msg[TEST_CAN_BUF_SIZE] = {0};
     PCanMsg *can_msg_pos;
     PCanMsg *can_msg_end;
+    _CanNotifySetup(config);
     while(1){
+        /* 每秒打印一次回显的速率 */
+        now = GET_TICK();
+        if(now - report_time >= 1000){
+            dbg_infoln("ECHO吞吐:%.0f帧/s, 累计%u帧, 错误%u次",
+                (float)(test_msg_cnt - report_cnt) * 1000 / (now - report_time), test_msg_cnt, err_cnt);
+            report_time = now;
+            report_cnt = test_msg_cnt;
+        }
         /* spi单次多传输点优势大些 */
         ret = RVMcu_ReceiveCanMsgBlock(can_msg, TEST_CAN_BUF_SIZE, 100);
         if(ret < 0){
             dbg_errfl("RVMcu_ReceiveCanMsgBlock error! ret = %d",ret);
+            err_cnt++;
             continue;
         }
         if(ret == 0){
-            usleep(500);
+            _CanIdleWait(config);
             continue;
         }
 
@@ -441,6 +622,7 @@ static int fun_loop_can_echo_test(RunConfig *config){
             ret = RVMcu_SendCanMsgBlock(can_msg_pos, can_msg_end-can_msg_pos, 100);
             if(ret < 0){
                 dbg_errfl("RVMcu_SendCanMsg error! ret = %d",ret);
+                err_cnt++;
                 usleep(500);
                 continue;
             }
@@ -504,6 +686,48 @@ static int fun_exit_bootloader(RunConfig *config){
     return ret;
 }
 
+/* 只读映射统计页，每隔 stats_interval 毫秒打印一次这段时间的速率，直到进程被结束 */
+static int fun_stats(RunConfig *config){
+    RvmStats stats;
+    RvmsCounters prev, cur;
+    double sec;
+    uint64_t lock_cnt;
+    int i;
+
+    if(RvmStats_Open(&stats, 1) < 0){
+        dbg_errfl("打开统计页 %s 失败，没有进程打开统计(RVMCU_STATS)或者版本不一致", RvmStats_Path());
+        return -1;
+    }
+    if(RvmStats_Snapshot(&stats, &prev) < 0) goto error;
+    dbg_infoln("%9s %9s %10s %10s %6s %6s %6s %9s %7s %7s", 
+        "rd/s", "wr/s", "rdKB/s", "wrKB/s", "crc", "tmo", "err", "lockw_us", "canrx/s", "cantx/s");
+    while(1){
+        usleep(config->stats_interval * 1000);
+        if(RvmStats_Snapshot(&stats, &cur) < 0) goto error;
+        sec = config->stats_interval / 1000.0;
+        lock_cnt = cur.lock_cnt - prev.lock_cnt;
+        dbg_infoln("%9.1f %9.1f %10.1f %10.1f %6llu %6llu %6llu %9.1f %7.1f %7.1f",
+            (cur.frames_read - prev.frames_read) / sec, (cur.frames_write - prev.frames_write) / sec,
+            (cur.bytes_read - prev.bytes_read) / 1024.0 / sec, (cur.bytes_write - prev.bytes_write) / 1024.0 / sec,
+            (unsigned long long)(cur.crc_errs - prev.crc_errs), (unsigned long long)(cur.timeouts - prev.timeouts),
+            (unsigned long long)(cur.errors - prev.errors),
+            lock_cnt ? (cur.lock_wait_ns - prev.lock_wait_ns) / 1000.0 / lock_cnt : 0.0,
+            (cur.can_rx - prev.can_rx) / sec, (cur.can_tx - prev.can_tx) / sec);
+        for(i = 0; i < RVMS_RING_MAX; i++){
+            if(cur.ring[i].cb_addr == 0) continue;
+            dbg_infoln("    ring 0x%04x used %u free %u max %u", (unsigned)cur.ring[i].cb_addr, 
+                (unsigned)cur.ring[i].used, (unsigned)cur.ring[i].free, (unsigned)cur.ring[i].used_max);
+        }
+        /* 输出到管道时也能及时看到 */
+        fflush(stdout);
+        prev = cur;
+    }
+error:
+    dbg_errfl("统计页一直在更新中，读不到一致的内容");
+    RvmStats_Close(&stats);
+    return -1;
+}
+
 int  run(RunConfig *config){
     int ret;
     if(config->mode == FUN_RW){
@@ -550,6 +774,14 @@ int  run(RunConfig *config){
         return fun_loop_can_echo_test(config);
     }else if(config->mode == FUN_WRITE_SHANQI_PRODUCTION_DATE){
         return RVMcu_ShanQiProductionDate(config->wr_buf);
+    }else if(config->mode == FUN_BENCH_FRAME){
+        return bench_frame(config);
+    }else if(config->mode == FUN_BENCH_LOCK){
+        return bench_lock(config);
+    }else if(config->mode == FUN_BENCH_ACK){
+        return bench_ack(config);
+    }else if(config->mode == FUN_STATS){
+        return fun_stats(config);
     }
 
 
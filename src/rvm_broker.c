@@ -0,0 +1,439 @@
+/**
+ * @file rvm_broker.c
+ * @brief MCU访问代理守护进程，独占SPI和串口，替其他进程访问MCU
+ *        每个客户端一个分发线程从请求环取槽位，交给公共的工作线程执行，
+ *        不同客户端的请求并发进入 SpiReg，由传输层统一合并、排优先级
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ *
+ * @par 修改日志:
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+
+#include "debug.h"
+#include "argparse.h"
+#include "spi_reg.h"
+#include "rearview_mcu.h"
+#include "rvm_broker.h"
+
+#define RVMB_WORKERS            8           /* 工作线程数, 决定同时进入传输层的请求数 */
+#define RVMB_POLL_MS            200         /* 分发线程检查客户端是否断开的间隔 */
+
+typedef struct _RvmbConn{
+    int                     sock_fd;
+    RvmbShared              *sh;
+    int                     inflight;       /* 交给工作线程还没做完的请求 */
+    pthread_mutex_t         mutex;
+    pthread_cond_t          cond;
+}RvmbConn;
+
+typedef struct _RvmbWork{
+    RvmbConn                *conn;
+    RvmbSlot                *slot;
+    struct _RvmbWork        *next;
+}RvmbWork;
+
+static struct{
+    RvmbWork                *head;
+    RvmbWork                *tail;
+    int                     active;         /* 排队和正在执行的请求 */
+    pthread_mutex_t         mutex;
+    pthread_cond_t          cond;
+}workQueue = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int broker_exit = 0;                 /* 主线程从 signalfd 收到退出信号后置1 */
+
+static const char* const usages[] = {
+    "rvm_broker [-P 2] [--pipeline N] [--frame-size N] [--shm-lock]",
+    NULL,
+};
+
+static int _FutexWait(uint32_t *addr, uint32_t val, uint32_t timeout_ms){
+    struct timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+    return (int)syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void _FutexWake(uint32_t *addr){
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* 释放槽位，叫醒等空闲槽位的客户端 */
+static void _SlotFree(RvmbShared *sh, RvmbSlot *slot){
+    __atomic_store_n(&slot->state, RVMB_SLOT_FREE, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&sh->slot_free, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&sh->slot_waiters, __ATOMIC_SEQ_CST)) _FutexWake(&sh->slot_free);
+}
+
+/**
+ * 执行一个槽位中的请求，结果写回槽位
+ * 槽位在客户端可写的共享内存里，请求参数只读一次放到局部变量，检查和使用的都是这份
+ */
+static void _Execute(RvmbSlot *slot){
+    SpiRegOp ops[RVMB_MAX_OPS];
+    RvmbOp *rop = (RvmbOp *)slot->data;
+    uint8_t op = __atomic_load_n(&slot->op, __ATOMIC_RELAXED);
+    uint8_t prio = __atomic_load_n(&slot->prio, __ATOMIC_RELAXED);
+    uint16_t reg_addr = __atomic_load_n(&slot->reg_addr, __ATOMIC_RELAXED);
+    uint16_t reg_cnt = __atomic_load_n(&slot->reg_cnt, __ATOMIC_RELAXED);
+    uint32_t timeout = __atomic_load_n(&slot->timeout, __ATOMIC_RELAXED);
+    uint16_t cnt;
+    size_t off;
+    int i, n;
+
+    switch(op){
+    /* reg_cnt 是16位的，数据区总装得下 */
+    case RVMB_OP_READ:
+        slot->ret = RVMcu_ReadRegEx(reg_addr, slot->data, reg_cnt, timeout, (SpiRegPrio)prio);
+        break;
+    case RVMB_OP_WRITE:
+        slot->ret = RVMcu_WriteRegEx(reg_addr, slot->data, reg_cnt, timeout, (SpiRegPrio)prio);
+        break;
+    case RVMB_OP_TRANSACT:
+        n = reg_cnt;
+        if(n <= 0 || n > RVMB_MAX_OPS) { slot->ret = -1; break; }
+        off = sizeof(RvmbOp) * (size_t)n;
+        for(i = 0; i < n; i++){
+            cnt = __atomic_load_n(&rop[i].reg_cnt, __ATOMIC_RELAXED);
+            if(off + cnt > RVMB_DATA_MAX) break;
+            ops[i].type = __atomic_load_n(&rop[i].type, __ATOMIC_RELAXED);
+            ops[i].flags = __atomic_load_n(&rop[i].flags, __ATOMIC_RELAXED);
+            ops[i].reg_addr = __atomic_load_n(&rop[i].reg_addr, __ATOMIC_RELAXED);
+            ops[i].reg_cnt = cnt;
+            ops[i].rdata = slot->data + off;
+            off += cnt;
+        }
+        if(i < n) { slot->ret = -1; break; }
+        slot->ret = RVMcu_TransactEx(ops, n, timeout, prio);
+        for(i = 0; i < n; i++)
+            rop[i].ret = ops[i].ret;
+        break;
+    default:
+        slot->ret = -1;
+        break;
+    }
+}
+
+static void *_WorkerThread(void *arg){
+    RvmbWork *work;
+    uint32_t st;
+    (void)arg;
+
+    while(1){
+        pthread_mutex_lock(&workQueue.mutex);
+        while(workQueue.head == NULL)
+            pthread_cond_wait(&workQueue.cond, &workQueue.mutex);
+        work = workQueue.head;
+        workQueue.head = work->next;
+        if(workQueue.head == NULL) workQueue.tail = NULL;
+        pthread_mutex_unlock(&workQueue.mutex);
+
+        _Execute(work->slot);
+        st = RVMB_SLOT_BUSY;
+        /* 客户端已经放弃的槽位直接释放 */
+        if(!__atomic_compare_exchange_n(&work->slot->state, &st, RVMB_SLOT_DONE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            _SlotFree(work->conn->sh, work->slot);
+        _FutexWake(&work->slot->state);
+
+        pthread_mutex_lock(&work->conn->mutex);
+        work->conn->inflight--;
+        pthread_cond_signal(&work->conn->cond);
+        pthread_mutex_unlock(&work->conn->mutex);
+        free(work);
+
+        pthread_mutex_lock(&workQueue.mutex);
+        workQueue.active--;
+        pthread_cond_broadcast(&workQueue.cond);
+        pthread_mutex_unlock(&workQueue.mutex);
+    }
+    return NULL;
+}
+
+static int _Dispatch(RvmbConn *conn, RvmbSlot *slot){
+    RvmbWork *work;
+    uint32_t st = RVMB_SLOT_REQ;
+
+    if(!__atomic_compare_exchange_n(&slot->state, &st, RVMB_SLOT_BUSY, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+        if(st == RVMB_SLOT_ABANDON)
+            _SlotFree(conn->sh, slot);
+        return 0;
+    }
+    work = malloc(sizeof(RvmbWork));
+    if(work == NULL){
+        slot->ret = -1;
+        __atomic_store_n(&slot->state, RVMB_SLOT_DONE, __ATOMIC_RELEASE);
+        _FutexWake(&slot->state);
+        return -1;
+    }
+    work->conn = conn;
+    work->slot = slot;
+    work->next = NULL;
+    pthread_mutex_lock(&conn->mutex);
+    conn->inflight++;
+    pthread_mutex_unlock(&conn->mutex);
+
+    pthread_mutex_lock(&workQueue.mutex);
+    if(workQueue.tail) workQueue.tail->next = work;
+    else workQueue.head = work;
+    workQueue.tail = work;
+    workQueue.active++;
+    pthread_cond_broadcast(&workQueue.cond);
+    pthread_mutex_unlock(&workQueue.mutex);
+    return 0;
+}
+
+static int _ConnClosed(RvmbConn *conn){
+    struct pollfd pfd = { .fd = conn->sock_fd, .events = POLLIN | POLLRDHUP };
+    char ch;
+    if(poll(&pfd, 1, 0) <= 0) return 0;
+    if(pfd.revents & (POLLHUP | POLLRDHUP | POLLERR)) return 1;
+    /* 客户端不会在控制通道上发数据，读到0就是断开了 */
+    return recv(conn->sock_fd, &ch, 1, MSG_DONTWAIT) == 0;
+}
+
+/* 每个客户端一个分发线程，客户端断开后等在途请求做完再释放共享内存 */
+static void *_ConnThread(void *arg){
+    RvmbConn *conn = (RvmbConn *)arg;
+    RvmbShared *sh = conn->sh;
+    uint32_t bell, idx, head;
+
+    while(!__atomic_load_n(&broker_exit, __ATOMIC_ACQUIRE)){
+        bell = __atomic_load_n(&sh->doorbell, __ATOMIC_SEQ_CST);
+        /* 共享内存客户端可写，不相信它给的环指针 */
+        head = __atomic_load_n(&sh->req_head, __ATOMIC_ACQUIRE);
+        if(head - sh->req_tail > RVMB_SLOTS)
+            sh->req_tail = head - RVMB_SLOTS;
+        while(__atomic_load_n(&sh->req_tail, __ATOMIC_RELAXED) != __atomic_load_n(&sh->req_head, __ATOMIC_ACQUIRE)){
+            idx = sh->req_ring[sh->req_tail % RVMB_SLOTS];
+            __atomic_store_n(&sh->req_tail, sh->req_tail + 1, __ATOMIC_RELEASE);
+            if(idx < RVMB_SLOTS)
+                _Dispatch(conn, &sh->slot[idx]);
+        }
+        if(_ConnClosed(conn)) break;
+        _FutexWait(&sh->doorbell, bell, RVMB_POLL_MS);
+    }
+
+    pthread_mutex_lock(&conn->mutex);
+    while(conn->inflight)
+        pthread_cond_wait(&conn->cond, &conn->mutex);
+    pthread_mutex_unlock(&conn->mutex);
+    munmap(conn->sh, sizeof(RvmbShared));
+    close(conn->sock_fd);
+    pthread_mutex_destroy(&conn->mutex);
+    pthread_cond_destroy(&conn->cond);
+    free(conn);
+    return NULL;
+}
+
+/* 给新客户端创建共享内存，fd通过 SCM_RIGHTS 发过去 */
+static int _Accept(int sock_fd){
+    RvmbHello hello = { .magic = RVMB_MAGIC, .shm_size = sizeof(RvmbShared) };
+    struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+    union{
+        struct cmsghdr      hdr;
+        char                buf[CMSG_SPACE(sizeof(int))];
+    }ctrl;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    RvmbConn *conn;
+    pthread_t tid;
+    void *p;
+    int shm_fd;
+
+    conn = calloc(1, sizeof(RvmbConn));
+    if(conn == NULL) goto conn_error;
+    shm_fd = memfd_create("rvm_broker", MFD_CLOEXEC);
+    if(shm_fd < 0) goto memfd_error;
+    if(ftruncate(shm_fd, sizeof(RvmbShared)) < 0) goto mmap_error;
+    p = mmap(NULL, sizeof(RvmbShared), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if(p == MAP_FAILED) goto mmap_error;
+    conn->sh = (RvmbShared *)p;
+    conn->sh->magic = RVMB_MAGIC;
+    conn->sock_fd = sock_fd;
+    pthread_mutex_init(&conn->mutex, NULL);
+    pthread_cond_init(&conn->cond, NULL);
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&ctrl, 0, sizeof(ctrl));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &shm_fd, sizeof(int));
+    if(sendmsg(sock_fd, &msg, MSG_NOSIGNAL) != sizeof(hello)) goto send_error;
+    close(shm_fd);
+
+    if(pthread_create(&tid, NULL, _ConnThread, conn) != 0) goto thread_error;
+    pthread_detach(tid);
+    return 0;
+thread_error:
+    shm_fd = -1;
+send_error:
+    pthread_mutex_destroy(&conn->mutex);
+    pthread_cond_destroy(&conn->cond);
+    munmap(conn->sh, sizeof(RvmbShared));
+mmap_error:
+    if(shm_fd >= 0) close(shm_fd);
+memfd_error:
+    free(conn);
+conn_error:
+    close(sock_fd);
+    return -1;
+}
+
+int main(int argc, const char* argv[]){
+    struct argparse argparse;
+    struct sockaddr_un addr;
+    struct signalfd_siginfo si;
+    struct pollfd pfd[2];
+    sigset_t sigs;
+    pthread_t tid;
+    int spi_proto = 1, pipeline = 1, frame_size = 0, is_shm_lock = 0, is_adaptive_speed = 0, is_ackless = 0, ack_spin_us = 0, is_tag_ack = 0;
+    int is_stats = 0;
+    const char *speed_file = NULL;
+    int listen_fd, sig_fd, fd, ret, i;
+    const char *sock_path = RvmBroker_SockPath();
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_GROUP("通信选项"),
+        OPT_INTEGER('P', "spi-proto", &spi_proto, "SPI协议版本 1:V1(默认) 2:V2命令数据一次传输,需MCU固件支持", NULL, 0, 0),
+        OPT_INTEGER(' ', "frame-size", &frame_size, "一帧数据段大小(默认1024)，更大的读写自动分片，受spidev bufsiz限制", NULL, 0, 0),
+        OPT_BOOLEAN(' ', "shm-lock", &is_shm_lock, "进程间用共享内存排队锁代替flock", NULL, 0, 0),
+        OPT_BOOLEAN(' ', "adaptive-speed", &is_adaptive_speed, "SPI时钟根据CRC错误和超时自动升降", NULL, 0, 0),
+        OPT_STRING(' ', "speed-file", &speed_file, "配合--adaptive-speed, 保存选出的时钟，下次从这个速度开始", NULL, 0, 0),
+        OPT_INTEGER(' ', "pipeline", &pipeline, "流水线深度 1:关闭(默认) 最大8,需要-P 2和MCU固件支持", NULL, 0, 0),
+        OPT_BOOLEAN(' ', "tag-ack", &is_tag_ack, "ACK带序号，迟到的ACK在用户态跳过，不再清空串口，需要MCU固件支持", NULL, 0, 0),
+        OPT_INTEGER(' ', "ack-spin", &ack_spin_us, "等ACK时先忙等的微秒数，减少唤醒延时但占用CPU，0:不忙等(默认)", NULL, 0, 0),
+        OPT_BOOLEAN(' ', "ackless", &is_ackless, "读寄存器不等ACK，按校准的时间等待MCU，需要-P 2和MCU固件支持", NULL, 0, 0),
+        OPT_BOOLEAN(' ', "stats", &is_stats, "把通信统计记到共享内存统计页，用 mcu_reg_wr --stats 查看", NULL, 0, 0),
+        OPT_END(),
+    };
+    debug_init();
+
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "\nMCU访问代理，其他进程的 RVMcu_Init 会自动连接到这里 ", NULL);
+    argc = argparse_parse(&argparse, argc, argv);
+    if(argc < 0) return 1;
+
+    /* 在创建任何线程(包括 RVMcu_Init 里的)之前屏蔽退出信号，线程都继承这个屏蔽字，
+     * 信号只会从主线程的 signalfd 上读到，不会打断工作线程里的传输 */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    sig_fd = signalfd(-1, &sigs, SFD_CLOEXEC);
+    if(sig_fd < 0){
+        dbg_errfl("signalfd: %s", strerror(errno));
+        return 1;
+    }
+
+    /* 自己直接访问设备 */
+    RVMcu_SetBroker(0);
+    RVMcu_SetFrameSize((uint32_t)frame_size);
+    RVMcu_SetStats(is_stats);
+    ret = RVMcu_Init();
+    if(ret < 0){
+        dbg_errfl("RVMcu_Init :%d",ret);
+        close(sig_fd);
+        return ret;
+    }
+    if((is_shm_lock && RVMcu_SetLockMode(SPIREG_LOCK_SHM) < 0) ||
+        RVMcu_SetSpiProto(spi_proto) < 0 || RVMcu_SetPipeline(pipeline) < 0 ||
+        (is_tag_ack && RVMcu_SetTaggedAck(1) < 0) ||
+        (ack_spin_us && RVMcu_SetAckSpin((uint32_t)ack_spin_us) < 0) ||
+        (is_ackless && RVMcu_SetAckless(1) < 0) ||
+        (is_adaptive_speed && RVMcu_SetAdaptiveSpeed(1, speed_file) < 0)){
+        dbg_errfl("通信参数设置失败");
+        ret = -1;
+        goto exit_mcu;
+    }
+
+    /* 非阻塞，poll 说可读之后连接又被对方放弃时 accept 不会卡住 */
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listen_fd < 0) { ret = -1; goto exit_mcu; }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+    unlink(sock_path);
+    if(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 16) < 0){
+        dbg_errfl("监听 %s 失败: %s", sock_path, strerror(errno));
+        ret = -1;
+        goto exit_sock;
+    }
+    chmod(sock_path, 0666);
+
+    for(i = 0; i < RVMB_WORKERS; i++){
+        if(pthread_create(&tid, NULL, _WorkerThread, NULL) != 0) { ret = -1; goto exit_listen; }
+        pthread_detach(tid);
+    }
+
+    dbg_infoln("rvm_broker 已启动: %s", sock_path);
+    pfd[0].fd = listen_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = sig_fd;
+    pfd[1].events = POLLIN;
+    for(;;){
+        if(poll(pfd, 2, -1) < 0){
+            if(errno == EINTR) continue;
+            dbg_errfl("poll: %s", strerror(errno));
+            break;
+        }
+        if(pfd[1].revents & POLLIN){
+            if(read(sig_fd, &si, sizeof(si)) == sizeof(si))
+                dbg_infoln("收到信号 %u, 退出", si.ssi_signo);
+            __atomic_store_n(&broker_exit, 1, __ATOMIC_RELEASE);
+            break;
+        }
+        if(!(pfd[0].revents & POLLIN)) continue;
+        fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if(fd < 0){
+            if(errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+                dbg_errfl("accept: %s", strerror(errno));
+            continue;
+        }
+        _Accept(fd);
+    }
+    /* 等已经收下的请求做完再关设备 */
+    pthread_mutex_lock(&workQueue.mutex);
+    while(workQueue.active)
+        pthread_cond_wait(&workQueue.cond, &workQueue.mutex);
+    pthread_mutex_unlock(&workQueue.mutex);
+    ret = 0;
+exit_listen:
+    unlink(sock_path);
+exit_sock:
+    close(listen_fd);
+exit_mcu:
+    RVMcu_Exit();
+    close(sig_fd);
+    return ret;
+}
@@ -0,0 +1,283 @@
+/**
+ * @file rvm_broker_client.c
+ * @brief MCU访问代理的客户端，请求放进共享内存由代理执行
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ *
+ * @par 修改日志:
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+
+#include "spi_reg.h"
+#include "rvm_broker.h"
+
+static int _FutexWait(uint32_t *addr, uint32_t val, uint32_t timeout_ms){
+    struct timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+    return (int)syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void _FutexWake(uint32_t *addr){
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static uint64_t _NowMs(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000ULL + (uint64_t)ts.tv_nsec / 1000000ULL;
+}
+
+const char *RvmBroker_SockPath(void){
+    const char *path = getenv(RVMB_SOCK_ENV);
+    return (path && path[0]) ? path : RVMB_SOCK_PATH;
+}
+
+/**
+ * @brief 连接代理，收到共享内存后映射
+ * @param  c                客户端
+ * @return int              成功0 代理不存在或失败返回负数
+ */
+int RvmBroker_Connect(RvmbClient *c){
+    struct sockaddr_un addr;
+    RvmbHello hello;
+    struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+    union{
+        struct cmsghdr      hdr;
+        char                buf[CMSG_SPACE(sizeof(int))];
+    }ctrl;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    void *p;
+    int fd, shm_fd = -1;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, RvmBroker_SockPath(), sizeof(addr.sun_path) - 1);
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) goto error;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    if(recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello) || hello.magic != RVMB_MAGIC ||
+        hello.shm_size != sizeof(RvmbShared))
+        goto error;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        goto error;
+    memcpy(&shm_fd, CMSG_DATA(cmsg), sizeof(int));
+
+    p = mmap(NULL, sizeof(RvmbShared), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if(p == MAP_FAILED) goto error;
+    c->sh = (RvmbShared *)p;
+    c->sock_fd = fd;
+    pthread_mutex_init(&c->mutex, NULL);
+    return 0;
+error:
+    close(fd);
+    return -1;
+}
+
+void RvmBroker_Close(RvmbClient *c){
+    if(c->sh == NULL) return;
+    munmap(c->sh, sizeof(RvmbShared));
+    close(c->sock_fd);
+    pthread_mutex_destroy(&c->mutex);
+    c->sh = NULL;
+}
+
+/**
+ * @brief 占一个空闲槽位，都在用时在 slot_free 上睡眠等待，槽位由其他线程或者代理释放
+ *        代理卡住时放弃的槽位一直不释放，所以也要有超时，否则之后的请求(包括喂狗)永远等下去
+ * @param  timeout          毫秒，和等结果一样多留 RVMB_WAIT_MARGIN_MS
+ * @return RvmbSlot*        超时返回NULL
+ */
+static RvmbSlot *_SlotGet(RvmbClient *c, uint32_t timeout){
+    RvmbShared *sh = c->sh;
+    uint64_t deadline = _NowMs() + timeout + RVMB_WAIT_MARGIN_MS, now;
+    uint32_t expect, seq;
+    int i;
+    while(1){
+        /* 先取序号再找，找完之后有槽位释放的话 futex 会因为序号变了马上返回 */
+        seq = __atomic_load_n(&sh->slot_free, __ATOMIC_SEQ_CST);
+        for(i = 0; i < RVMB_SLOTS; i++){
+            expect = RVMB_SLOT_FREE;
+            if(__atomic_compare_exchange_n(&sh->slot[i].state, &expect, RVMB_SLOT_FILL, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                return &sh->slot[i];
+        }
+        now = _NowMs();
+        if(now >= deadline) return NULL;
+        __atomic_fetch_add(&sh->slot_waiters, 1, __ATOMIC_SEQ_CST);
+        _FutexWait(&sh->slot_free, seq, (uint32_t)(deadline - now));
+        __atomic_fetch_sub(&sh->slot_waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void _SlotPut(RvmbShared *sh, RvmbSlot *slot){
+    __atomic_store_n(&slot->state, RVMB_SLOT_FREE, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&sh->slot_free, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&sh->slot_waiters, __ATOMIC_SEQ_CST)) _FutexWake(&sh->slot_free);
+}
+
+/**
+ * @brief 提交槽位并等待结果
+ * @return int              成功0 等待超时(代理没有应答)返回-2，此时槽位交给代理释放
+ */
+static int _SlotSubmitWait(RvmbClient *c, RvmbSlot *slot, uint32_t timeout){
+    RvmbShared *sh = c->sh;
+    uint64_t deadline = _NowMs() + timeout + RVMB_WAIT_MARGIN_MS;
+    uint64_t now;
+    uint32_t st;
+
+    slot->timeout = timeout;
+    __atomic_store_n(&slot->state, RVMB_SLOT_REQ, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&c->mutex);
+    sh->req_ring[sh->req_head % RVMB_SLOTS] = (uint32_t)(slot - sh->slot);
+    __atomic_store_n(&sh->req_head, sh->req_head + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&c->mutex);
+    __atomic_fetch_add(&sh->doorbell, 1, __ATOMIC_SEQ_CST);
+    _FutexWake(&sh->doorbell);
+
+    while(1){
+        st = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if(st == RVMB_SLOT_DONE) return 0;
+        now = _NowMs();
+        if(now >= deadline) break;
+        _FutexWait(&slot->state, st, (uint32_t)(deadline - now));
+    }
+    /* 代理没回应，把槽位交给代理，做完后由它释放 */
+    while(st != RVMB_SLOT_DONE){
+        if(__atomic_compare_exchange_n(&slot->state, &st, RVMB_SLOT_ABANDON, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return -2;
+    }
+    return 0;
+}
+
+int RvmBroker_Read(RvmbClient *c, uint16_t reg_addr, uint8_t *reg_data, uint16_t reg_cnt,
+    uint32_t timeout, SpiRegPrio prio){
+    RvmbSlot *slot;
+    int ret;
+
+    /* 数据区装得下任意长度，和直接访问一样由代理里的传输层分片 */
+    slot = _SlotGet(c, timeout);
+    if(slot == NULL) return -2;
+    slot->op = RVMB_OP_READ;
+    slot->prio = (uint8_t)prio;
+    slot->reg_addr = reg_addr;
+    slot->reg_cnt = reg_cnt;
+    ret = _SlotSubmitWait(c, slot, timeout);
+    if(ret < 0) return ret;
+    ret = slot->ret;
+    if(ret == 0) memcpy(reg_data, slot->data, reg_cnt);
+    _SlotPut(c->sh, slot);
+    return ret;
+}
+
+int RvmBroker_Write(RvmbClient *c, uint16_t reg_addr, const uint8_t *reg_data, uint16_t reg_cnt,
+    uint32_t timeout, SpiRegPrio prio){
+    RvmbSlot *slot;
+    int ret;
+
+    slot = _SlotGet(c, timeout);
+    if(slot == NULL) return -2;
+    slot->op = RVMB_OP_WRITE;
+    slot->prio = (uint8_t)prio;
+    slot->reg_addr = reg_addr;
+    slot->reg_cnt = reg_cnt;
+    memcpy(slot->data, reg_data, reg_cnt);
+    ret = _SlotSubmitWait(c, slot, timeout);
+    if(ret < 0) return ret;
+    ret = slot->ret;
+    _SlotPut(c->sh, slot);
+    return ret;
+}
+
+/**
+ * @brief 批量操作的一部分，描述数组和数据一起放进一个槽位，在代理中作为一次 SpiReg_TransactEx 执行
+ * @param  sent             返回1表示代理执行了，0表示没拿到槽位或代理没应答
+ * @return int              同 SpiReg_Transact
+ */
+static int _TransactSlot(RvmbClient *c, SpiRegOp *ops, int n, uint32_t timeout, SpiRegPrio prio, int *sent){
+    RvmbSlot *slot;
+    RvmbOp *rop;
+    size_t off;
+    int i, ret;
+
+    *sent = 0;
+    slot = _SlotGet(c, timeout);
+    if(slot == NULL) return -2;
+    slot->op = RVMB_OP_TRANSACT;
+    slot->prio = (uint8_t)prio;
+    slot->reg_cnt = (uint16_t)n;
+    rop = (RvmbOp *)slot->data;
+    off = sizeof(RvmbOp) * (size_t)n;
+    for(i = 0; i < n; i++){
+        rop[i].type = ops[i].type;
+        rop[i].flags = ops[i].flags;
+        rop[i].reg_addr = ops[i].reg_addr;
+        rop[i].reg_cnt = ops[i].reg_cnt;
+        rop[i].ret = 0;
+        if(ops[i].type == SPIREG_OP_WRITE)
+            memcpy(slot->data + off, ops[i].wdata, ops[i].reg_cnt);
+        off += ops[i].reg_cnt;
+    }
+    ret = _SlotSubmitWait(c, slot, timeout);
+    if(ret < 0) return ret;
+    *sent = 1;
+
+    off = sizeof(RvmbOp) * (size_t)n;
+    for(i = 0; i < n; i++){
+        ops[i].ret = rop[i].ret;
+        if(ops[i].type == SPIREG_OP_READ && ops[i].ret == 0)
+            memcpy(ops[i].rdata, slot->data + off, ops[i].reg_cnt);
+        off += ops[i].reg_cnt;
+    }
+    ret = slot->ret;
+    _SlotPut(c->sh, slot);
+    return ret;
+}
+
+/**
+ * @brief 批量操作，一个槽位装不下(超过 RVMB_MAX_OPS 个操作或者数据超过 RVMB_DATA_MAX)时按顺序拆成几次提交，
+ *        每次在代理中各自加一次锁，拆开的两部分之间别的请求可以插进来
+ * @return int              同 SpiReg_Transact
+ */
+int RvmBroker_Transact(RvmbClient *c, SpiRegOp *ops, int n, uint32_t timeout, SpiRegPrio prio){
+    size_t size;
+    int i, cnt, ret, first_err = 0, sent;
+
+    if(n <= 0) return -1;
+    for(i = 0; i < n; i += cnt){
+        /* 单个操作加上描述总是装得下，每次至少一个 */
+        size = 0;
+        for(cnt = 0; i + cnt < n && cnt < RVMB_MAX_OPS; cnt++){
+            size += sizeof(RvmbOp) + ops[i + cnt].reg_cnt;
+            if(size > RVMB_DATA_MAX) break;
+        }
+        ret = _TransactSlot(c, ops + i, cnt, timeout, prio, &sent);
+        if(!sent) return ret;
+        if(ret < 0 && first_err == 0) first_err = ret;
+    }
+    return first_err;
+}
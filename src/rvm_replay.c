@@ -0,0 +1,478 @@
+/**
+ * @file rvm_replay.c
+ * @brief 解析 --capture / RVMCU_CAPTURE 抓到的链路数据，按协议还原每一次寄存器读写，
+ *        打印时间线和各阶段耗时(握手、命令、命令ACK、数据、ACK)，最后给出各阶段的分布
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ *
+ * @par 修改日志:
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "argparse.h"
+#include "crc_check.h"
+#include "spi_frame.h"
+#include "spi_cap.h"
+#include "lat_hist.h"
+
+#define RP_PEND_MAX             16          /* 流水线中最多同时等ACK的帧 */
+
+typedef enum _RpStage{
+    RP_STAGE_HS,                /* 写'S'/'P' 到读到ACK */
+    RP_STAGE_CMD,               /* V1的命令传输 */
+    RP_STAGE_CMD_ACK,           /* V1等命令的ACK */
+    RP_STAGE_DATA,              /* 数据传输，V2和流水线含命令 */
+    RP_STAGE_ACK,               /* 等最后的ACK, 流水线是传输结束到收到ACK */
+    RP_STAGE_TOTAL,
+    RP_STAGE_CNT,
+}RpStage;
+
+typedef enum _RpResult{
+    RP_OK,
+    RP_NACK,
+    RP_TIMEOUT,
+    RP_CRC,                     /* 读到的数据CRC不对 */
+    RP_RESULT_CNT,
+}RpResult;
+
+typedef enum _RpState{
+    RP_IDLE,
+    RP_WAIT_HS_ACK,
+    RP_WAIT_CMD,
+    RP_WAIT_CMD_ACK,
+    RP_WAIT_DATA,
+    RP_WAIT_ACK,
+    RP_PIPE,
+}RpState;
+
+typedef struct _RpTxn{
+    uint8_t                 proto;          /* 1:V1 2:V2 3:流水线 4:无ACK 0:握手就失败了 */
+    uint8_t                 code;
+    uint8_t                 tag;
+    uint16_t                reg_addr;
+    uint16_t                reg_cnt;
+    uint8_t                 cmd[SPI_CMD_LEN];
+    uint8_t                 crc_err;
+    uint64_t                start_ns;
+    uint64_t                spi_end_ns;     /* 流水线: 数据传输结束的时间 */
+    int64_t                 stage[RP_STAGE_CNT];    /* -1为没有这个阶段 */
+}RpTxn;
+
+typedef struct _Replay{
+    RpState                 state;
+    int                     pipe;           /* 握手是'P' */
+    int                     no_ack;         /* 握手是'Q', 这一帧没有ACK */
+    int                     tagged;         /* 握手是'T'/'U', ACK是 [ACK/NACK, tag] */
+    uint8_t                 tag;
+    int                     carry;          /* 上一次读到的最后一个字节, ACK可能被拆开读, -1没有 */
+    uint64_t                stale;          /* 带序号ACK时跳过的迟到ACK */
+    int                     status;         /* 'T'的序号带 SPI_TAG_STATUS, 最后的ACK后面有状态 */
+    uint32_t                status_left;    /* 最后的ACK后面还没读到的状态字节 */
+    uint64_t                status_acks;    /* 带状态的ACK数 */
+    uint64_t                notifies;       /* 两帧之间MCU发来的 SPI_NOTIFY */
+    uint64_t                hs_start;
+    int64_t                 pipe_hs;        /* 流水线握手的耗时，记到这一段的第一帧 */
+    RpTxn                   cur;
+    RpTxn                   pend[RP_PEND_MAX];
+    int                     pend_cnt;
+    uint8_t                 ack_half[2];    /* 带序号ACK可能分两次读到 */
+    int                     ack_half_len;
+    int                     quiet;
+    uint64_t                txns;
+    uint64_t                result[RP_RESULT_CNT];
+    uint64_t                unknown;        /* 对不上协议的记录 */
+    LatHist                 hist[RP_STAGE_CNT];
+}Replay;
+
+static const char* const usages[] = {
+    "rvm_replay [options] <capture file>",
+    NULL,
+};
+
+static const char *stage_name[RP_STAGE_CNT] = {"hs", "cmd", "cmd_ack", "data", "ack", "total"};
+static const char *result_name[RP_RESULT_CNT] = {"OK", "NACK", "TIMEOUT", "CRC"};
+static Replay replay;
+
+static void _TxnNew(RpTxn *txn, uint64_t start_ns){
+    int i;
+    memset(txn, 0, sizeof(RpTxn));
+    txn->start_ns = start_ns;
+    for(i = 0; i < RP_STAGE_CNT; i++)
+        txn->stage[i] = -1;
+}
+
+static void _TxnSetCmd(RpTxn *txn, const uint8_t *cmd){
+    memcpy(txn->cmd, cmd, SPI_CMD_LEN);
+    SpiFrame_ParseCmd(cmd, &txn->code, &txn->reg_addr, &txn->reg_cnt);
+    txn->tag = cmd[CMD_SEQ_1BYTE_OFFSET] & SPI_TAG_MASK;
+}
+
+/* 读命令时检查MCU回来的数据段CRC，和 spi_reg.c 的校验方式一致 */
+static void _TxnCheckRead(RpTxn *txn, const uint8_t *rx, uint32_t len){
+    uint16_t crc16_val;
+    if(txn->code != SPI_CMD_READ_REG && txn->code != SPI_CMD_READ_REG_V2) return;
+    if(len < (uint32_t)txn->reg_cnt + WR_CRC_LEN){
+        txn->crc_err = 1;
+        return;
+    }
+    crc16_val = crc16(crc16(0xffff, txn->cmd, CMD_WR_CMD_LEN), rx, txn->reg_cnt);
+    txn->crc_err = SpiFrame_GetTailCrc(rx + txn->reg_cnt) != crc16_val;
+}
+
+static void _TxnEmit(RpTxn *txn, uint64_t end_ns, RpResult result){
+    char col[RP_STAGE_CNT][16];
+    const char *op;
+    int i;
+
+    if(result == RP_OK && txn->crc_err) result = RP_CRC;
+    txn->stage[RP_STAGE_TOTAL] = (int64_t)(end_ns - txn->start_ns);
+    replay.txns++;
+    replay.result[result]++;
+    for(i = 0; i < RP_STAGE_CNT; i++){
+        if(txn->stage[i] < 0){
+            strcpy(col[i], "-");
+            continue;
+        }
+        LatHist_Record(&replay.hist[i], (uint64_t)txn->stage[i]);
+        snprintf(col[i], sizeof(col[i]), "%.1f", txn->stage[i] / 1000.0);
+    }
+    if(replay.quiet) return;
+    op = (txn->code == SPI_CMD_READ_REG || txn->code == SPI_CMD_READ_REG_V2) ? "R" :
+        (txn->code == SPI_CMD_WRITE_REG || txn->code == SPI_CMD_WRITE_REG_V2) ? "W" : "?";
+    printf("%12.3f %-4s %s 0x%04x %5u %9s %9s %9s %9s %9s %10s  %s\n", txn->start_ns / 1e6,
+        txn->proto == 1 ? "V1" : txn->proto == 2 ? "V2" : txn->proto == 3 ? "PIPE" : txn->proto == 4 ? "Q" : "HS", op, txn->reg_addr, txn->reg_cnt,
+        col[RP_STAGE_HS], col[RP_STAGE_CMD], col[RP_STAGE_CMD_ACK], col[RP_STAGE_DATA], col[RP_STAGE_ACK],
+        col[RP_STAGE_TOTAL], result_name[result]);
+}
+
+/* 流水线中止(握手重来或者等ACK超时)，还没确认的帧都算超时 */
+static void _PipeAbort(uint64_t now){
+    int i;
+    for(i = 0; i < replay.pend_cnt; i++)
+        _TxnEmit(&replay.pend[i], now, RP_TIMEOUT);
+    replay.pend_cnt = 0;
+    replay.ack_half_len = 0;
+}
+
+/* 没有收尾的传输，一般是调用者等超时后放弃了 */
+static void _Abort(uint64_t now){
+    if(replay.state == RP_PIPE || replay.pend_cnt)
+        _PipeAbort(now);
+    else if(replay.state != RP_IDLE && replay.state != RP_WAIT_HS_ACK)
+        _TxnEmit(&replay.cur, now, RP_TIMEOUT);
+    replay.state = RP_IDLE;
+}
+
+static void _OnPipeAck(const uint8_t ack[SPI_TAG_ACK_LEN], uint64_t end_ns){
+    int i, j;
+    for(i = 0; i < replay.pend_cnt; i++){
+        if(replay.pend[i].tag == ack[1]) break;
+    }
+    if(i == replay.pend_cnt) return;    /* 之前超时的帧留下的ACK */
+    /* MCU按顺序回ACK, 跳过的帧是丢了 */
+    for(j = 0; j < i; j++)
+        _TxnEmit(&replay.pend[j], end_ns, RP_TIMEOUT);
+    replay.pend[i].stage[RP_STAGE_ACK] = (int64_t)(end_ns - replay.pend[i].spi_end_ns);
+    _TxnEmit(&replay.pend[i], end_ns, ack[0] == SPI_ACK ? RP_OK : RP_NACK);
+    replay.pend_cnt -= i + 1;
+    memmove(replay.pend, replay.pend + i + 1, sizeof(RpTxn) * (size_t)replay.pend_cnt);
+}
+
+static void _OnUartTx(const SpiCapRec *rec, const uint8_t *data){
+    uint32_t i;
+    for(i = 0; i < rec->len; i++){
+        if(data[i] != SPI_CMD_START && data[i] != SPI_CMD_PIPE_START && data[i] != SPI_CMD_QUIET_START &&
+            data[i] != SPI_CMD_TAG_START && data[i] != SPI_CMD_TAG_PIPE_START) continue;
+        _Abort(rec->ts_ns);
+        replay.pipe = data[i] == SPI_CMD_PIPE_START || data[i] == SPI_CMD_TAG_PIPE_START;
+        replay.no_ack = data[i] == SPI_CMD_QUIET_START;
+        replay.tagged = data[i] == SPI_CMD_TAG_START || data[i] == SPI_CMD_TAG_PIPE_START;
+        /* 序号紧跟在握手字节后面 */
+        replay.status = 0;
+        if(replay.tagged && i + 1 < rec->len){
+            replay.status = data[i] == SPI_CMD_TAG_START && (data[i + 1] & SPI_TAG_STATUS);
+            replay.tag = data[++i] & SPI_TAG_MASK;
+        }
+        replay.carry = -1;
+        replay.status_left = 0;
+        replay.hs_start = rec->ts_ns;
+        /* 'Q'没有握手ACK，直接等命令 */
+        replay.state = replay.no_ack ? RP_WAIT_CMD : RP_WAIT_HS_ACK;
+        _TxnNew(&replay.cur, rec->ts_ns);
+    }
+}
+
+/* 在读到的字节(连同上次剩下的一个字节)里找本帧序号的ACK, 返回ACK/NACK, 没有返回-1
+ * 迟到的带状态ACK后面的状态字节最高位都是1 (SPI_STATUS_MARK)，不会被当成ACK或序号 */
+static int _FindTagAck(const uint8_t *data, uint32_t len){
+    int prev = replay.carry;
+    uint32_t i;
+    replay.carry = data[len - 1];
+    for(i = 0; i < len; prev = data[i++]){
+        if((prev == SPI_ACK || prev == SPI_NACK) && data[i] == replay.tag){
+            replay.carry = -1;
+            return prev;
+        }
+    }
+    return -1;
+}
+
+static void _OnUartRx(const SpiCapRec *rec, const uint8_t *data){
+    uint64_t end = rec->ts_ns + rec->dur_ns;
+    uint32_t i, rec_len = rec->len;
+    int ch;
+
+    if(rec->len == 0){
+        /* 流水线空闲时清缓冲区之类的读不算超时 */
+        if(replay.state == RP_PIPE && replay.pend_cnt == 0) return;
+        if(replay.state == RP_WAIT_ACK || replay.state == RP_WAIT_CMD_ACK)
+            replay.cur.stage[replay.state == RP_WAIT_ACK ? RP_STAGE_ACK : RP_STAGE_CMD_ACK] = rec->dur_ns;
+        if(replay.state == RP_WAIT_HS_ACK){
+            replay.cur.stage[RP_STAGE_HS] = (int64_t)(end - replay.hs_start);
+            _TxnEmit(&replay.cur, end, RP_TIMEOUT);
+            replay.state = RP_IDLE;
+            return;
+        }
+        _Abort(end);
+        return;
+    }
+    if(replay.status_left){
+        /* 最后ACK后面的状态，不是ACK */
+        i = rec->len < replay.status_left ? rec->len : replay.status_left;
+        replay.status_left -= i;
+        if(replay.status_left == 0) replay.status_acks++;
+        if(i == rec->len) return;
+        data += i;
+        rec_len = rec->len - i;
+    }
+    if(replay.state == RP_IDLE){
+        /* 两帧之间MCU的通知，混着迟到的ACK时照旧处理 */
+        for(i = 0, ch = 0; i < rec_len; i++){
+            if(data[i] == SPI_NOTIFY) ch++;
+        }
+        replay.notifies += (uint64_t)ch;
+        if((uint32_t)ch == rec_len) return;
+    }
+    ch = data[0];
+    if(replay.tagged && replay.state != RP_PIPE){
+        ch = _FindTagAck(data, rec_len);
+        if(ch < 0){
+            replay.stale++;
+            return;
+        }
+    }
+    switch(replay.state){
+    case RP_WAIT_HS_ACK:
+        if(ch != SPI_ACK){
+            replay.cur.stage[RP_STAGE_HS] = (int64_t)(end - replay.hs_start);
+            _TxnEmit(&replay.cur, end, RP_NACK);
+            replay.state = RP_IDLE;
+            break;
+        }
+        if(replay.pipe){
+            replay.pipe_hs = (int64_t)(end - replay.hs_start);
+            replay.state = RP_PIPE;
+        }else{
+            replay.cur.stage[RP_STAGE_HS] = (int64_t)(end - replay.hs_start);
+            replay.state = RP_WAIT_CMD;
+        }
+        break;
+    case RP_WAIT_CMD_ACK:
+        replay.cur.stage[RP_STAGE_CMD_ACK] = rec->dur_ns;
+        if(ch != SPI_ACK){
+            _TxnEmit(&replay.cur, end, RP_NACK);
+            replay.state = RP_IDLE;
+            break;
+        }
+        replay.state = RP_WAIT_DATA;
+        break;
+    case RP_WAIT_ACK:
+        replay.cur.stage[RP_STAGE_ACK] = rec->dur_ns;
+        _TxnEmit(&replay.cur, end, ch == SPI_ACK ? RP_OK : RP_NACK);
+        replay.state = RP_IDLE;
+        if(replay.status) replay.status_left = SPI_STATUS_LEN;
+        break;
+    case RP_PIPE:
+        for(i = 0; i < rec_len; i++){
+            replay.ack_half[replay.ack_half_len++] = data[i];
+            if(replay.ack_half_len < SPI_TAG_ACK_LEN) continue;
+            replay.ack_half_len = 0;
+            _OnPipeAck(replay.ack_half, end);
+        }
+        break;
+    default:
+        replay.unknown++;
+        break;
+    }
+}
+
+static void _OnSpi(const SpiCapRec *rec, const uint8_t *tx, const uint8_t *rx){
+    RpTxn *txn;
+    uint8_t code;
+
+    switch(replay.state){
+    case RP_WAIT_CMD:
+        if(rec->len < SPI_CMD_LEN) break;
+        _TxnSetCmd(&replay.cur, tx);
+        code = replay.cur.code;
+        if((code == SPI_CMD_READ_REG || code == SPI_CMD_WRITE_REG) && rec->len == SPI_CMD_LEN){
+            replay.cur.proto = 1;
+            replay.cur.stage[RP_STAGE_CMD] = rec->dur_ns;
+            replay.state = RP_WAIT_CMD_ACK;
+            return;
+        }
+        replay.cur.proto = 2;
+        replay.cur.stage[RP_STAGE_DATA] = rec->dur_ns;
+        _TxnCheckRead(&replay.cur, rx + SPI_CMD_LEN, rec->len - SPI_CMD_LEN);
+        replay.state = RP_WAIT_ACK;
+        if(replay.no_ack){
+            /* 握手阶段是发'Q'后定时等待的时间，结果只看CRC */
+            replay.cur.proto = 4;
+            replay.cur.stage[RP_STAGE_HS] = (int64_t)(rec->ts_ns - replay.hs_start);
+            _TxnEmit(&replay.cur, rec->ts_ns + rec->dur_ns, RP_OK);
+            replay.state = RP_IDLE;
+        }
+        return;
+    case RP_WAIT_DATA:
+        replay.cur.stage[RP_STAGE_DATA] = rec->dur_ns;
+        _TxnCheckRead(&replay.cur, rx, rec->len);
+        replay.state = RP_WAIT_ACK;
+        return;
+    case RP_PIPE:
+        if(rec->len < SPI_CMD_LEN) break;
+        if(replay.pend_cnt == RP_PEND_MAX)
+            _OnPipeAck((const uint8_t[]){SPI_NACK, replay.pend[0].tag}, rec->ts_ns);
+        txn = &replay.pend[replay.pend_cnt++];
+        _TxnNew(txn, rec->ts_ns);
+        _TxnSetCmd(txn, tx);
+        txn->proto = 3;
+        txn->stage[RP_STAGE_DATA] = rec->dur_ns;
+        txn->spi_end_ns = rec->ts_ns + rec->dur_ns;
+        /* 握手记到这一段的第一帧 */
+        if(replay.pipe_hs >= 0){
+            txn->stage[RP_STAGE_HS] = replay.pipe_hs;
+            txn->start_ns = replay.hs_start;
+            replay.pipe_hs = -1;
+        }
+        _TxnCheckRead(txn, rx + SPI_CMD_LEN, rec->len - SPI_CMD_LEN);
+        return;
+    default:
+        break;
+    }
+    replay.unknown++;
+}
+
+static void _PrintRaw(const SpiCapRec *rec, const uint8_t *data){
+    static const char *type_name[] = {"?", "UART_TX", "UART_RX", "UART_CLEAN", "SPI"};
+    uint32_t i, show = rec->len > 16 ? 16 : rec->len;
+    printf("%12.3f +%8.1fus %-10s len=%-5u arg=%-6d ", rec->ts_ns / 1e6, rec->dur_ns / 1000.0,
+        rec->type <= SPI_CAP_SPI ? type_name[rec->type] : type_name[0], rec->len, rec->arg);
+    for(i = 0; i < show; i++)
+        printf("%02x ", data[i]);
+    printf("%s\n", show < rec->len ? "..." : "");
+}
+
+static void _PrintSummary(const SpiCapFileHdr *hdr){
+    int i;
+    printf("\n设备:%s 传输:%llu次", hdr->name, (unsigned long long)replay.txns);
+    for(i = 0; i < RP_RESULT_CNT; i++)
+        printf(" %s:%llu", result_name[i], (unsigned long long)replay.result[i]);
+    printf(" 无法解析的记录:%llu 跳过的迟到ACK:%llu 带状态的ACK:%llu MCU通知:%llu\n", (unsigned long long)replay.unknown, 
+        (unsigned long long)replay.stale, (unsigned long long)replay.status_acks, (unsigned long long)replay.notifies);
+    printf("%-8s %10s %10s %10s %10s %10s %10s\n", "stage", "count", "avg", "p50", "p99", "p99.9", "max");
+    for(i = 0; i < RP_STAGE_CNT; i++){
+        if(replay.hist[i].count == 0) continue;
+        printf("%-8s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", stage_name[i],
+            (unsigned long long)replay.hist[i].count,
+            replay.hist[i].sum_ns / 1000.0 / replay.hist[i].count,
+            LatHist_Percentile(&replay.hist[i], 50) / 1000.0, LatHist_Percentile(&replay.hist[i], 99) / 1000.0,
+            LatHist_Percentile(&replay.hist[i], 99.9) / 1000.0, replay.hist[i].max_ns / 1000.0);
+    }
+}
+
+int main(int argc, const char* argv[]){
+    struct argparse argparse;
+    SpiCapFileHdr hdr;
+    SpiCapRec rec;
+    uint8_t *data = NULL;
+    uint32_t data_size = 0, need, rec_no = 0;
+    int is_quiet = 0, is_raw = 0, ret = 1;
+    FILE *fp;
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_BOOLEAN('q', "quiet", &is_quiet, "只打印汇总，不打印每次传输", NULL, 0, 0),
+        OPT_BOOLEAN('r', "raw", &is_raw, "打印每一条原始记录", NULL, 0, 0),
+        OPT_END(),
+    };
+    debug_init();
+
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "\n解析 mcu_reg_wr --capture 的抓包文件，时间单位: 时间线ms 各阶段us ", NULL);
+    argc = argparse_parse(&argparse, argc, argv);
+    if(argc != 1){
+        argparse_usage(&argparse);
+        return 1;
+    }
+
+    fp = fopen(argv[0], "rb");
+    if(fp == NULL){
+        dbg_errfl("打开 %s 失败", argv[0]);
+        return 1;
+    }
+    if(fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != SPI_CAP_MAGIC ||
+        hdr.version != SPI_CAP_VERSION || hdr.rec_size != sizeof(SpiCapRec)){
+        dbg_errfl("%s 不是抓包文件或者版本不对", argv[0]);
+        goto exit;
+    }
+    hdr.name[sizeof(hdr.name) - 1] = '\0';
+    replay.quiet = is_quiet;
+    replay.pipe_hs = -1;
+    replay.carry = -1;
+    if(!is_quiet && !is_raw)
+        printf("%12s %-4s %s %-6s %5s %9s %9s %9s %9s %9s %10s  %s\n", "time(ms)", "mode", "op", "addr", "cnt",
+            "hs", "cmd", "cmd_ack", "data", "ack", "total(us)", "result");
+    while(fread(&rec, sizeof(rec), 1, fp) == 1){
+        rec_no++;
+        /* 文件可能损坏，先检查再按长度分配，一条记录不会超过一次SPI消息 */
+        if(rec.type < SPI_CAP_UART_TX || rec.type > SPI_CAP_SPI || rec.len > hdr.max_msg){
+            dbg_errfl("第 %u 条记录损坏: type %u len %u(最大 %u)", rec_no, rec.type, rec.len, hdr.max_msg);
+            ret = 2;
+            break;
+        }
+        need = rec.type == SPI_CAP_SPI ? rec.len * 2 : rec.len;
+        if(need > data_size){
+            free(data);
+            data = (uint8_t *)malloc(need);
+            data_size = data ? need : 0;
+            if(data == NULL) goto exit;
+        }
+        /* 进程被杀时最后一条可能没写完 */
+        if(need && fread(data, 1, need, fp) != need) break;
+        if(is_raw){
+            _PrintRaw(&rec, data);
+            continue;
+        }
+        switch(rec.type){
+        case SPI_CAP_UART_TX: _OnUartTx(&rec, data); break;
+        case SPI_CAP_UART_RX: _OnUartRx(&rec, data); break;
+        case SPI_CAP_SPI: _OnSpi(&rec, data, data + rec.len); break;
+        default: break;
+        }
+    }
+    if(!is_raw) _PrintSummary(&hdr);
+    /* 损坏前的记录照样汇总，但返回失败 */
+    if(ret != 2) ret = 0;
+exit:
+    free(data);
+    fclose(fp);
+    return ret;
+}
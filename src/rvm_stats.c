@@ -0,0 +1,195 @@
+/**
+ * @file rvm_stats.c
+ * @brief MCU通信的实时统计页
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ *
+ * @par 修改日志:
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rvm_stats.h"
+
+static uint64_t _NowNs(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+const char *RvmStats_Path(void){
+    const char *path = getenv(RVMS_PATH_ENV);
+    return (path && path[0]) ? path : RVMS_PATH;
+}
+
+/**
+ * @brief 打开统计页，写者不存在时创建
+ * @param  s                统计页
+ * @param  read_only        1:监控程序只读映射，页不存在时失败
+ * @return int              成功0 失败负数, 版本不一致也算失败
+ */
+int RvmStats_Open(RvmStats *s, int read_only){
+    struct stat st;
+    RvmsPage *page;
+    uint32_t expect = 0;
+    void *p;
+    int fd;
+
+    s->page = NULL;
+    s->fd = -1;
+    fd = read_only ? open(RvmStats_Path(), O_RDONLY | O_CLOEXEC) :
+        open(RvmStats_Path(), O_CREAT | O_RDWR | O_CLOEXEC, 0666);
+    if(fd < 0) return -1;
+    if(fstat(fd, &st) < 0) goto error;
+    if((size_t)st.st_size < sizeof(RvmsPage)){
+        if(read_only || ftruncate(fd, sizeof(RvmsPage)) < 0) goto error;
+    }
+    p = mmap(NULL, sizeof(RvmsPage), read_only ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(p == MAP_FAILED) goto error;
+    page = (RvmsPage *)p;
+
+    /* 新建的页全0, 第一个打开的写者填写页头 */
+    if(!read_only && __atomic_compare_exchange_n(&page->magic, &expect, RVMS_MAGIC, 0, 
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+        page->version = RVMS_VERSION;
+        __atomic_store_n(&page->size, (uint32_t)sizeof(RvmsPage), __ATOMIC_RELEASE);
+    }
+    if(__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != RVMS_MAGIC || 
+        __atomic_load_n(&page->size, __ATOMIC_ACQUIRE) != sizeof(RvmsPage) || page->version != RVMS_VERSION){
+        munmap(p, sizeof(RvmsPage));
+        goto error;
+    }
+    s->fd = fd;
+    s->page = page;
+    return 0;
+error:
+    close(fd);
+    return -1;
+}
+
+void RvmStats_Close(RvmStats *s){
+    if(s->page == NULL) return;
+    munmap(s->page, sizeof(RvmsPage));
+    close(s->fd);
+    s->page = NULL;
+    s->fd = -1;
+}
+
+/* 计数器都用原子加，写者之间不互斥，持有者被杀死或者停住也卡不住别人 */
+static void _Add(uint64_t *v, uint64_t n){
+    __atomic_fetch_add(v, n, __ATOMIC_RELAXED);
+}
+
+static void _Max(uint64_t *v, uint64_t n){
+    uint64_t old = __atomic_load_n(v, __ATOMIC_RELAXED);
+    while(n > old && !__atomic_compare_exchange_n(v, &old, n, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void _Touch(RvmsPage *page){
+    __atomic_store_n(&page->c.update_ns, _NowNs(), __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 读出所有计数器，每个计数器单独原子读，不同计数器之间不保证是同一时刻
+ * @param  s                统计页
+ * @param  out              输出
+ * @return int              成功0 页没打开返回负数
+ */
+int RvmStats_Snapshot(RvmStats *s, RvmsCounters *out){
+    const uint64_t *src;
+    uint64_t *dst;
+    size_t i;
+
+    if(s->page == NULL) return -1;
+    /* RvmsCounters 全是 uint64_t 和 RvmsRing，按8字节逐个读 */
+    src = (const uint64_t *)&s->page->c;
+    dst = (uint64_t *)out;
+    for(i = 0; i < sizeof(RvmsCounters) / sizeof(uint64_t); i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * @brief 记录一帧的结果
+ * @param  s                统计页
+ * @param  is_write         1:写帧 0:读帧
+ * @param  bytes            寄存器字节数，失败的帧不计
+ * @param  ret              帧的结果 0成功 -2超时 -3CRC错误
+ */
+void RvmStats_Frame(RvmStats *s, int is_write, uint32_t bytes, int ret){
+    RvmsPage *page = s->page;
+    if(page == NULL) return;
+    _Add(is_write ? &page->c.frames_write : &page->c.frames_read, 1);
+    if(ret == 0){
+        _Add(is_write ? &page->c.bytes_write : &page->c.bytes_read, bytes);
+    }else if(ret == -2){
+        _Add(&page->c.timeouts, 1);
+    }else if(ret == -3){
+        _Add(&page->c.crc_errs, 1);
+    }else{
+        _Add(&page->c.errors, 1);
+    }
+    _Touch(page);
+}
+
+void RvmStats_LockWait(RvmStats *s, uint64_t wait_ns){
+    RvmsPage *page = s->page;
+    if(page == NULL) return;
+    _Add(&page->c.lock_cnt, 1);
+    _Add(&page->c.lock_wait_ns, wait_ns);
+    _Max(&page->c.lock_wait_max_ns, wait_ns);
+    _Touch(page);
+}
+
+/**
+ * @brief 记录环形缓冲区的水位，空槽用CAS占用，表满时丢掉这次采样
+ * @param  s                统计页
+ * @param  cb_addr          环形缓冲区寄存器起始地址
+ * @param  is_free          1:size是可用容量 0:size是已用容量
+ * @param  size             字节数
+ */
+void RvmStats_Ring(RvmStats *s, uint16_t cb_addr, int is_free, uint32_t size){
+    RvmsPage *page = s->page;
+    RvmsRing *ring = NULL;
+    uint64_t key;
+    int i;
+
+    if(page == NULL || cb_addr == 0) return;
+    for(i = 0; i < RVMS_RING_MAX; i++){
+        key = __atomic_load_n(&page->c.ring[i].cb_addr, __ATOMIC_RELAXED);
+        if(key == 0 && __atomic_compare_exchange_n(&page->c.ring[i].cb_addr, &key, cb_addr, 0, 
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            key = cb_addr;
+        if(key == cb_addr){
+            ring = &page->c.ring[i];
+            break;
+        }
+    }
+    if(ring == NULL) return;
+    if(is_free){
+        __atomic_store_n(&ring->free, size, __ATOMIC_RELAXED);
+    }else{
+        __atomic_store_n(&ring->used, size, __ATOMIC_RELAXED);
+        _Max(&ring->used_max, size);
+    }
+    _Add(&ring->samples, 1);
+    _Touch(page);
+}
+
+void RvmStats_Can(RvmStats *s, uint32_t rx, uint32_t tx){
+    RvmsPage *page = s->page;
+    if(page == NULL) return;
+    if(rx) _Add(&page->c.can_rx, rx);
+    if(tx) _Add(&page->c.can_tx, tx);
+    _Touch(page);
+}
@@ -0,0 +1,197 @@
+/**
+ * @file spi_cap.c
+ * @brief 链路抓包
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ *
+ * @par 修改日志:
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "spi_cap.h"
+
+static uint64_t _NowNs(clockid_t clk){
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* 写一条记录的头，调用者持有 cap->mutex */
+static void _RecHead(SpiCap *cap, uint16_t type, uint64_t start, uint32_t len, int32_t arg, uint32_t speed_hz){
+    SpiCapRec rec;
+    uint64_t now = _NowNs(CLOCK_MONOTONIC);
+    rec.ts_ns = start - cap->start_ns;
+    rec.dur_ns = (uint32_t)(now - start);
+    rec.len = len;
+    rec.arg = arg;
+    rec.type = type;
+    rec.speed_khz = (uint16_t)(speed_hz / 1000);
+    fwrite(&rec, sizeof(rec), 1, cap->fp);
+    cap->recs++;
+    cap->bytes += sizeof(rec);
+}
+
+static void _Rec(SpiCap *cap, uint16_t type, uint64_t start, const void *data, uint32_t len, int32_t arg){
+    pthread_mutex_lock(&cap->mutex);
+    _RecHead(cap, type, start, len, arg, 0);
+    if(len) fwrite(data, 1, len, cap->fp);
+    cap->bytes += len;
+    pthread_mutex_unlock(&cap->mutex);
+}
+
+/* 各段的tx(或rx)首尾相接写出，没有缓冲区的段填0 */
+static void _WriteSegs(SpiCap *cap, const struct spi_ioc_transfer *xfer, int n, int rx){
+    static const uint8_t zero[256];
+    uint32_t left, cnt;
+    uint64_t buf;
+    int i;
+    for(i = 0; i < n; i++){
+        buf = rx ? xfer[i].rx_buf : xfer[i].tx_buf;
+        if(buf){
+            fwrite((const void *)(uintptr_t)buf, 1, xfer[i].len, cap->fp);
+            continue;
+        }
+        for(left = xfer[i].len; left; left -= cnt){
+            cnt = left < sizeof(zero) ? left : sizeof(zero);
+            fwrite(zero, 1, cnt, cap->fp);
+        }
+    }
+}
+
+static int _CapXfer(SpiTrans *t, struct spi_ioc_transfer *xfer, int n){
+    SpiCap *cap = (SpiCap *)t->priv;
+    uint64_t start = _NowNs(CLOCK_MONOTONIC);
+    uint32_t total = 0;
+    int i, ret;
+
+    ret = SpiTrans_Xfer(&cap->inner, xfer, n);
+    for(i = 0; i < n; i++)
+        total += xfer[i].len;
+    pthread_mutex_lock(&cap->mutex);
+    _RecHead(cap, SPI_CAP_SPI, start, total, ret, n ? xfer[0].speed_hz : 0);
+    _WriteSegs(cap, xfer, n, 0);
+    _WriteSegs(cap, xfer, n, 1);
+    cap->bytes += (uint64_t)total * 2;
+    /* 进程被杀或者崩溃时最多丢最后 SPI_CAP_FLUSH_MS 的记录，整条记录写完才刷 */
+    if((int64_t)(start - cap->flush_ns) >= (int64_t)SPI_CAP_FLUSH_MS * 1000000LL){
+        fflush(cap->fp);
+        cap->flush_ns = start;
+    }
+    pthread_mutex_unlock(&cap->mutex);
+    return ret;
+}
+
+static int _CapUartWrite(SpiTrans *t, const uint8_t *data, int len){
+    SpiCap *cap = (SpiCap *)t->priv;
+    uint64_t start = _NowNs(CLOCK_MONOTONIC);
+    int ret = SpiTrans_UartWrite(&cap->inner, data, len);
+    _Rec(cap, SPI_CAP_UART_TX, start, data, ret > 0 ? (uint32_t)ret : 0, ret);
+    return ret;
+}
+
+static int _CapUartRead(SpiTrans *t, uint8_t *buf, int len, int timeout, uint32_t spin_us){
+    SpiCap *cap = (SpiCap *)t->priv;
+    uint64_t start = _NowNs(CLOCK_MONOTONIC);
+    int ret = SpiTrans_UartRead(&cap->inner, buf, len, timeout, spin_us);
+    _Rec(cap, SPI_CAP_UART_RX, start, buf, ret > 0 ? (uint32_t)ret : 0, timeout);
+    return ret;
+}
+
+/* 写和读在内层合成一次，抓包里照样记成一条写和一条读 */
+static int _CapUartXfer(SpiTrans *t, const uint8_t *tx, int tx_len, uint8_t *rx, int rx_len, int timeout, uint32_t spin_us){
+    SpiCap *cap = (SpiCap *)t->priv;
+    uint64_t start = _NowNs(CLOCK_MONOTONIC);
+    uint8_t tx_copy[16];
+    int ret;
+
+    /* 握手常用同一个字节收发，读回来之前先留一份写的内容 */
+    if(tx_len > (int)sizeof(tx_copy)){
+        ret = SpiTrans_UartWrite(&cap->inner, tx, tx_len);
+        _Rec(cap, SPI_CAP_UART_TX, start, tx, ret > 0 ? (uint32_t)ret : 0, ret);
+        if(ret != tx_len) return -1;
+        return _CapUartRead(t, rx, rx_len, timeout, spin_us);
+    }
+    memcpy(tx_copy, tx, (size_t)tx_len);
+    ret = SpiTrans_UartXfer(&cap->inner, tx, tx_len, rx, rx_len, timeout, spin_us);
+    /* 出错时不知道写出去没有，按没写记 */
+    _Rec(cap, SPI_CAP_UART_TX, start, tx_copy, ret >= 0 ? (uint32_t)tx_len : 0, ret >= 0 ? tx_len : ret);
+    _Rec(cap, SPI_CAP_UART_RX, start, rx, ret > 0 ? (uint32_t)ret : 0, timeout);
+    return ret;
+}
+
+static void _CapUartInClean(SpiTrans *t){
+    SpiCap *cap = (SpiCap *)t->priv;
+    uint64_t start = _NowNs(CLOCK_MONOTONIC);
+    SpiTrans_UartInClean(&cap->inner);
+    _Rec(cap, SPI_CAP_UART_CLEAN, start, NULL, 0, 0);
+}
+
+/* 只是等待，没有收发，不记录 */
+static int _CapUartWait(SpiTrans *t, int timeout){
+    SpiCap *cap = (SpiCap *)t->priv;
+    return SpiTrans_UartWait(&cap->inner, timeout);
+}
+
+static void _CapClose(SpiTrans *t){
+    SpiCap *cap = (SpiCap *)t->priv;
+    SpiTrans_Close(&cap->inner);
+    fclose(cap->fp);
+    pthread_mutex_destroy(&cap->mutex);
+    free(cap);
+    t->priv = NULL;
+}
+
+static const SpiTransOps cap_ops = {
+    .xfer = _CapXfer,
+    .uart_write = _CapUartWrite,
+    .uart_read = _CapUartRead,
+    .uart_xfer = _CapUartXfer,
+    .uart_in_clean = _CapUartInClean,
+    .uart_wait = _CapUartWait,
+    .close = _CapClose,
+};
+
+/**
+ * @brief 给已经打开的传输套上抓包，之后通过 t 的所有收发都记录到文件，关闭 t 时关闭文件
+ *        名字和fd不变，锁和其他进程的互斥不受影响
+ * @param  t                已经打开的传输
+ * @param  path             抓包文件，已存在时覆盖
+ * @return int              成功0 失败负数，失败时 t 不变
+ */
+int SpiCap_Wrap(SpiTrans *t, const char *path){
+    SpiCapFileHdr hdr;
+    SpiCap *cap;
+
+    cap = (SpiCap *)calloc(1, sizeof(SpiCap));
+    if(cap == NULL) return -1;
+    cap->fp = fopen(path, "wbe");
+    if(cap->fp == NULL){
+        free(cap);
+        return -1;
+    }
+    setvbuf(cap->fp, NULL, _IOFBF, SPI_CAP_FILE_BUF);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SPI_CAP_MAGIC;
+    hdr.version = SPI_CAP_VERSION;
+    hdr.rec_size = sizeof(SpiCapRec);
+    hdr.start_real_ns = _NowNs(CLOCK_REALTIME);
+    hdr.max_msg = t->max_msg;
+    memcpy(hdr.name, t->name, sizeof(hdr.name));
+    fwrite(&hdr, sizeof(hdr), 1, cap->fp);
+    pthread_mutex_init(&cap->mutex, NULL);
+    cap->start_ns = _NowNs(CLOCK_MONOTONIC);
+    cap->flush_ns = cap->start_ns;
+    cap->inner = *t;
+    t->ops = &cap_ops;
+    t->priv = cap;
+    return 0;
+}
@@ -0,0 +1,93 @@
+/**
+ * @file spi_frame.c
+ * @brief MPU与MCU寄存器读写协议的帧构建与解析, 只填充一帧实际用到的字节
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ * 
+ * @par 修改日志:
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "crc_check.h"
+#include "memctrl.h"
+#include "spi_frame.h"
+
+/**
+ * @brief 填充命令帧, 命令头之后到 SPI_CMD_LEN 的部分填0xff
+ * @param  cmd_buf          命令缓冲区
+ * @param  cmd              SPI_CMD_XXX
+ * @param  reg_addr         寄存器地址
+ * @param  reg_cnt          寄存器数量
+ * @return uint16_t         命令部分的crc, 作为数据段crc的初值
+ */
+uint16_t SpiFrame_BuildCmd(uint8_t cmd_buf[SPI_CMD_LEN], uint8_t cmd, uint16_t reg_addr, uint16_t reg_cnt){
+    SET_MEM_VAL_TYPE_SYSTEM_TO_BIG(cmd_buf + CMD_1BYTE_OFFSET, cmd, uint8_t);
+    SET_MEM_VAL_TYPE_SYSTEM_TO_BIG(cmd_buf + CMD_WR_ADDR_2BYTE_OFFSET, reg_addr, uint16_t);
+    SET_MEM_VAL_TYPE_SYSTEM_TO_BIG(cmd_buf + CMD_WR_LEN_2BYTE_OFFSET, reg_cnt, uint16_t);
+    memset(cmd_buf + CMD_WR_CMD_LEN, 0xff, SPI_CMD_LEN - CMD_WR_CMD_LEN);
+    return crc16(0xffff, cmd_buf, CMD_WR_CMD_LEN);
+}
+
+/**
+ * @brief 填充数据段尾部 CRC + 8字节对齐的填充
+ * @param  tail_buf         尾部缓冲区
+ * @param  tail_len         尾部长度 SpiFrame_DataLength(reg_cnt) - reg_cnt
+ * @param  crc16_val        写操作时要发送的crc, 读操作传NULL尾部全部填0xff
+ */
+void SpiFrame_BuildTail(uint8_t *tail_buf, size_t tail_len, const uint16_t *crc16_val){
+    size_t fill_offset = 0;
+    if(crc16_val){
+        SET_MEM_VAL_TYPE_SYSTEM_TO_BIG(tail_buf, *crc16_val, uint16_t);
+        fill_offset = WR_CRC_LEN;
+    }
+    memset(tail_buf + fill_offset, 0xff, tail_len - fill_offset);
+}
+
+/**
+ * @brief 解析命令帧
+ */
+void SpiFrame_ParseCmd(const uint8_t cmd_buf[SPI_CMD_LEN], uint8_t *cmd, uint16_t *reg_addr, uint16_t *reg_cnt){
+    *cmd = cmd_buf[CMD_1BYTE_OFFSET];
+    SET_MEM_VAL_TYPE_BIG_TO_SYSTEM(reg_addr, GET_MEM_VAL(cmd_buf + CMD_WR_ADDR_2BYTE_OFFSET, uint16_t), uint16_t);
+    SET_MEM_VAL_TYPE_BIG_TO_SYSTEM(reg_cnt, GET_MEM_VAL(cmd_buf + CMD_WR_LEN_2BYTE_OFFSET, uint16_t), uint16_t);
+}
+
+/**
+ * @brief 取出数据段尾部的crc
+ */
+uint16_t SpiFrame_GetTailCrc(const uint8_t *tail_buf){
+    uint16_t crc16_val;
+    SET_MEM_VAL_TYPE_BIG_TO_SYSTEM(&crc16_val, GET_MEM_VAL(tail_buf, uint16_t), uint16_t);
+    return crc16_val;
+}
+
+/**
+ * @brief 填充最后ACK后面的状态，见 SPI_STATUS_MARK
+ */
+void SpiFrame_BuildStatus(uint8_t status[SPI_STATUS_LEN], uint32_t rx_used, uint32_t tx_free){
+    if(rx_used > SPI_STATUS_MAX) rx_used = SPI_STATUS_MAX;
+    if(tx_free > SPI_STATUS_MAX) tx_free = SPI_STATUS_MAX;
+    status[0] = (uint8_t)(SPI_STATUS_MARK | (rx_used & 0x7F));
+    status[1] = (uint8_t)(SPI_STATUS_MARK | (rx_used >> 7));
+    status[2] = (uint8_t)(SPI_STATUS_MARK | (tx_free & 0x7F));
+    status[3] = (uint8_t)(SPI_STATUS_MARK | (tx_free >> 7));
+}
+
+/**
+ * @brief 解析最后ACK后面的状态
+ * @return int              成功0 有字节最高位不是1(不是状态)返回-1
+ */
+int SpiFrame_ParseStatus(const uint8_t status[SPI_STATUS_LEN], uint16_t *rx_used, uint16_t *tx_free){
+    int i;
+    for(i = 0; i < SPI_STATUS_LEN; i++){
+        if(!(status[i] & SPI_STATUS_MARK)) return -1;
+    }
+    *rx_used = (uint16_t)((status[0] & 0x7F) | (status[1] & 0x7F) << 7);
+    *tx_free = (uint16_t)((status[2] & 0x7F) | (status[3] & 0x7F) << 7);
+    return 0;
+}
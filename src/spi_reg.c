@@ -18,16 +18,18 @@
 #include <libgen.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <sys/ioctl.h>
 #include <linux/spi/spidev.h>
 #include <sys/file.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "crc_check.h"
 #include "memctrl.h"
+#include "spi_frame.h"
 #include "spi_reg.h"
+#include "spi_cap.h"
 #include "debug.h"
-#include "pp_uart.h"
+#include "spi_trans.h"
 
 
 
@@ -35,267 +37,1688 @@
 #define SPI_START_TIMEOUT_MS            55
 
 
-#define SPI_CMD_READ_REG                (0x03)
-#define SPI_CMD_WRITE_REG               (0x06)
-#define SPI_ACK                         'A'
-#define SPI_NACK                        'N'
-#define SPI_CMD_START                   'S'
-#define SPI_DATA_START                  'D'
+/* V2协议命令与数据之间默认的间隔，给MCU准备数据的时间 */
+#define V2_CMD_DATA_GAP_US                  20
 
-/* 可用的总命令长度，没算'S' */
-#define SPI_CMD_LEN                         8
+/* 定时等待剩余时间小于这个值就忙等，nanosleep 通常要多睡几十微秒 */
+#define ACKLESS_SPIN_NS                     200000
+/* 校准无ACK模式时每次读的长度 */
+#define ACKLESS_PROBE_LEN                   8
+/* 等通知时一次从串口收走的字节数 */
+#define NOTIFY_DRAIN_LEN                    16
 
-/* 这里的命令偏移没计算 启动字节 START */
-#define CMD_1BYTE_OFFSET                    0
-#define CMD_WR_ADDR_2BYTE_OFFSET            1
-#define CMD_WR_LEN_2BYTE_OFFSET             3
-#define CMD_WR_CMD_LEN                      5
 
-#define WR_ACK_1BYTE_OFFSET                 0
-/* 这里的数据偏移没计算ACK字节 */
-#define WR_ACK_DATA_XBYTE_OFFSET            0
-#define WR_ACK_LEN                          1 
-#define WR_CRC_LEN                          2 
-#define WR_DATA_ALIGN_BYTE                  8  /* 传输数据时向8字节取整 */
 
 
-#define UART_SPEED                      115200
+static uint64_t _NowNs(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
 
+/* 阶段结束，记录从 *t 到现在的时间，*t 更新为现在作为下一阶段的开始 */
+static void _LatMark(SpiRegHandle *h, int op, SpiRegStage stage, uint64_t *t){
+    uint64_t now;
+    if(!h->lat_enabled) return;
+    now = _NowNs();
+    LatHist_Record(&h->lat[op][stage], now - *t);
+    *t = now;
+}
 
+static uint64_t _LatStart(SpiRegHandle *h){
+    return h->lat_enabled ? _NowNs() : 0;
+}
 
-static int _TransferSpi(SpiRegHandle *h, size_t length)
+static int _TransferSpi(SpiRegHandle *h, uint8_t *tx_buf, uint8_t *rx_buf, size_t length)
 {
     int ret;
 	struct spi_ioc_transfer transfer = {0};
-	transfer.rx_buf = (unsigned long)h->rx_buf;
-	transfer.tx_buf = (unsigned long)h->tx_buf;
+	transfer.rx_buf = (unsigned long)rx_buf;
+	transfer.tx_buf = (unsigned long)tx_buf;
 	transfer.len = length;
+    transfer.speed_hz = h->speed;
 
-    ret = ioctl(h->fd, SPI_IOC_MESSAGE(1), &transfer);
+    ret = SpiTrans_Xfer(&h->trans, &transfer, 1);
 	return ret;
 }
 
-static int _GotoStartCmd(SpiRegHandle *h, uint32_t timeout){
-    uint8_t ch = SPI_CMD_START;
+/**
+ * @brief 传输数据段, 数据直接从调用者的缓冲区发出或收进调用者的缓冲区，尾部(CRC+填充)使用句柄内的小缓冲区
+ *        所有分段放在同一个SPI消息中，片选不会断开，MCU看到的仍是一帧连续的数据
+ *        V2协议时命令也放在这个消息的最前面
+ * @param  h                句柄
+ * @param  with_cmd         是否带上命令(V2协议)
+ * @param  segs             数据分段
+ * @param  seg_cnt          分段数量
+ * @param  tail_length      尾部长度 CRC+填充
+ * @return int 
+ */
+static int _TransferFrame(SpiRegHandle *h, int with_cmd, const SpiRegSeg *segs, int seg_cnt, size_t tail_length)
+{
+	struct spi_ioc_transfer transfer[SPIREG_MAX_SEGS + 2] = {0};
+    int i, n = 0;
+
+    if(with_cmd){
+        transfer[n].rx_buf = (unsigned long)h->cmd_rx_buf;
+        transfer[n].tx_buf = (unsigned long)h->cmd_tx_buf;
+        transfer[n].len = SPI_CMD_LEN;
+        transfer[n].delay_usecs = h->v2_gap_us;
+        n++;
+    }
+    for(i = 0; i < seg_cnt; i++){
+        if(segs[i].len == 0) continue;
+        transfer[n].rx_buf = (unsigned long)segs[i].rx;
+        transfer[n].tx_buf = (unsigned long)segs[i].tx;
+        transfer[n].len = segs[i].len;
+        n++;
+    }
+    transfer[n].rx_buf = (unsigned long)h->tail_rx_buf;
+    transfer[n].tx_buf = (unsigned long)h->tail_tx_buf;
+    transfer[n].len = tail_length;
+    n++;
+
+    /* 每段都带上当前时钟，自适应调整时不用再改设备的默认速度 */
+    for(i = 0; i < n; i++)
+        transfer[i].speed_hz = h->speed;
+    return SpiTrans_Xfer(&h->trans, transfer, n);
+}
+
+/* 状态按微秒打时间戳，32位够用，比较时按差值算不怕回绕 */
+static uint32_t _NowUs(void){
+    return (uint32_t)(_NowNs() / 1000ULL);
+}
+
+/**
+ * @brief 收到的两个字节不是要等的ACK时调用，错开一个字节再找
+ * @return int              ack 中还留着的字节数
+ */
+static int _AckResync(SpiRegHandle *h, uint8_t *ack){
+    /* MCU在两帧之间发的通知，先记下来 */
+    if(ack[0] == SPI_NOTIFY) __atomic_store_n(&h->notify_pending, 1, __ATOMIC_RELEASE);
+    /* 之前的ACK可能只剩半个，错开一个字节再找 */
+    ack[0] = ack[1];
+    return 1;
+}
+
+/**
+ * @brief 收带序号的ACK，序号对不上的字节是之前超时的帧留下的，在用户态跳过，不用清空串口
+ * @param  hs               不为NULL时先发出这个握手再收，传输层可以把写和读合成一次
+ * @param  status           不为NULL时ACK后面还有 SPI_STATUS_LEN 字节状态，一起收进来
+ * @return int              ACK返回0 NACK返回-1 超时-2
+ */
+static int _WaitTagAck(SpiRegHandle *h, const uint8_t *hs, int hs_len, uint8_t tag, uint8_t *status, uint32_t timeout){
+    uint64_t deadline = _NowNs() + (uint64_t)timeout * 1000000ULL, now;
+    uint8_t ack[SPI_TAG_ACK_LEN + SPI_STATUS_LEN];
+    int n = 0, len = SPI_TAG_ACK_LEN, ret;
+
+    while(1){
+        now = _NowNs();
+        if(now >= deadline) return -2;
+        if(hs != NULL){
+            ret = SpiTrans_UartXfer(&h->trans, hs, hs_len, ack + n, len - n, 
+                (int)((deadline - now + 999999ULL) / 1000000ULL), h->ack_spin_us);
+            hs = NULL;
+        }else{
+            ret = SpiTrans_UartRead(&h->trans, ack + n, (size_t)(len - n), 
+                (int)((deadline - now + 999999ULL) / 1000000ULL), h->ack_spin_us);
+        }
+        if(ret <= 0) return -2;
+        n += ret;
+        if(n < len) continue;
+        if(len > SPI_TAG_ACK_LEN){
+            memcpy(status, ack + SPI_TAG_ACK_LEN, SPI_STATUS_LEN);
+            return ack[0] == SPI_ACK ? 0 : -1;
+        }
+        if((ack[0] == SPI_ACK || ack[0] == SPI_NACK) && ack[1] == tag){
+            /* NACK后面也有状态，收完免得留在串口里 */
+            if(status == NULL) return ack[0] == SPI_ACK ? 0 : -1;
+            len += SPI_STATUS_LEN;
+            continue;
+        }
+        n = _AckResync(h, ack);
+    }
+}
+
+/* 记下最后ACK带回的状态，读的一方不加锁，格式不对的丢掉 */
+static void _StatusSave(SpiRegHandle *h, const uint8_t *status){
+    uint16_t rx_used, tx_free;
+    uint64_t w;
+    if(SpiFrame_ParseStatus(status, &rx_used, &tx_free) < 0) return;
+    w = (uint64_t)rx_used | (uint64_t)tx_free << 16 | (uint64_t)_NowUs() << 32;
+    /* 时间戳恰好是0时也要和无效区分开 */
+    if(w == 0) w = 1ULL << 32;
+    __atomic_store_n(&h->status_word, w, __ATOMIC_RELEASE);
+}
+
+/* 取下一个序号，跳过和控制字节相同的值 */
+static uint8_t _NextTag(SpiRegHandle *h){
+    uint8_t tag;
+    do{
+        tag = h->pipe_seq++ & SPI_TAG_MASK;
+    }while(SPI_TAG_IS_CTRL(tag));
+    return tag;
+}
+
+static int _GotoStartCmd(SpiRegHandle *h, uint8_t start_ch, uint32_t timeout){
+    uint8_t ch = start_ch;
+    uint8_t hs[2];
     int ret;
-    uart_InClean(h->uart_fd);
-    ret = uart_Write(h->uart_fd, &ch, 1);
-    if(ret != 1) return -1;
-    ret = uart_Read(h->uart_fd, &ch, 1, (int)timeout);
+    if(h->tag_ack){
+        /* 握手带上序号，这一帧的ACK都带这个序号 */
+        hs[0] = start_ch == SPI_CMD_PIPE_START ? SPI_CMD_TAG_PIPE_START : SPI_CMD_TAG_START;
+        hs[1] = h->ack_tag = _NextTag(h);
+        /* 流水线的ACK是按帧收的，不带状态 */
+        if(h->status_fresh_us && start_ch == SPI_CMD_START) hs[1] |= SPI_TAG_STATUS;
+        return _WaitTagAck(h, hs, sizeof(hs), h->ack_tag, NULL, timeout);
+    }
+    SpiTrans_UartInClean(&h->trans);
+    ret = SpiTrans_UartXfer(&h->trans, &ch, 1, &ch, 1, (int)timeout, h->ack_spin_us);
     //if(ret <= 0 || ch != SPI_ACK) return -1;
     if(ret <= 0) return -1;
     if(ch != SPI_ACK) {
         //dbg_debugfl("ret = %d ch = 0x%02x %c",ret ,ch ,ch);
         return -1;
     }
-    uart_InClean(h->uart_fd);
+    SpiTrans_UartInClean(&h->trans);
+    return 0;
+}
+
+/* 等到 deadline, 先睡眠，最后一小段忙等 */
+static void _WaitUntil(uint64_t deadline){
+    struct timespec ts;
+    uint64_t now = _NowNs();
+    if(deadline > now + ACKLESS_SPIN_NS){
+        now = deadline - now - ACKLESS_SPIN_NS;
+        ts.tv_sec = (time_t)(now / 1000000000ULL);
+        ts.tv_nsec = (long)(now % 1000000000ULL);
+        nanosleep(&ts, NULL);
+    }
+    while(_NowNs() < deadline);
+}
+
+/* 无ACK握手: 发'Q'后等够校准出的时间，MCU这时已经准备好收这一帧 */
+static int _QuietStart(SpiRegHandle *h){
+    uint8_t ch = SPI_CMD_QUIET_START;
+    if(SpiTrans_UartWrite(&h->trans, &ch, 1) != 1) return -1;
+    _WaitUntil(_NowNs() + h->ackless.arm_ns);
     return 0;
 }
 
 static int _WaitAck(SpiRegHandle *h, uint32_t timeout){
     uint8_t ch = 0x00;
     int ret;
-    ret = uart_Read(h->uart_fd, &ch, 1, (int)timeout);
+    if(h->tag_ack) return _WaitTagAck(h, NULL, 0, h->ack_tag, NULL, timeout);
+    ret = SpiTrans_UartRead(&h->trans, &ch, 1, (int)timeout, h->ack_spin_us);
     if(ret != 1 || ch != SPI_ACK) return -1;
-    uart_InClean(h->uart_fd);
+    SpiTrans_UartInClean(&h->trans);
+    return 0;
+}
+
+/* 流水线出错，所有未确认的帧都算超时，下一帧重新握手 */
+static void _PipeAbort(SpiRegHandle *h){
+    SpiRegPend *pend;
+    while(h->pend_cnt){
+        pend = &h->pend[h->pend_head];
+        if(*pend->ret == 0) *pend->ret = -2;
+        h->pend_head = (h->pend_head + 1) % SPIREG_PIPE_MAX_DEPTH;
+        h->pend_cnt--;
+    }
+    h->pipe_open = 0;
+}
+
+static int _PipeIsPending(SpiRegHandle *h, uint8_t tag){
+    int i;
+    for(i = 0; i < h->pend_cnt; i++){
+        if(h->pend[(h->pend_head + i) % SPIREG_PIPE_MAX_DEPTH].tag == tag)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 收最早那一帧的带序号ACK, MCU按顺序处理，所以ACK也按顺序回来
+ *        不认识的序号是之前超时留下的，和 _WaitTagAck 一样错开一个字节跳过，中间的通知也记下来
+ */
+static int _PipeCollect(SpiRegHandle *h, uint32_t timeout){
+#define PIPE_MAX_STALE_ACK      16
+    uint8_t ack[SPI_TAG_ACK_LEN];
+    SpiRegPend *pend = &h->pend[h->pend_head];
+    uint64_t t = _LatStart(h);
+    int ret, n = 0, stale = 0;
+
+    while(1){
+        ret = SpiTrans_UartRead(&h->trans, ack + n, (size_t)(SPI_TAG_ACK_LEN - n), (int)timeout, h->ack_spin_us);
+        if(ret <= 0) break;
+        n += ret;
+        if(n < SPI_TAG_ACK_LEN) continue;
+        if(ack[0] == SPI_ACK || ack[0] == SPI_NACK){
+            if(ack[1] == pend->tag){
+                _LatMark(h, pend->op, SPIREG_STAGE_ACK, &t);
+                if(ack[0] != SPI_ACK && *pend->ret == 0) *pend->ret = -2;
+                h->pend_head = (h->pend_head + 1) % SPIREG_PIPE_MAX_DEPTH;
+                h->pend_cnt--;
+                return 0;
+            }
+            /* 后面帧的ACK先到了，说明前面的帧丢了 */
+            if(_PipeIsPending(h, ack[1])) break;
+        }
+        /* 一直对不上就当这段流水线出错，不无限等下去 */
+        if(++stale > PIPE_MAX_STALE_ACK * SPI_TAG_ACK_LEN) break;
+        n = _AckResync(h, ack);
+    }
+    _PipeAbort(h);
+    return -2;
+}
+
+/* 收完所有未确认帧的ACK，结束这一段流水线 */
+static int _PipeFlush(SpiRegHandle *h, uint32_t timeout){
+    int ret;
+    while(h->pend_cnt){
+        ret = _PipeCollect(h, timeout);
+        if(ret < 0) return ret;
+    }
+    h->pipe_open = 0;
+    return 0;
+}
+
+/**
+ * @brief 命令和数据都已构建好后，完成一帧的握手、传输和ACK
+ *        流水线模式下不等本帧的ACK，而是在未确认帧达到深度时才收最早一帧的ACK, 结果之后写到 *ack_ret
+ * @param  ack_ret          流水线模式下本帧ACK的结果, 其他模式不使用
+ * @return int              成功0 失败负数 -2是超时
+ */
+static int _Exchange(SpiRegHandle *h, const SpiRegSeg *segs, int seg_cnt, size_t tail_length, 
+    uint32_t timeout, int *ack_ret){
+    int ret, op = h->lat_op;
+    uint64_t t = _LatStart(h), cal;
+    uint8_t status[SPI_STATUS_LEN];
+    SpiRegPend *pend;
+    uint8_t tag;
+
+    /* 这一帧可能改变环形缓冲区，之前的状态作废，成功时由最后的ACK更新 */
+    if(h->status_fresh_us) __atomic_store_n(&h->status_word, 0, __ATOMIC_RELEASE);
+
+    if(h->pipe_depth > 1){
+        if(!h->pipe_open){
+            ret = _GotoStartCmd(h, SPI_CMD_PIPE_START, timeout);
+            if(ret < 0) return -2;
+            _LatMark(h, op, SPIREG_STAGE_START, &t);
+            h->pipe_open = 1;
+        }
+        if(h->pend_cnt >= h->pipe_depth){
+            ret = _PipeCollect(h, timeout);
+            if(ret < 0) return ret;
+            t = _LatStart(h);
+        }
+        tag = _NextTag(h);
+        h->cmd_tx_buf[CMD_SEQ_1BYTE_OFFSET] = tag;
+        /* 命令和数据一次传完，ACK留到后面收 */
+        ret = _TransferFrame(h, 1, segs, seg_cnt, tail_length);
+        if(ret < 0){
+            _PipeAbort(h);
+            return ret;
+        }
+        _LatMark(h, op, SPIREG_STAGE_DATA, &t);
+        pend = &h->pend[(h->pend_head + h->pend_cnt) % SPIREG_PIPE_MAX_DEPTH];
+        pend->tag = tag;
+        pend->op = (uint8_t)op;
+        pend->ret = ack_ret;
+        h->pend_cnt++;
+        return 0;
+    }
+
+    if(h->ackless.quiet){
+        /* 没有ACK，CRC由调用者校验 */
+        ret = _QuietStart(h);
+        if(ret < 0) return ret;
+        _LatMark(h, op, SPIREG_STAGE_START, &t);
+        ret = _TransferFrame(h, 1, segs, seg_cnt, tail_length);
+        if(ret < 0) return ret;
+        _LatMark(h, op, SPIREG_STAGE_DATA, &t);
+        return 0;
+    }
+
+    cal = h->ackless.calibrating ? _NowNs() : 0;
+    ret = _GotoStartCmd(h, SPI_CMD_START, timeout);
+    if(ret < 0) return -2;
+    if(cal){
+        cal = _NowNs() - cal;
+        if(cal > h->ackless.hs_max_ns) h->ackless.hs_max_ns = cal;
+    }
+    _LatMark(h, op, SPIREG_STAGE_START, &t);
+    if(h->proto == SPIREG_PROTO_V2){
+        /* 命令和数据一次传完，只等最后一个ACK */
+        ret = _TransferFrame(h, 1, segs, seg_cnt, tail_length);
+        if(ret < 0) return ret;
+    }else{
+        ret = _TransferSpi(h, h->cmd_tx_buf, h->cmd_rx_buf, SPI_CMD_LEN);
+        if(ret < 0) return ret;
+        _LatMark(h, op, SPIREG_STAGE_CMD, &t);
+        ret = _WaitAck(h, timeout);
+        if(ret < 0) return -2;
+        _LatMark(h, op, SPIREG_STAGE_CMD_ACK, &t);
+        ret = _TransferFrame(h, 0, segs, seg_cnt, tail_length);
+        if(ret < 0) return ret;
+    }
+    _LatMark(h, op, SPIREG_STAGE_DATA, &t);
+
+    if(h->status_fresh_us){
+        ret = _WaitTagAck(h, NULL, 0, h->ack_tag, status, timeout);
+        if(ret < 0) return -2;
+        _StatusSave(h, status);
+    }else{
+        ret = _WaitAck(h, timeout);
+        if(ret < 0) return -2;
+    }
+    _LatMark(h, op, SPIREG_STAGE_ACK, &t);
+    return 0;
+}
+
+/**
+ * @brief 加锁, 同进程的线程和其他进程都互斥
+ *        SPIREG_LOCK_FLOCK: 进程内互斥锁 + flock
+ *        SPIREG_LOCK_SHM: 共享内存排队锁, 线程和进程一起排队，不竞争时不进内核
+ */
+static int _Lock(SpiRegHandle *h){
+    int ret;
+    uint64_t t = h->stats ? _NowNs() : 0;
+    if(h->lock_mode == SPIREG_LOCK_SHM){
+        ret = ShmTLock_Lock(&h->tlock);
+    }else{
+        pthread_mutex_lock(&h->mutex);
+        ret = flock(h->lock_fd, LOCK_EX);
+        if(ret < 0){
+            pthread_mutex_unlock(&h->mutex);
+            return ret;
+        }
+    }
+    if(h->stats && ret == 0) RvmStats_LockWait(h->stats, _NowNs() - t);
+    return ret;
+}
+
+static void _Unlock(SpiRegHandle *h){
+    if(h->lock_mode == SPIREG_LOCK_SHM){
+        ShmTLock_Unlock(&h->tlock);
+        return;
+    }
+    flock(h->lock_fd, LOCK_UN);
+    pthread_mutex_unlock(&h->mutex);
+}
+
+/* 分段的总长度 */
+static uint32_t _SegsLength(const SpiRegSeg *segs, int seg_cnt){
+    uint32_t total = 0;
+    int i;
+    for(i = 0; i < seg_cnt; i++)
+        total += segs[i].len;
+    return total;
+}
+
+/* 自适应时钟可选的档位 */
+static const uint32_t adapt_speed_tab[] = {
+    1000000, 2000000, 4000000, 5000000, 6000000, 8000000, 10000000,
+    12000000, 15000000, 18000000, 20000000, 25000000, 30000000,
+};
+#define ADAPT_SPEED_CNT     (int)(sizeof(adapt_speed_tab)/sizeof(adapt_speed_tab[0]))
+
+/* 在 [min_hz, max_hz] 中找比当前速度高一档(dir>0)或低一档(dir<0)的速度，没有返回0 */
+static uint32_t _AdaptNextSpeed(SpiRegHandle *h, int dir){
+    int i;
+    if(dir > 0){
+        for(i = 0; i < ADAPT_SPEED_CNT; i++)
+            if(adapt_speed_tab[i] > h->speed && adapt_speed_tab[i] <= h->adapt.max_hz)
+                return adapt_speed_tab[i];
+    }else{
+        for(i = ADAPT_SPEED_CNT - 1; i >= 0; i--)
+            if(adapt_speed_tab[i] < h->speed && adapt_speed_tab[i] >= h->adapt.min_hz)
+                return adapt_speed_tab[i];
+    }
+    return 0;
+}
+
+static void _AdaptSave(SpiRegHandle *h){
+    FILE *fp;
+    if(h->adapt.path[0] == '\0') return;
+    fp = fopen(h->adapt.path, "w");
+    if(fp == NULL) return;
+    fprintf(fp, "%u\n", h->speed);
+    fclose(fp);
+}
+
+static void _AdaptChange(SpiRegHandle *h, uint32_t speed){
+    dbg_infofl("spi speed %u -> %u", h->speed, speed);
+    h->speed = speed;
+    h->adapt.win_frames = 0;
+    h->adapt.win_errs = 0;
+    h->adapt.clean_wins = 0;
+    _AdaptSave(h);
+}
+
+/**
+ * @brief 记录一帧的结果，按窗口统计CRC错误和超时
+ *        窗口内错误达到 SPIREG_ADAPT_ERR_DOWN 立即降一档，并记住出错的速度；
+ *        连续 SPIREG_ADAPT_UP_WINDOWS 个窗口没有错误升一档，要升回出过错的速度需要多等几倍
+ * @return int              原样返回 ret，方便在返回处调用
+ */
+static int _AdaptRecord(SpiRegHandle *h, int ret){
+    SpiRegAdapt *ad = &h->adapt;
+    uint32_t next, need;
+
+    if(ret == -3) ad->crc_errs++;
+    else if(ret == -2) ad->timeouts++;
+    if(!ad->enabled) return ret;
+
+    ad->win_frames++;
+    if(ret == -2 || ret == -3){
+        ad->win_errs++;
+        if(ad->win_errs >= SPIREG_ADAPT_ERR_DOWN){
+            next = _AdaptNextSpeed(h, -1);
+            ad->fail_hz = h->speed;
+            if(next) _AdaptChange(h, next);
+            else ad->win_frames = ad->win_errs = 0;
+        }
+        return ret;
+    }
+    if(ad->win_frames < SPIREG_ADAPT_WINDOW) return ret;
+
+    if(ad->win_errs == 0) ad->clean_wins++;
+    else ad->clean_wins = 0;
+    ad->win_frames = ad->win_errs = 0;
+    next = _AdaptNextSpeed(h, 1);
+    need = SPIREG_ADAPT_UP_WINDOWS;
+    if(ad->fail_hz && next >= ad->fail_hz) need *= SPIREG_ADAPT_FAIL_HOLD;
+    if(next && ad->clean_wins >= need)
+        _AdaptChange(h, next);
+    return ret;
+}
+
+/* 一帧结束，记到统计页并交给自适应时钟 */
+static int _FrameEnd(SpiRegHandle *h, int op, uint32_t reg_cnt, int ret){
+    if(h->stats) RvmStats_Frame(h->stats, op == SPIREG_OP_WRITE, reg_cnt, ret);
+    return _AdaptRecord(h, ret);
+}
+
+/**
+ * @brief 已经持有锁时读寄存器，数据直接收到各个分段的 rx 中
+ * @param  ack_ret          流水线模式下ACK的结果延后写到这里，传NULL则本帧同步完成
+ * @return int 成功0 失败负数 -2是超时 -3是crc错误, 失败时分段中的数据不确定
+ */
+static int _ReadLocked(SpiRegHandle *h, uint16_t reg_addr, SpiRegSeg *segs, int seg_cnt, uint32_t timeout, int *ack_ret){
+    int ret, i;
+    int sync_ack_ret = 0;
+    uint16_t crc16_val;
+    uint32_t reg_cnt = _SegsLength(segs, seg_cnt);
+    size_t trans_length = SpiFrame_DataLength(reg_cnt);
+    uint64_t t0, t;
+
+    if(trans_length > h->frame_size || seg_cnt > SPIREG_MAX_SEGS) return -1;
+
+    t0 = t = _LatStart(h);
+    h->lat_op = SPIREG_OP_READ;
+    /* 读数据时发送的填充直接使用初始化时就填好0xff的 tx_buf, 只构建命令和尾部 */
+    for(i = 0; i < seg_cnt; i++)
+        segs[i].tx = h->tx_buf;
+    crc16_val = SpiFrame_BuildCmd(h->cmd_tx_buf, h->proto == SPIREG_PROTO_V2 ? SPI_CMD_READ_REG_V2 : SPI_CMD_READ_REG,
+        reg_addr, (uint16_t)reg_cnt);
+    SpiFrame_BuildTail(h->tail_tx_buf, trans_length - reg_cnt, NULL);
+
+    ret = _Exchange(h, segs, seg_cnt, trans_length - reg_cnt, timeout, ack_ret ? ack_ret : &sync_ack_ret);
+    /* 无ACK帧失败时由调用者马上用ACK模式重读，不算链路错误 */
+    if(ret < 0) return h->ackless.quiet ? ret : _FrameEnd(h, SPIREG_OP_READ, reg_cnt, ret);
+    
+    /* 数据在传输完成时就已经收到，流水线模式下也可以马上校验 */
+    t = _LatStart(h);
+    for(i = 0; i < seg_cnt; i++)
+        crc16_val = crc16(crc16_val, segs[i].rx, segs[i].len);
+    ret = SpiFrame_GetTailCrc(h->tail_rx_buf) != crc16_val ? -3 : 0;
+    _LatMark(h, SPIREG_OP_READ, SPIREG_STAGE_CRC, &t);
+    if(ret < 0 && h->ackless.quiet) return ret;
+
+    if(ack_ret == NULL){
+        if(_PipeFlush(h, timeout) < 0 || sync_ack_ret < 0) return _FrameEnd(h, SPIREG_OP_READ, reg_cnt, -2);
+    }
+    _LatMark(h, SPIREG_OP_READ, SPIREG_STAGE_FRAME, &t0);
+    return _FrameEnd(h, SPIREG_OP_READ, reg_cnt, ret);
+}
+
+/**
+ * @brief 已经持有锁时写寄存器，数据直接从各个分段的 tx 发出
+ * @param  ack_ret          同 _ReadLocked
+ * @return int 成功0 失败负数 -2是超时
+ */
+static int _WriteLocked(SpiRegHandle *h, uint16_t reg_addr, SpiRegSeg *segs, int seg_cnt, uint32_t timeout, int *ack_ret){
+    int ret, i;
+    int sync_ack_ret = 0;
+    uint16_t crc16_val;
+    uint32_t reg_cnt = _SegsLength(segs, seg_cnt);
+    size_t trans_length = SpiFrame_DataLength(reg_cnt);
+    uint64_t t0, t;
+
+    if(trans_length > h->frame_size || seg_cnt > SPIREG_MAX_SEGS) return -1;
+
+    t0 = t = _LatStart(h);
+    h->lat_op = SPIREG_OP_WRITE;
+    for(i = 0; i < seg_cnt; i++)
+        segs[i].rx = h->rx_buf;
+    crc16_val = SpiFrame_BuildCmd(h->cmd_tx_buf, h->proto == SPIREG_PROTO_V2 ? SPI_CMD_WRITE_REG_V2 : SPI_CMD_WRITE_REG,
+        reg_addr, (uint16_t)reg_cnt);
+    for(i = 0; i < seg_cnt; i++)
+        crc16_val = crc16(crc16_val, segs[i].tx, segs[i].len);
+    SpiFrame_BuildTail(h->tail_tx_buf, trans_length - reg_cnt, &crc16_val);
+    _LatMark(h, SPIREG_OP_WRITE, SPIREG_STAGE_CRC, &t);
+
+    ret = _Exchange(h, segs, seg_cnt, trans_length - reg_cnt, timeout, ack_ret ? ack_ret : &sync_ack_ret);
+    if(ret < 0) return _FrameEnd(h, SPIREG_OP_WRITE, reg_cnt, ret);
+
+    if(ack_ret == NULL){
+        if(_PipeFlush(h, timeout) < 0 || sync_ack_ret < 0) return _FrameEnd(h, SPIREG_OP_WRITE, reg_cnt, -2);
+    }
+    _LatMark(h, SPIREG_OP_WRITE, SPIREG_STAGE_FRAME, &t0);
+    return _FrameEnd(h, SPIREG_OP_WRITE, reg_cnt, 0);
+}
+
+/* 一帧能承载的最大寄存器数量 */
+static uint32_t _FrameMaxCnt(SpiRegHandle *h){
+    return (h->frame_size & ~(uint32_t)(WR_DATA_ALIGN_BYTE - 1)) - WR_CRC_LEN;
+}
+
+/* 查寄存器属性, 没有登记的寄存器属性为0 */
+static uint8_t _RegAttr(SpiRegHandle *h, uint16_t reg_addr){
+    int i;
+    for(i = 0; i < h->attr_cnt; i++){
+        if(reg_addr >= h->attr_tab[i].reg_addr && 
+            reg_addr < (uint32_t)h->attr_tab[i].reg_addr + h->attr_tab[i].reg_cnt)
+            return h->attr_tab[i].attr;
+    }
+    return 0;
+}
+
+/* 按地址范围找重试统计，表满后都记到最后一项 */
+static SpiRegRetryStat *_RetryStat(SpiRegHandle *h, uint16_t reg_addr){
+    uint16_t base = reg_addr & (uint16_t)~(SPIREG_RETRY_RANGE - 1);
+    int i;
+    for(i = 0; i < h->retry_stat_cnt; i++){
+        if(h->retry_stat[i].range_base == base)
+            return &h->retry_stat[i];
+    }
+    if(h->retry_stat_cnt >= SPIREG_RETRY_TAB_SIZE - 1)
+        return &h->retry_stat[SPIREG_RETRY_TAB_SIZE - 1];
+    h->retry_stat[h->retry_stat_cnt].range_base = base;
+    return &h->retry_stat[h->retry_stat_cnt++];
+}
+
+/**
+ * @brief 无ACK读一帧，连续 SPIREG_ACKLESS_MAX_FAIL 次失败后关闭无ACK模式
+ * @return int              成功0 失败负数，失败时调用者用ACK模式重读
+ */
+static int _ReadQuietLocked(SpiRegHandle *h, uint16_t reg_addr, SpiRegSeg *segs, int seg_cnt, uint32_t timeout){
+    SpiRegAckless *al = &h->ackless;
+    int ret;
+
+    al->quiet = 1;
+    ret = _ReadLocked(h, reg_addr, segs, seg_cnt, timeout, NULL);
+    al->quiet = 0;
+    al->frames++;
+    if(ret == 0){
+        al->fails = 0;
+        return 0;
+    }
+    al->errs++;
+    if(++al->fails >= SPIREG_ACKLESS_MAX_FAIL){
+        dbg_infofl("ackless read failed %u times, back to ack mode", al->fails);
+        al->enabled = 0;
+        al->fails = 0;
+        al->fallbacks++;
+    }
+    return ret;
+}
+
+/**
+ * @brief 读一帧，打开了无ACK读时先试一次无ACK读，失败再用ACK模式读
+ *        这里不重试，超时或CRC错误由放开锁的调用者按 _Retryable/_RetryWait 退避后重来
+ * @return int              同 _ReadLocked
+ */
+static int _ReadTryLocked(SpiRegHandle *h, uint16_t reg_addr, SpiRegSeg *segs, int seg_cnt, uint32_t timeout, int *ack_ret){
+    /* 读了就取走数据的寄存器不能失败后重读，总是走ACK模式 */
+    if(h->ackless.enabled && h->pipe_depth <= 1 && !(_RegAttr(h, reg_addr) & SPIREG_ATTR_NON_IDEMPOTENT)){
+        if(_ReadQuietLocked(h, reg_addr, segs, seg_cnt, timeout) == 0) return 0;
+    }
+    return _ReadLocked(h, reg_addr, segs, seg_cnt, timeout, ack_ret);
+}
+
+/* 一次读的退避重试状态，跨过放锁和重新加锁 */
+typedef struct _SpiRegRetry{
+    int                     idx;            /* SpiReg_Transact 中在重试的操作，-1为没有 */
+    int                     cnt;            /* idx 这一组合并的操作数量，放弃时跳过这么多 */
+    uint64_t                deadline;
+    uint32_t                backoff_us;
+    uint32_t                left;           /* 重试这一次可以用的时间 */
+    uint8_t                 n;
+}SpiRegRetry;
+
+/* 从 start_ns 开始在 timeout 内重试 */
+static void _RetryInit(SpiRegRetry *rt, uint64_t start_ns, uint32_t timeout){
+    rt->idx = -1;
+    rt->deadline = start_ns + (uint64_t)timeout * 1000000ULL;
+    rt->backoff_us = SPIREG_RETRY_BACKOFF_US;
+    rt->left = timeout;
+    rt->n = 0;
+}
+
+/**
+ * @brief 读的结果能不能重试: 超时或CRC错误，打开了重试，
+ *        并且不是登记了 SPIREG_ATTR_NON_IDEMPOTENT 的寄存器(读了就会从环形缓冲区取走数据)
+ */
+static int _Retryable(SpiRegHandle *h, uint16_t reg_addr, int ret){
+    if(ret != -2 && ret != -3) return 0;
+    return h->retry_max && !(_RegAttr(h, reg_addr) & SPIREG_ATTR_NON_IDEMPOTENT);
+}
+
+/* 记一次重试或放弃，统计表由 fc_mutex 保护，因为退避时不持有总线锁 */
+static void _RetryCount(SpiRegHandle *h, uint16_t reg_addr, int gave_up){
+    SpiRegRetryStat *stat;
+
+    pthread_mutex_lock(&h->fc_mutex);
+    stat = _RetryStat(h, reg_addr);
+    if(gave_up) stat->gave_up++;
+    else stat->retries++;
+    pthread_mutex_unlock(&h->fc_mutex);
+}
+
+/**
+ * @brief 读失败后退避，调用者必须已经放开总线锁，退避期间别的线程和进程照常使用总线
+ *        退避从 SPIREG_RETRY_BACKOFF_US 开始翻倍，最多 SPIREG_RETRY_BACKOFF_MAX_US，最多重试 retry_max 次
+ * @return int              0 重新加锁再读一次，超时用 rt->left -1 放弃
+ */
+static int _RetryWait(SpiRegHandle *h, SpiRegRetry *rt, uint16_t reg_addr){
+    uint64_t now;
+
+    /* 退避之后至少还要剩1ms才值得再试 */
+    if(rt->n >= h->retry_max || _NowNs() + (uint64_t)rt->backoff_us * 1000ULL + 1000000ULL > rt->deadline)
+        goto give_up;
+    usleep(rt->backoff_us);
+    /* usleep 可能睡过头，重新取时间，不然剩余时间会下溢成一个很大的超时 */
+    now = _NowNs();
+    if(now + 1000000ULL >= rt->deadline) goto give_up;
+    rt->n++;
+    rt->backoff_us *= 2;
+    if(rt->backoff_us > SPIREG_RETRY_BACKOFF_MAX_US) rt->backoff_us = SPIREG_RETRY_BACKOFF_MAX_US;
+    rt->left = (uint32_t)((rt->deadline - now) / 1000000ULL);
+    _RetryCount(h, reg_addr, 0);
+    return 0;
+give_up:
+    _RetryCount(h, reg_addr, 1);
+    return -1;
+}
+
+/**
+ * @brief 已经持有锁时读寄存器，超过一帧的数据自动分片后拼回 reg_data
+ *        普通寄存器每片地址递增，SPIREG_ATTR_FIXED_ADDR 寄存器每片都读同一个地址
+ */
+static int _ReadFragLocked(SpiRegHandle *h, uint16_t reg_addr, uint8_t *reg_data, uint16_t reg_cnt, 
+    uint32_t timeout, int *ack_ret){
+    uint32_t max_cnt = _FrameMaxCnt(h);
+    uint8_t attr = _RegAttr(h, reg_addr);
+    uint32_t off = 0;
+    SpiRegSeg seg;
+    int ret;
+
+    if(reg_cnt > max_cnt && (attr & SPIREG_ATTR_NO_FRAG)) return -1;
+    do{
+        seg.rx = reg_data + off;
+        seg.len = (uint16_t)(reg_cnt - off > max_cnt ? max_cnt : reg_cnt - off);
+        ret = _ReadTryLocked(h, (attr & SPIREG_ATTR_FIXED_ADDR) ? reg_addr : (uint16_t)(reg_addr + off), 
+            &seg, 1, timeout, ack_ret);
+        if(ret < 0) return ret;
+        off += seg.len;
+    }while(off < reg_cnt);
     return 0;
 }
 
+/**
+ * @brief 已经持有锁时写寄存器，超过一帧的数据自动分片发送，地址规则同 _ReadFragLocked
+ */
+static int _WriteFragLocked(SpiRegHandle *h, uint16_t reg_addr, const uint8_t *reg_data, uint16_t reg_cnt, 
+    uint32_t timeout, int *ack_ret){
+    uint32_t max_cnt = _FrameMaxCnt(h);
+    uint8_t attr = _RegAttr(h, reg_addr);
+    uint32_t off = 0;
+    SpiRegSeg seg;
+    int ret;
+
+    if(reg_cnt > max_cnt && (attr & SPIREG_ATTR_NO_FRAG)) return -1;
+    do{
+        seg.tx = reg_data + off;
+        seg.len = (uint16_t)(reg_cnt - off > max_cnt ? max_cnt : reg_cnt - off);
+        ret = _WriteLocked(h, (attr & SPIREG_ATTR_FIXED_ADDR) ? reg_addr : (uint16_t)(reg_addr + off), 
+            &seg, 1, timeout, ack_ret);
+        if(ret < 0) return ret;
+        off += seg.len;
+    }while(off < reg_cnt);
+    return 0;
+}
 
 
 /**
- * @brief 读spi寄存器
+ * @brief 借用式读寄存器，成功后 *data 直接指向句柄内已经通过CRC校验的接收缓冲区, 不能超过一帧
+ *        成功时句柄保持加锁状态，用完后必须调用 SpiReg_Release 释放，在此期间不能再调用本句柄的其他接口
  * @param  h                句柄
  * @param  reg_addr         寄存器地址
  * @param  reg_cnt          要读的寄存器数量
- * @param  reg_data         装寄存器数据的指针
+ * @param  data             返回只读数据视图，8字节对齐
+ * @param  timeout          超时时间
+ * @return int              成功0 失败负数(失败时不需要释放) 错误码同 SpiReg_Read
+ */
+int SpiReg_ReadBorrow(SpiRegHandle *h, uint16_t reg_addr, uint16_t reg_cnt, const uint8_t **data, uint32_t timeout){
+    int ret;
+    SpiRegSeg seg = {.rx = NULL, .len = reg_cnt};
+    SpiRegRetry rt;
+
+    if(h == NULL || data == NULL) return -1;
+    _RetryInit(&rt, _NowNs(), timeout);
+    for(;;){
+        ret = _Lock(h);
+        if(ret < 0) return ret;
+        seg.rx = h->rx_buf;
+        ret = _ReadTryLocked(h, reg_addr, &seg, 1, rt.left, NULL);
+        if(ret == 0) break;
+        /* 退避时放开锁 */
+        _Unlock(h);
+        if(!_Retryable(h, reg_addr, ret) || _RetryWait(h, &rt, reg_addr) < 0) return ret;
+    }
+    *data = h->rx_buf;
+    return 0;
+}
+
+/**
+ * @brief 释放 SpiReg_ReadBorrow 借出的缓冲区
+ * @param  h                句柄
+ */
+void SpiReg_Release(SpiRegHandle *h){
+    if(h == NULL) return;
+    _Unlock(h);
+}
+
+/* ops[start]开始能和它合并成一次传输的操作数量 */
+static int _MergeCount(SpiRegHandle *h, const SpiRegOp *ops, int start, int n){
+    int i;
+    uint32_t next_addr = ops[start].reg_addr + ops[start].reg_cnt;
+    uint32_t total = ops[start].reg_cnt;
+
+    if(!(ops[start].flags & SPIREG_OPF_MERGEABLE) || _RegAttr(h, ops[start].reg_addr)) return 1;
+    for(i = start + 1; i < n; i++){
+        if(ops[i].type != ops[start].type || !(ops[i].flags & SPIREG_OPF_MERGEABLE))
+            break;
+        /* 登记过属性(包括 SPIREG_ATTR_NO_MERGE)的是命令型寄存器，不能合并 */
+        if(_RegAttr(h, ops[i].reg_addr))
+            break;
+        if(ops[i].reg_addr != next_addr)
+            break;
+        if(i - start >= SPIREG_MAX_SEGS || 
+            total + ops[i].reg_cnt > _FrameMaxCnt(h))
+            break;
+        total += ops[i].reg_cnt;
+        next_addr += ops[i].reg_cnt;
+    }
+    return i - start;
+}
+
+/**
+ * @brief 已经持有锁时从 ops[start] 开始执行一批操作, 见 SpiReg_Transact
+ *        rt 为NULL时全部做完，可以重试的读失败由各自的调用者放开锁后重新提交；
+ *        rt 不为NULL时在可以重试的读失败处停下，调用者放开锁退避后从停下的地方接着做，
+ *        重做 rt->idx 这一组时超时用 rt->left
+ * @return int              停下的操作下标，全部做完返回 n
+ */
+static int _TransactLocked(SpiRegHandle *h, SpiRegOp *ops, int start, int n, uint32_t tmo, SpiRegRetry *rt){
+    int ret, end = n;
+    int i, j, k, merge_cnt;
+    uint32_t timeout;
+    uint64_t t;
+    SpiRegSeg segs[SPIREG_MAX_SEGS];
+
+    /* 流水线模式下每组的ACK结果延后写到组内第一个操作的 ret 中 */
+    for(i = start; i < n; i += merge_cnt){
+        merge_cnt = _MergeCount(h, ops, i, n);
+        ops[i].ret = 0;
+        t = _NowNs();
+        timeout = rt && rt->idx == i ? rt->left : tmo;
+        if(merge_cnt == 1){
+            /* 单个操作可能超过一帧，走分片流程 */
+            if(ops[i].type == SPIREG_OP_WRITE)
+                ret = _WriteFragLocked(h, ops[i].reg_addr, ops[i].wdata, ops[i].reg_cnt, timeout, &ops[i].ret);
+            else
+                ret = _ReadFragLocked(h, ops[i].reg_addr, ops[i].rdata, ops[i].reg_cnt, timeout, &ops[i].ret);
+        }else{
+            /* 合并的操作各自作为一个分段，数据直接在调用者的缓冲区收发 */
+            for(j = 0; j < merge_cnt; j++){
+                segs[j].len = ops[i+j].reg_cnt;
+                if(ops[i].type == SPIREG_OP_WRITE)
+                    segs[j].tx = ops[i+j].wdata;
+                else
+                    segs[j].rx = ops[i+j].rdata;
+            }
+            if(ops[i].type == SPIREG_OP_WRITE)
+                ret = _WriteLocked(h, ops[i].reg_addr, segs, merge_cnt, timeout, &ops[i].ret);
+            else
+                ret = _ReadTryLocked(h, ops[i].reg_addr, segs, merge_cnt, timeout, &ops[i].ret);
+        }
+        if(ret < 0) ops[i].ret = ret;
+        if(rt && ops[i].type == SPIREG_OP_READ && _Retryable(h, ops[i].reg_addr, ret)){
+            /* 第一次失败时开始计重试的超时 */
+            if(rt->idx != i){
+                _RetryInit(rt, t, tmo);
+                rt->idx = i;
+            }
+            rt->cnt = merge_cnt;
+            end = i + merge_cnt;
+            break;
+        }
+    }
+    _PipeFlush(h, tmo);
+
+    for(j = start; j < end; j += merge_cnt){
+        merge_cnt = _MergeCount(h, ops, j, n);
+        for(k = j + 1; k < j + merge_cnt; k++)
+            ops[k].ret = ops[j].ret;
+    }
+    return i < n ? i : n;
+}
+
+/* 合并执行的请求，在调用者的栈上，完成前不会返回 */
+typedef struct _SpiRegFcReq{
+    SpiRegOp                op;             /* 单个操作，批量操作时 op.ret 是加锁的结果 */
+    SpiRegOp                *ops;           /* 批量操作，NULL为单个操作 */
+    int                     start;          /* 批量操作从这里开始做，做完后是停下的位置 */
+    int                     n;
+    SpiRegRetry             *rt;
+    uint32_t                timeout;
+    int                     done;
+    uint64_t                enq_ns;         /* 入队时间 */
+    struct _SpiRegFcReq     *next;
+}SpiRegFcReq;
+
+/* 只有 BULK 会老化，INTERACTIVE 只排在 REALTIME 后面 */
+static const uint64_t fc_aging_ns[SPIREG_PRIO_CNT] = {
+    [SPIREG_PRIO_REALTIME] = 0,
+    [SPIREG_PRIO_INTERACTIVE] = 0,
+    [SPIREG_PRIO_BULK] = SPIREG_AGING_BULK_MS * 1000000ULL,
+};
+
+static int _FcEmpty(SpiRegHandle *h){
+    int prio;
+    for(prio = 0; prio < SPIREG_PRIO_CNT; prio++)
+        if(h->fc_head[prio]) return 0;
+    return 1;
+}
+
+/**
+ * @brief 从队列取出一批请求，合并者执行
+ *        只从一个优先级取: REALTIME 非空时总是先取它，老化不能让别的队列排到它前面；
+ *        否则默认取最高的非空队列，低优先级队首排队超过老化时间时先取它，多个都超时取等得最久的
+ */
+static int _FcTake(SpiRegHandle *h, SpiRegFcReq **batch){
+    int n = 0, prio, sel = -1, aged = 0;
+    uint64_t now = _NowNs(), wait, over, max_over = 0;
+    SpiRegPrioStat *stat;
+
+    /* 喂狗这类请求不能排在一整批老化的大批量请求后面 */
+    if(h->fc_head[SPIREG_PRIO_REALTIME]) sel = SPIREG_PRIO_REALTIME;
+    for(prio = SPIREG_PRIO_REALTIME + 1; sel != SPIREG_PRIO_REALTIME && prio < SPIREG_PRIO_CNT; prio++){
+        if(h->fc_head[prio] == NULL) continue;
+        if(sel < 0) { sel = prio; continue; }
+        wait = now - h->fc_head[prio]->enq_ns;
+        if(wait < fc_aging_ns[prio]) continue;
+        over = wait - fc_aging_ns[prio];
+        if(!aged || over > max_over){
+            sel = prio;
+            max_over = over;
+            aged = 1;
+        }
+    }
+    if(sel < 0) return 0;
+
+    stat = &h->prio_stat[sel];
+    while(h->fc_head[sel] && n < SPIREG_FC_MAX_BATCH){
+        batch[n] = h->fc_head[sel];
+        h->fc_head[sel] = batch[n]->next;
+        wait = now - batch[n]->enq_ns;
+        stat->req_cnt++;
+        stat->wait_ns_total += wait;
+        if(wait > stat->wait_ns_max) stat->wait_ns_max = wait;
+        n++;
+    }
+    if(aged) stat->aged_cnt += (uint64_t)n;
+    if(h->fc_head[sel] == NULL) h->fc_tail[sel] = NULL;
+    return n;
+}
+
+/* 单个操作合在一起做，批量操作在同一次加锁里按顺序各自做 */
+static void _FcExecute(SpiRegHandle *h, SpiRegFcReq **batch, int n){
+    SpiRegOp ops[SPIREG_FC_MAX_BATCH];
+    SpiRegFcReq *req;
+    uint32_t timeout = 0;
+    int i, k = 0, ret;
+
+    for(i = 0; i < n; i++){
+        if(batch[i]->ops) continue;
+        ops[k++] = batch[i]->op;
+        if(batch[i]->timeout > timeout) timeout = batch[i]->timeout;
+    }
+    ret = _Lock(h);
+    if(ret == 0){
+        if(k) _TransactLocked(h, ops, 0, k, timeout, NULL);
+        for(i = 0; i < n; i++){
+            req = batch[i];
+            if(req->ops) req->start = _TransactLocked(h, req->ops, req->start, req->n, req->timeout, req->rt);
+        }
+        _Unlock(h);
+    }
+    for(i = 0, k = 0; i < n; i++){
+        if(batch[i]->ops) batch[i]->op.ret = ret < 0 ? ret : 0;
+        else batch[i]->op.ret = ret < 0 ? ret : ops[k++].ret;
+    }
+}
+
+/**
+ * @brief 合并执行: 请求先挂到队列，没有执行者时自己成为执行者，
+ *        把队列中其他线程的请求一起作为一批操作执行，相邻的寄存器会合并成一帧，
+ *        结果写回各自的请求后唤醒等待的线程
+ * @return int              请求的执行结果
+ */
+static int _Combine(SpiRegHandle *h, SpiRegFcReq *req, uint32_t timeout, SpiRegPrio prio){
+    SpiRegFcReq *batch[SPIREG_FC_MAX_BATCH];
+    int n, round;
+
+    if((unsigned)prio >= SPIREG_PRIO_CNT) return -1;
+    req->timeout = timeout;
+    req->done = 0;
+    req->next = NULL;
+    req->enq_ns = _NowNs();
+    pthread_mutex_lock(&h->fc_mutex);
+    if(h->fc_tail[prio]) h->fc_tail[prio]->next = req;
+    else h->fc_head[prio] = req;
+    h->fc_tail[prio] = req;
+
+    while(!req->done){
+        if(h->fc_busy){
+            pthread_cond_wait(&h->fc_cond, &h->fc_mutex);
+            continue;
+        }
+        h->fc_busy = 1;
+        /* 队列空了或者做满 SPIREG_FC_MAX_ROUND 批后交出执行权，由还在等的线程接着做
+         * 每批都重新按优先级挑选，高优先级请求最多等当前这一批做完 */
+        for(round = 0; round < SPIREG_FC_MAX_ROUND && !_FcEmpty(h); round++){
+            n = _FcTake(h, batch);
+            pthread_mutex_unlock(&h->fc_mutex);
+            _FcExecute(h, batch, n);
+            pthread_mutex_lock(&h->fc_mutex);
+            while(n--) batch[n]->done = 1;
+        }
+        h->fc_busy = 0;
+        pthread_cond_broadcast(&h->fc_cond);
+    }
+    pthread_mutex_unlock(&h->fc_mutex);
+    return req->op.ret;
+}
+
+/**
+ * @brief 读spi寄存器, 数据直接收进 reg_data，不经过句柄内缓冲区的拷贝
+ *        超过一帧时自动分片，环形缓冲区这类寄存器需要先用 SpiReg_SetRegAttr 登记属性
+ *        多个线程同时调用时，请求会被合并到同一次传输中执行
+ *        超时或CRC错误时在 timeout 内退避后重新排队重试，退避时不占着锁，SPIREG_ATTR_NON_IDEMPOTENT 寄存器不重试
+ * @param  h                句柄
+ * @param  reg_addr         寄存器地址
+ * @param  reg_cnt          要读的寄存器数量
+ * @param  reg_data         装寄存器数据的指针, 失败时内容不确定
+ * @param  prio             排队优先级, SpiReg_Read 使用 SPIREG_PRIO_INTERACTIVE
  * @return return 成功0 失败负数 一般情况下 -2是超时 -3是crc错误，不排除其他系统返回值和他们一样
  */
-int SpiReg_Read(SpiRegHandle *h, uint16_t reg_addr, uint16_t reg_cnt, uint8_t *reg_data, uint32_t timeout){
+int SpiReg_ReadEx(SpiRegHandle *h, uint16_t reg_addr, uint16_t reg_cnt, uint8_t *reg_data, 
+    uint32_t timeout, SpiRegPrio prio){
+    SpiRegFcReq req;
+    SpiRegRetry rt;
     int ret;
-    uint16_t crc16_val = 0xffff;
-    uint16_t read_crc16_val = 0x0000;
-    size_t trans_length = 0;
-    uint32_t fill_len; 
 
     if(h == NULL) return -1;
-    
-    pthread_mutex_lock(&h->mutex);
-    ret = flock(h->lock_fd, LOCK_EX);
-    if(ret < 0){
-         pthread_mutex_unlock(&h->mutex);
-        return ret;
+    _RetryInit(&rt, _NowNs(), timeout);
+    req.ops = NULL;
+    req.op.type = SPIREG_OP_READ;
+    req.op.flags = SPIREG_OPF_MERGEABLE;
+    req.op.reg_addr = reg_addr;
+    req.op.reg_cnt = reg_cnt;
+    req.op.rdata = reg_data;
+    /* 失败后不占着锁和执行者退避，而是退避完重新排队 */
+    while((ret = _Combine(h, &req, rt.left, prio)) < 0){
+        if(!_Retryable(h, reg_addr, ret) || _RetryWait(h, &rt, reg_addr) < 0) break;
     }
+    return ret;
+}
 
-    memset(h->rx_buf, 0xff, SPI_RT_MSG_MAX_SIZE);
-    memset(h->tx_buf, 0xff, SPI_RT_MSG_MAX_SIZE);
-    SET_MEM_VAL_TYPE_SYSTEM_TO_BIG(h->tx_buf + CMD_1BYTE_OFFSET, SPI_CMD_READ_REG, uint8_t);
-    SET_MEM_VAL_TYPE_SYSTEM_TO_BIG(h->tx_buf + CMD_WR_ADDR_2BYTE_OFFSET, reg_addr, uint16_t);
-    SET_MEM_VAL_TYPE_SYSTEM_TO_BIG(h->tx_buf + CMD_WR_LEN_2BYTE_OFFSET, reg_cnt, uint16_t);
-    crc16_val = crc16(crc16_val, h->tx_buf, CMD_WR_CMD_LEN);
+int SpiReg_WriteEx(SpiRegHandle *h, uint16_t reg_addr, uint16_t reg_cnt, const uint8_t *reg_data, 
+    uint32_t timeout, SpiRegPrio prio){
+    SpiRegFcReq req;
 
-    ret = _GotoStartCmd(h, timeout);
-    if(ret < 0) { ret = -2 ; goto out;};
-    ret = _TransferSpi(h, SPI_CMD_LEN);
-    if(ret < 0) goto out;
-    ret = _WaitAck(h, timeout);
-    if(ret < 0) { ret = -2 ; goto out;};
-    trans_length = reg_cnt + WR_CRC_LEN;
-        /* 计算需要填充的大小 */
-    fill_len =  (WR_DATA_ALIGN_BYTE - trans_length%WR_DATA_ALIGN_BYTE) % WR_DATA_ALIGN_BYTE;
-    trans_length += fill_len;
-    ret = _TransferSpi(h, trans_length);
-    if(ret < 0) goto out;
+    if(h == NULL) return -1;
+    req.ops = NULL;
+    req.op.type = SPIREG_OP_WRITE;
+    req.op.flags = SPIREG_OPF_MERGEABLE;
+    req.op.reg_addr = reg_addr;
+    req.op.reg_cnt = reg_cnt;
+    req.op.wdata = reg_data;
+    return _Combine(h, &req, timeout, prio);
+}
+/**
+ * @brief 按优先级批量执行一组寄存器读写，和 SpiReg_ReadEx 一样在优先级队列里排队，轮到时整组在一次加锁里做完
+ *        相邻且地址连续、都带 SPIREG_OPF_MERGEABLE 标志的同类操作会被合并成一次传输
+ *        读超时或CRC错误时放开锁退避，重新排队后从失败的那一组接着做，退避期间别的线程和进程可以使用总线
+ * @param  h                句柄
+ * @param  ops              操作数组，按顺序执行，每个操作的结果写在 ops[i].ret
+ * @param  n                操作数量
+ * @param  timeout          每次传输的超时时间，一组读的重试都算在这个时间里
+ * @param  prio             排队优先级, SpiReg_Transact 使用 SPIREG_PRIO_INTERACTIVE
+ * @return int              全部成功返回0，否则返回第一个失败操作的错误码，加锁失败时一个操作都没做
+ */
+int SpiReg_TransactEx(SpiRegHandle *h, SpiRegOp *ops, int n, uint32_t timeout, SpiRegPrio prio){
+    SpiRegRetry rt = {.idx = -1};
+    SpiRegFcReq req;
+    int ret, i;
 
-    ret = _WaitAck(h, timeout);
-    if(ret < 0) { ret = -2 ; goto out;};
-    
-    crc16_val = crc16(crc16_val, h->rx_buf, reg_cnt);
-
-    SET_MEM_VAL_TYPE_BIG_TO_SYSTEM(&read_crc16_val, 
-        GET_MEM_VAL(h->rx_buf+reg_cnt, uint16_t), 
-        uint16_t);
-    //dbg_infohex(h->rx_buf, reg_cnt+WR_CRC_LEN);
-    if(read_crc16_val == crc16_val){
-        memcpy(reg_data, h->rx_buf, reg_cnt);
-        ret = 0;
-    }else{
-        ret = -3;
+    if(h == NULL || ops == NULL || n <= 0) return -1;
+    req.ops = ops;
+    req.start = 0;
+    req.n = n;
+    req.rt = &rt;
+    while((ret = _Combine(h, &req, timeout, prio)) == 0 && req.start < n){
+        /* 放弃的这一组保留失败结果，接着做后面的 */
+        if(_RetryWait(h, &rt, ops[req.start].reg_addr) < 0 && (req.start = rt.idx + rt.cnt) >= n) break;
     }
+    if(ret < 0) return ret;
+
+    for(i = 0; i < n; i++)
+        if(ops[i].ret < 0) return ops[i].ret;
+    return 0;
+}
+
+int SpiReg_Transact(SpiRegHandle *h, SpiRegOp *ops, int n, uint32_t timeout){
+    return SpiReg_TransactEx(h, ops, n, timeout, SPIREG_PRIO_INTERACTIVE);
+}
+
+int SpiReg_Read(SpiRegHandle *h, uint16_t reg_addr, uint16_t reg_cnt, uint8_t *reg_data, uint32_t timeout){
+    return SpiReg_ReadEx(h, reg_addr, reg_cnt, reg_data, timeout, SPIREG_PRIO_INTERACTIVE);
+}
 
+int SpiReg_Write(SpiRegHandle *h, uint16_t reg_addr, uint16_t reg_cnt, const uint8_t *reg_data, uint32_t timeout){
+    return SpiReg_WriteEx(h, reg_addr, reg_cnt, reg_data, timeout, SPIREG_PRIO_INTERACTIVE);
+}
+
+/**
+ * @brief 获取某个优先级的排队统计
+ * @param  h                句柄
+ * @param  prio             优先级
+ * @param  stat             统计输出
+ * @return int              成功0 失败负数
+ */
+int SpiReg_GetPrioStat(SpiRegHandle *h, SpiRegPrio prio, SpiRegPrioStat *stat){
+    if(h == NULL || stat == NULL || (unsigned)prio >= SPIREG_PRIO_CNT) return -1;
+    pthread_mutex_lock(&h->fc_mutex);
+    *stat = h->prio_stat[prio];
+    pthread_mutex_unlock(&h->fc_mutex);
+    return 0;
+}
+
+/**
+ * @brief 设置传输协议版本，老版本MCU固件只支持 SPIREG_PROTO_V1
+ * @param  h                句柄
+ * @param  proto            SpiRegProto
+ * @param  v2_gap_us        V2协议命令与数据之间的间隔(微秒)，给MCU准备数据，传0使用默认值
+ * @return int              成功0 失败负数
+ */
+int SpiReg_SetProto(SpiRegHandle *h, SpiRegProto proto, uint16_t v2_gap_us){
+    if(h == NULL) return -1;
+    if(proto != SPIREG_PROTO_V1 && proto != SPIREG_PROTO_V2) return -1;
+    if(_Lock(h) < 0) return -1;
+    h->proto = proto;
+    h->v2_gap_us = v2_gap_us ? v2_gap_us : V2_CMD_DATA_GAP_US;
+    /* 流水线和无ACK读依赖V2协议 */
+    if(proto != SPIREG_PROTO_V2){
+        h->pipe_depth = 1;
+        h->ackless.enabled = 0;
+    }
+    _Unlock(h);
+    return 0;
+}
+
+/**
+ * @brief 打开或关闭无ACK读，需要先切到 SPIREG_PROTO_V2 并且MCU固件支持 SPI_CMD_QUIET_START
+ *        打开时先用ACK模式连续读 probe_addr 校准，取MCU最慢的握手响应再加 SPIREG_ACKLESS_MARGIN_PCT 作为等待时间，
+ *        之后的读帧(流水线和 SPIREG_ATTR_NON_IDEMPOTENT 寄存器除外)发'Q'后定时等待，省掉两次ACK，
+ *        CRC错误的帧马上用ACK模式重读，连续 SPIREG_ACKLESS_MAX_FAIL 次失败自动关闭。写帧仍然要MCU的ACK确认
+ * @param  h                句柄
+ * @param  enable           1打开(重新校准) 0关闭
+ * @param  probe_addr       校准时读的寄存器，读 ACKLESS_PROBE_LEN 字节不能有副作用
+ * @return int              成功0 失败负数，失败时保持关闭
+ */
+int SpiReg_SetAckless(SpiRegHandle *h, int enable, uint16_t probe_addr){
+    SpiRegAckless *al;
+    SpiRegSeg seg;
+    uint64_t byte_ns, arm;
+    int ret = 0, i;
+
+    if(h == NULL) return -1;
+    if(_Lock(h) < 0) return -1;
+    al = &h->ackless;
+    al->enabled = 0;
+    if(!enable) goto out;
+    if(h->proto != SPIREG_PROTO_V2){
+        ret = -1;
+        goto out;
+    }
+    /* 连续读，MCU处理上一帧的收尾也算在握手时间里，第一帧冷启动不算 */
+    al->hs_max_ns = 0;
+    for(i = 0; i <= SPIREG_ACKLESS_CAL_CNT; i++){
+        al->calibrating = i > 0;
+        seg.rx = h->rx_buf;
+        seg.len = ACKLESS_PROBE_LEN;
+        ret = _ReadTryLocked(h, probe_addr, &seg, 1, SPI_TIMEOUT_MS, NULL);
+        if(ret < 0) break;
+    }
+    al->calibrating = 0;
+    if(ret < 0) goto out;
+    /* 测到的时间包括ACK字节传回来，无ACK时不用等这个字节 */
+    byte_ns = h->trans.uart_baud ? 10ULL * 1000000000ULL / h->trans.uart_baud : 0;
+    arm = al->hs_max_ns > byte_ns ? al->hs_max_ns - byte_ns : 0;
+    al->arm_ns = arm + arm * SPIREG_ACKLESS_MARGIN_PCT / 100;
+    al->fails = 0;
+    al->enabled = 1;
+    dbg_infofl("ackless: handshake max %lluns, wait %lluns", 
+        (unsigned long long)al->hs_max_ns, (unsigned long long)al->arm_ns);
 out:
-    flock(h->lock_fd, LOCK_UN);
-    pthread_mutex_unlock(&h->mutex);
+    _Unlock(h);
     return ret;
 }
 
-int SpiReg_Write(SpiRegHandle *h, uint16_t reg_addr, uint16_t reg_cnt, const uint8_t *reg_data, uint32_t timeout){
-    int ret;
-    uint16_t crc16_val = 0xffff;
-    size_t trans_length = 0;
-    uint32_t fill_len; 
+/**
+ * @brief 读取无ACK模式的状态和统计
+ */
+int SpiReg_GetAckless(SpiRegHandle *h, SpiRegAckless *stat){
+    if(h == NULL || stat == NULL) return -1;
+    if(_Lock(h) < 0) return -1;
+    *stat = h->ackless;
+    _Unlock(h);
+    return 0;
+}
 
+/**
+ * @brief 设置流水线深度，需要先切到 SPIREG_PROTO_V2 并且MCU固件支持
+ *        流水线模式下，同一次加锁内的多帧(批量操作、分片)不再逐帧握手，
+ *        发下一帧时不等上一帧的ACK，ACK带帧序号，按序号对应到各帧的结果
+ * @param  h                句柄
+ * @param  depth            最多未确认的帧数量 1为关闭 最大 SPIREG_PIPE_MAX_DEPTH
+ * @return int              成功0 失败负数
+ */
+int SpiReg_SetPipeline(SpiRegHandle *h, uint8_t depth){
+    int ret = 0;
+    if(h == NULL || depth == 0 || depth > SPIREG_PIPE_MAX_DEPTH) return -1;
+    if(_Lock(h) < 0) return -1;
+    if(depth > 1 && h->proto != SPIREG_PROTO_V2)
+        ret = -1;
+    else
+        h->pipe_depth = depth;
+    _Unlock(h);
+    return ret;
+}
+
+/**
+ * @brief 登记寄存器属性, 影响分片等行为，应在初始化后、开始读写前调用
+ * @param  h                句柄
+ * @param  reg_addr         起始寄存器地址
+ * @param  reg_cnt          寄存器数量
+ * @param  attr             SPIREG_ATTR_XXX
+ * @return int              成功0 表满返回-1
+ */
+int SpiReg_SetRegAttr(SpiRegHandle *h, uint16_t reg_addr, uint16_t reg_cnt, uint8_t attr){
+    int ret = -1;
     if(h == NULL) return -1;
-    
-    pthread_mutex_lock(&h->mutex);
-    ret = flock(h->lock_fd, LOCK_EX);
-    if(ret < 0) {
-        pthread_mutex_unlock(&h->mutex);
-        return ret;
+    if(_Lock(h) < 0) return -1;
+    if(h->attr_cnt < SPIREG_ATTR_TAB_SIZE){
+        h->attr_tab[h->attr_cnt].reg_addr = reg_addr;
+        h->attr_tab[h->attr_cnt].reg_cnt = reg_cnt;
+        h->attr_tab[h->attr_cnt].attr = attr;
+        h->attr_cnt++;
+        ret = 0;
     }
-    
+    _Unlock(h);
+    return ret;
+}
 
-    memset(h->rx_buf, 0xff, SPI_RT_MSG_MAX_SIZE);
-    memset(h->tx_buf, 0xff, SPI_RT_MSG_MAX_SIZE);
-    SET_MEM_VAL_TYPE_SYSTEM_TO_BIG(h->tx_buf + CMD_1BYTE_OFFSET, SPI_CMD_WRITE_REG, uint8_t);
-    SET_MEM_VAL_TYPE_SYSTEM_TO_BIG(h->tx_buf + CMD_WR_ADDR_2BYTE_OFFSET, reg_addr, uint16_t);
-    SET_MEM_VAL_TYPE_SYSTEM_TO_BIG(h->tx_buf + CMD_WR_LEN_2BYTE_OFFSET, reg_cnt, uint16_t);
-    crc16_val = crc16(crc16_val, h->tx_buf, CMD_WR_CMD_LEN);
+/**
+ * @brief 设置进程间的仲裁方式，必须在没有其他线程使用句柄时调用，
+ *        使用同一组设备的所有进程必须使用相同的方式，否则互相之间没有互斥
+ * @param  h                句柄
+ * @param  mode             SPIREG_LOCK_FLOCK(默认) 或 SPIREG_LOCK_SHM
+ * @return int              成功0 失败负数
+ */
+int SpiReg_SetLockMode(SpiRegHandle *h, SpiRegLockMode mode){
+    char path[512] = {0};
+    if(h == NULL) return -1;
+    if(mode == h->lock_mode) return 0;
+    if(mode == SPIREG_LOCK_SHM){
+        snprintf(path, sizeof(path), "%s%s.tlock", SPIREG_SHM_LOCK_DIR, h->lock_name);
+        if(ShmTLock_Open(&h->tlock, path) < 0) return -1;
+    }else if(mode == SPIREG_LOCK_FLOCK){
+        ShmTLock_Close(&h->tlock);
+    }else{
+        return -1;
+    }
+    h->lock_mode = mode;
+    return 0;
+}
 
-    ret = _GotoStartCmd(h, timeout);
-    if(ret < 0) { ret = -2 ; goto out;};
+/**
+ * @brief 打开自适应时钟: 链路干净时逐档升速，出现CRC错误或超时时降速
+ *        时钟通过每次传输的 speed_hz 设置，不再改设备的默认速度
+ * @param  h                句柄
+ * @param  min_hz           最低速度, 0为关闭自适应
+ * @param  max_hz           最高速度
+ * @param  persist_path     保存当前速度的文件, 下次打开时从这个速度开始, NULL不保存
+ * @return int              成功0 失败负数
+ */
+int SpiReg_SetAdaptive(SpiRegHandle *h, uint32_t min_hz, uint32_t max_hz, const char *persist_path){
+    FILE *fp;
+    unsigned int saved = 0;
 
-    ret = _TransferSpi(h, SPI_CMD_LEN);
-    if(ret < 0) goto out;
+    if(h == NULL || (min_hz && min_hz > max_hz)) return -1;
+    if(_Lock(h) < 0) return -1;
+    memset(&h->adapt, 0, sizeof(h->adapt));
+    if(min_hz){
+        h->adapt.enabled = 1;
+        h->adapt.min_hz = min_hz;
+        h->adapt.max_hz = max_hz;
+        if(persist_path){
+            strncpy(h->adapt.path, persist_path, sizeof(h->adapt.path) - 1);
+            fp = fopen(persist_path, "r");
+            if(fp){
+                if(fscanf(fp, "%u", &saved) == 1 && saved >= min_hz && saved <= max_hz)
+                    h->speed = saved;
+                fclose(fp);
+            }
+        }
+        if(h->speed < min_hz) h->speed = min_hz;
+        if(h->speed > max_hz) h->speed = max_hz;
+    }
+    _Unlock(h);
+    return 0;
+}
 
-    ret = _WaitAck(h, timeout);
-    if(ret < 0) { ret = -2 ; goto out;};
-    /* 开始准备发送的数据 */
-    crc16_val = crc16(crc16_val, reg_data, reg_cnt);
-    memcpy(h->tx_buf, reg_data, reg_cnt);
-    SET_MEM_VAL_TYPE_SYSTEM_TO_BIG(h->tx_buf+reg_cnt, crc16_val, uint16_t);
-    trans_length = reg_cnt + WR_CRC_LEN;
-    /* 计算需要填充的大小 */
-    fill_len =  (WR_DATA_ALIGN_BYTE - trans_length%WR_DATA_ALIGN_BYTE) % WR_DATA_ALIGN_BYTE;
-    memset(h->tx_buf+trans_length, 0xff, fill_len);
-    trans_length += fill_len;
-    //dbg_infohex(h->tx_buf, trans_length);
-    ret = _TransferSpi(h, trans_length);
-    if(ret < 0) goto out;
+/**
+ * @brief 获取当前SPI时钟和累计的错误数
+ * @param  h                句柄
+ * @param  crc_errs         累计CRC错误, 可以为NULL
+ * @param  timeouts         累计超时, 可以为NULL
+ * @return uint32_t         当前时钟(Hz)
+ */
+uint32_t SpiReg_GetSpeed(SpiRegHandle *h, uint32_t *crc_errs, uint32_t *timeouts){
+    uint32_t speed;
+    if(h == NULL || _Lock(h) < 0) return 0;
+    speed = h->speed;
+    if(crc_errs) *crc_errs = h->adapt.crc_errs;
+    if(timeouts) *timeouts = h->adapt.timeouts;
+    _Unlock(h);
+    return speed;
+}
 
-    ret = _WaitAck(h, timeout);
-    if(ret < 0) { ret = -2 ; goto out;};
-out:
-    flock(h->lock_fd, LOCK_UN);
-    pthread_mutex_unlock(&h->mutex);
+/**
+ * @brief 设置幂等读的最大重试次数
+ * @param  h                句柄
+ * @param  retry_max        0为不重试, 默认 SPIREG_RETRY_MAX
+ * @return int              成功0 失败负数
+ */
+int SpiReg_SetRetry(SpiRegHandle *h, uint8_t retry_max){
+    if(h == NULL || _Lock(h) < 0) return -1;
+    h->retry_max = retry_max;
+    _Unlock(h);
+    return 0;
+}
+
+/**
+ * @brief 获取按地址范围统计的重试次数
+ * @param  h                句柄
+ * @param  stat             输出数组
+ * @param  max              数组大小
+ * @return int              范围数量
+ */
+int SpiReg_GetRetryStat(SpiRegHandle *h, SpiRegRetryStat *stat, int max){
+    int n;
+    if(h == NULL || stat == NULL) return -1;
+    pthread_mutex_lock(&h->fc_mutex);
+    /* 表满后溢出的统计在最后一项 */
+    n = h->retry_stat_cnt;
+    if(h->retry_stat[SPIREG_RETRY_TAB_SIZE - 1].retries || h->retry_stat[SPIREG_RETRY_TAB_SIZE - 1].gave_up)
+        n = SPIREG_RETRY_TAB_SIZE;
+    if(n > max) n = max;
+    memcpy(stat, h->retry_stat, sizeof(SpiRegRetryStat) * (size_t)n);
+    pthread_mutex_unlock(&h->fc_mutex);
+    return n;
+}
+
+/**
+ * @brief 设置共享内存统计页，之后每帧的结果和等锁时间都记到页里
+ * @param  h                句柄
+ * @param  stats            已经打开的统计页，NULL不统计
+ */
+void SpiReg_SetStats(SpiRegHandle *h, RvmStats *stats){
+    h->stats = stats;
+}
+
+/**
+ * @brief 开始抓包，之后所有串口和SPI的收发都记录到文件，SpiReg_Exit 时关闭
+ * @param  h                句柄
+ * @param  path             抓包文件
+ * @return int              成功0 失败负数
+ */
+int SpiReg_SetCapture(SpiRegHandle *h, const char *path){
+    int ret;
+    if(h == NULL || path == NULL || _Lock(h) < 0) return -1;
+    ret = SpiCap_Wrap(&h->trans, path);
+    _Unlock(h);
     return ret;
 }
 
 /**
- * @brief open spi 配置为既定频率后返回文件描述符
- * @param  dev              设备节点 /dev/ttyLP1
- * @param  speed            spi时钟频率
- * @return int 
+ * @brief 打开或关闭带序号的ACK，需要MCU固件支持 SPI_CMD_TAG_START
+ *        打开后握手带一个滚动序号，MCU的每个ACK都是 [ACK/NACK, 序号]，
+ *        之前超时的帧迟到的ACK按序号在用户态跳过，整个传输不再调用 uart_InClean(tcflush)
+ * @param  h                句柄
+ * @param  enable           0关闭 其他打开
+ * @return int              成功0 失败负数
  */
-int SpiReg_Init(SpiRegHandle *h, char* spi_dev, char* uart_dev, uint32_t spi_speed){
-    int fd,ret,lock_fd;
-    char lock_path[512] = {0};
-    uint8_t mode = SPI_MODE_3;              // 设置模式为 0
-    uint8_t lsb_first = 0;                  // 设置为 MSB 优先
-    uint8_t bits_per_word = 8;              // 设置数据位数为 8 位
+int SpiReg_SetTaggedAck(SpiRegHandle *h, int enable){
+    if(h == NULL || _Lock(h) < 0) return -1;
+    h->tag_ack = enable ? 1 : 0;
+    /* 状态和通知都靠序号把ACK和其他字节区分开，关掉序号它们也就没有了 */
+    if(!h->tag_ack){
+        h->status_fresh_us = 0;
+        h->notify = 0;
+    }
+    _Unlock(h);
+    return 0;
+}
 
-    strcpy(lock_path, "/run/lock/");
-    strncat(lock_path, basename(spi_dev), 40);
-    strncat(lock_path, "__", 40);
-    strncat(lock_path, basename(uart_dev), 40);
-    strncat(lock_path, ".lock", 40);
+/**
+ * @brief 打开或关闭带状态的ACK，需要MCU固件支持 SPI_TAG_STATUS
+ *        打开后每帧最后的ACK带回CAN收发环形缓冲区的水位，在 fresh_us 内可以用 SpiReg_GetStatus
+ *        取到，省掉每次读写环形缓冲区前查询容量的那一帧。状态依赖带序号的ACK，打开时一起打开
+ * @param  h                句柄
+ * @param  fresh_us         状态的有效时间，0关闭(带序号的ACK保持打开)
+ * @return int              成功0 失败负数
+ */
+int SpiReg_SetStatusAck(SpiRegHandle *h, uint32_t fresh_us){
+    if(h == NULL || _Lock(h) < 0) return -1;
+    if(fresh_us) h->tag_ack = 1;
+    h->status_fresh_us = fresh_us;
+    __atomic_store_n(&h->status_word, 0, __ATOMIC_RELEASE);
+    _Unlock(h);
+    return 0;
+}
 
-    lock_fd = open(lock_path, O_CREAT | O_RDWR | O_CLOEXEC, 0666);
-    if(lock_fd < 0)
-        return lock_fd;
-    h->lock_fd = lock_fd;
+/**
+ * @brief 取最近一帧ACK带回的环形缓冲区水位，不加锁
+ *        状态是上一帧结束时MCU的值，每帧开始时作废。之后MCU只会往接收缓冲区里放、从发送缓冲区里取，
+ *        但其他线程或进程也可能在读写同一个缓冲区，只有调用者是缓冲区唯一的使用者、
+ *        并且取状态和随后的读写之间没有其他读写时，rx_used 和 tx_free 才只会偏小
+ * @param  h                句柄
+ * @param  status           输出
+ * @return int              成功0 没有状态或已经过期返回-1
+ */
+int SpiReg_GetStatus(SpiRegHandle *h, SpiRegStatus *status){
+    uint64_t w;
+    uint32_t age;
+    if(h == NULL || status == NULL || h->status_fresh_us == 0) return -1;
+    w = __atomic_load_n(&h->status_word, __ATOMIC_ACQUIRE);
+    if(w == 0) return -1;
+    age = _NowUs() - (uint32_t)(w >> 32);
+    if(age >= h->status_fresh_us) return -1;
+    status->rx_used = (uint16_t)w;
+    status->tx_free = (uint16_t)(w >> 16);
+    status->age_us = age;
+    return 0;
+}
 
-    ret = flock(h->lock_fd, LOCK_EX);
-    if(ret < 0) { 
-        close(lock_fd);
-        return ret;
+/**
+ * @brief 声明MCU会在两帧之间发 SPI_NOTIFY (由MCU的寄存器打开)，之后可以用 SpiReg_WaitNotify 等待
+ *        通知要和ACK区分开，打开时一起打开带序号的ACK，传输中不再清空串口以免把通知清掉
+ * @param  h                句柄
+ * @param  enable           0关闭 其他打开
+ * @return int              成功0 失败负数
+ */
+int SpiReg_SetNotify(SpiRegHandle *h, int enable){
+    if(h == NULL || _Lock(h) < 0) return -1;
+    if(enable) h->tag_ack = 1;
+    h->notify = enable ? 1 : 0;
+    __atomic_store_n(&h->notify_pending, 0, __ATOMIC_RELEASE);
+    _Unlock(h);
+    return 0;
+}
+
+/**
+ * @brief 等MCU的 SPI_NOTIFY，等待期间不占锁，其他线程照常传输
+ *        其他线程的传输收ACK时跳过的通知也算，迟到的ACK里恰好有 SPI_NOTIFY 时会多醒一次
+ *        timeout 为0时不等待，只把串口里已有的字节收走，给 SpiReg_GetNotifyFd 可读后调用
+ * @param  h                句柄
+ * @param  timeout          毫秒
+ * @return int              收到通知返回1 超时返回0 失败负数
+ */
+int SpiReg_WaitNotify(SpiRegHandle *h, uint32_t timeout){
+    uint64_t deadline = _NowNs() + (uint64_t)timeout * 1000000ULL, now;
+    uint8_t buf[NOTIFY_DRAIN_LEN];
+    int ret, i, wait_ms;
+
+    if(h == NULL || !h->notify) return -1;
+    while(1){
+        if(__atomic_exchange_n(&h->notify_pending, 0, __ATOMIC_ACQ_REL)){
+            /* 缓存的水位是通知之前的，不能再用它跳过读 */
+            __atomic_store_n(&h->status_word, 0, __ATOMIC_RELEASE);
+            return 1;
+        }
+        now = _NowNs();
+        wait_ms = now >= deadline ? 0 : (int)((deadline - now + 999999ULL) / 1000000ULL);
+        ret = SpiTrans_UartWait(&h->trans, wait_ms);
+        if(ret < 0) return -1;
+        if(ret == 0){
+            if(wait_ms == 0) return 0;
+            continue;
+        }
+        /* 放锁前ACK都已经收完，这时串口里只有通知和之前超时的帧迟到的ACK */
+        if(_Lock(h) < 0) return -1;
+        ret = SpiTrans_UartRead(&h->trans, buf, sizeof(buf), 0, 0);
+        _Unlock(h);
+        for(i = 0; i < ret; i++){
+            if(buf[i] == SPI_NOTIFY) __atomic_store_n(&h->notify_pending, 1, __ATOMIC_RELEASE);
+        }
     }
-    
-    ret = open(spi_dev, O_RDWR|O_CLOEXEC);  // 打开 SPI 设备文件
-    if(ret < 0)  goto open_spi_error;
-    fd = ret;
-    ret = ioctl(fd, SPI_IOC_WR_MODE, &mode);
-    if ( ret < 0) goto ioctl_error;
-    
-    ret = ioctl(fd, SPI_IOC_WR_LSB_FIRST, &lsb_first);
-    if ( ret < 0) goto ioctl_error;
+}
+
+/**
+ * @brief 取MCU发通知的串口fd，给外部的事件循环等待，可读后调用 SpiReg_WaitNotify(h, 0)
+ *        等待时不能把数据读走，传输中的ACK也从这个fd来
+ * @param  h                句柄
+ * @return int              没有打开通知或者没有真实串口(模拟器)返回-1
+ */
+int SpiReg_GetNotifyFd(SpiRegHandle *h){
+    if(h == NULL || !h->notify) return -1;
+    return h->trans.uart_fd;
+}
 
-    ret = ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits_per_word);
-    if ( ret < 0) goto ioctl_error;
+/**
+ * @brief 取传输层各操作的累计调用次数，用来估算每帧的系统调用
+ */
+int SpiReg_GetTransCnt(SpiRegHandle *h, SpiTransCnt *cnt){
+    if(h == NULL || cnt == NULL || _Lock(h) < 0) return -1;
+    *cnt = h->trans.cnt;
+    _Unlock(h);
+    return 0;
+}
+
+/**
+ * @brief 设置等ACK时的忙等时间，先在这段时间内反复非阻塞读串口，ACK没到再进 poll 睡眠
+ *        MCU很快就能回ACK时省掉一次调度唤醒的延时，代价是忙等期间占满CPU，用 --bench-ack 测了再选
+ * @param  h                句柄
+ * @param  spin_us          忙等微秒数，0不忙等(默认), 最大 SPIREG_ACK_SPIN_MAX_US
+ * @return int              成功0 失败负数
+ */
+int SpiReg_SetAckSpin(SpiRegHandle *h, uint32_t spin_us){
+    if(h == NULL || spin_us > SPIREG_ACK_SPIN_MAX_US) return -1;
+    if(_Lock(h) < 0) return -1;
+    h->ack_spin_us = spin_us;
+    _Unlock(h);
+    return 0;
+}
+
+/**
+ * @brief 打开或关闭各阶段延时统计，打开时每个阶段多一次 clock_gettime
+ * @param  h                句柄
+ * @param  enable           0关闭 其他打开
+ * @return int              成功0 失败负数
+ */
+int SpiReg_SetLatency(SpiRegHandle *h, int enable){
+    if(h == NULL || _Lock(h) < 0) return -1;
+    h->lat_enabled = enable ? 1 : 0;
+    _Unlock(h);
+    return 0;
+}
+
+/**
+ * @brief 取一个阶段的延时直方图，不加锁，可以在传输进行中调用
+ * @param  h                句柄
+ * @param  op               SPIREG_OP_READ 或 SPIREG_OP_WRITE
+ * @param  stage            阶段
+ * @param  hist             输出
+ * @param  reset            取出的同时清零
+ * @return int              成功0 失败负数
+ */
+int SpiReg_GetLatency(SpiRegHandle *h, int op, SpiRegStage stage, LatHist *hist, int reset){
+    if(h == NULL || hist == NULL || op < 0 || op >= SPIREG_LAT_OP_CNT || stage >= SPIREG_STAGE_CNT) 
+        return -1;
+    LatHist_Snapshot(&h->lat[op][stage], hist, reset);
+    return 0;
+}
+
+/* 打开(不存在则创建)锁文件 /run/lock/<lock_name>.lock */
+static int _OpenLockFile(const char *lock_name){
+    char lock_path[512] = {0};
+    strcpy(lock_path, "/run/lock/");
+    strncat(lock_path, lock_name, SPIREG_LOCK_NAME_LEN);
+    strncat(lock_path, ".lock", 40);
+    return open(lock_path, O_CREAT | O_RDWR | O_CLOEXEC, 0666);
+}
+
+/* 传输已经打开后初始化句柄，失败时不关闭传输和锁文件 */
+static int _InitHandle(SpiRegHandle *h, const SpiTrans *trans, int lock_fd, uint32_t spi_speed, uint32_t frame_size){
+    int ret;
 
-    ret = ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &spi_speed);
-    if ( ret < 0) goto ioctl_error;
-    
     memset(h,0,sizeof(SpiRegHandle));
-    h->fd =fd;
+
+    if(frame_size == 0) frame_size = SPI_RT_MSG_MAX_SIZE;
+    if(frame_size > trans->max_msg - SPI_CMD_LEN) frame_size = trans->max_msg - SPI_CMD_LEN;
+    frame_size &= ~(uint32_t)(WR_DATA_ALIGN_BYTE - 1);
+    if(frame_size < WR_DATA_ALIGN_BYTE) return -1;
+    h->frame_size = frame_size;
+    ret = posix_memalign((void**)&h->tx_buf, WR_DATA_ALIGN_BYTE, frame_size);
+    if(ret != 0) return -1;
+    ret = posix_memalign((void**)&h->rx_buf, WR_DATA_ALIGN_BYTE, frame_size);
+    if(ret != 0) { free(h->tx_buf); return -1; }
+    /* tx_buf 只作为读数据时的发送填充，初始化后不再改动 */
+    memset(h->tx_buf, 0xff, frame_size);
+    h->trans = *trans;
     h->lock_fd = lock_fd;
+    strncpy(h->lock_name, trans->name, SPIREG_LOCK_NAME_LEN - 1);
+    h->lock_mode = SPIREG_LOCK_FLOCK;
+    h->tlock.fd = -1;
     h->speed = spi_speed;
-
-    h->uart_fd = uart_Open(uart_dev, UART_SPEED, 8, 1, 'N');
-    if(h->uart_fd < 0) goto uart_open_error;
+    h->proto = SPIREG_PROTO_V1;
+    h->v2_gap_us = V2_CMD_DATA_GAP_US;
+    h->pipe_depth = 1;
+    h->retry_max = SPIREG_RETRY_MAX;
+    h->lat_enabled = 1;
 
     pthread_mutex_init(&h->mutex, NULL);
+    pthread_mutex_init(&h->fc_mutex, NULL);
+    pthread_cond_init(&h->fc_cond, NULL);
+    return 0;
+}
 
-    flock(h->lock_fd, LOCK_UN);
+/**
+ * @brief open spi 配置为既定频率后返回文件描述符
+ * @param  dev              设备节点 /dev/ttyLP1
+ * @param  speed            spi时钟频率
+ * @param  frame_size       一帧数据段的最大长度(含CRC和填充)，0使用 SPI_RT_MSG_MAX_SIZE,
+ *                          不会超过spidev的bufsiz(V2协议还要留出命令的长度)，更大的读写自动分片
+ * @return int 
+ */
+int SpiReg_Init(SpiRegHandle *h, char* spi_dev, char* uart_dev, uint32_t spi_speed, uint32_t frame_size){
+    SpiTrans trans;
+    char lock_name[SPIREG_LOCK_NAME_LEN] = {0};
+    int ret, lock_fd;
 
+    /* 锁名和传输的名字一致: spi设备名__串口设备名 */
+    strncat(lock_name, basename(spi_dev), 40);
+    strncat(lock_name, "__", 40);
+    strncat(lock_name, basename(uart_dev), 40);
+    lock_fd = _OpenLockFile(lock_name);
+    if(lock_fd < 0)
+        return lock_fd;
+
+    /* 配置设备时和其他进程互斥 */
+    ret = flock(lock_fd, LOCK_EX);
+    if(ret < 0) { 
+        close(lock_fd);
+        return ret;
+    }
+    ret = SpiTrans_OpenSpidev(&trans, spi_dev, uart_dev, spi_speed);
+    if(ret < 0) goto open_error;
+    ret = _InitHandle(h, &trans, lock_fd, spi_speed, frame_size);
+    if(ret < 0){
+        SpiTrans_Close(&trans);
+        goto open_error;
+    }
+    flock(lock_fd, LOCK_UN);
     return 0;
-uart_open_error:
-ioctl_error:
-    close(fd);
-open_spi_error:
-    flock(h->lock_fd, LOCK_UN);
+open_error:
+    flock(lock_fd, LOCK_UN);
     close(lock_fd);
     return ret;
 }
 
+/**
+ * @brief 用已经打开的传输初始化(如软件模拟的MCU)，锁文件按 trans->name 区分
+ * @param  h                句柄
+ * @param  trans            已打开的传输，复制到句柄中，之后由 SpiReg_Exit 关闭
+ * @param  spi_speed        spi时钟频率
+ * @param  frame_size       同 SpiReg_Init, 不超过 trans->max_msg
+ * @return int              成功0 失败负数, 失败时传输仍由调用者关闭
+ */
+int SpiReg_InitTrans(SpiRegHandle *h, const SpiTrans *trans, uint32_t spi_speed, uint32_t frame_size){
+    int ret, lock_fd;
+    lock_fd = _OpenLockFile(trans->name);
+    if(lock_fd < 0)
+        return lock_fd;
+    ret = _InitHandle(h, trans, lock_fd, spi_speed, frame_size);
+    if(ret < 0) close(lock_fd);
+    return ret;
+}
+
 void SpiReg_Exit(SpiRegHandle *h){
 
 
     flock(h->lock_fd, LOCK_EX);
     pthread_mutex_destroy(&h->mutex);
-    close(h->fd);
-    close(h->uart_fd);
+    pthread_mutex_destroy(&h->fc_mutex);
+    pthread_cond_destroy(&h->fc_cond);
+    SpiTrans_Close(&h->trans);
     flock(h->lock_fd, LOCK_UN);
     close(h->lock_fd);
-    
+    ShmTLock_Close(&h->tlock);
+    free(h->tx_buf);
+    free(h->rx_buf);
 }
@@ -0,0 +1,249 @@
+/**
+ * @file spi_trans.c
+ * @brief spidev + 串口 的传输实现
+ * @author simon.xiaoapeng (simon.xiaoapeng@gmail.com)
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2023  simon.xiaoapeng@gmail.com
+ *
+ * @par 修改日志:
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <linux/spi/spidev.h>
+
+#include "spi_trans.h"
+#include "pp_uart.h"
+
+#define UART_SPEED                      115200
+
+/* spidev 一次消息的最大长度，由内核模块参数 bufsiz 决定 */
+#define SPIDEV_BUFSIZ_PATH              "/sys/module/spidev/parameters/bufsiz"
+#define SPIDEV_BUFSIZ_DEFAULT           4096
+
+/* 读spidev模块参数bufsiz */
+static uint32_t _SpidevBufsiz(void){
+    FILE *fp;
+    unsigned int bufsiz = 0;
+    fp = fopen(SPIDEV_BUFSIZ_PATH, "r");
+    if(fp == NULL) return SPIDEV_BUFSIZ_DEFAULT;
+    if(fscanf(fp, "%u", &bufsiz) != 1 || bufsiz == 0)
+        bufsiz = SPIDEV_BUFSIZ_DEFAULT;
+    fclose(fp);
+    return bufsiz;
+}
+
+static int _SpidevXfer(SpiTrans *t, struct spi_ioc_transfer *xfer, int n){
+    return ioctl(t->spi_fd, SPI_IOC_MESSAGE(n), xfer);
+}
+
+static int _SpidevUartWrite(SpiTrans *t, const uint8_t *data, int len){
+    return (int)uart_Write(t->uart_fd, (void *)data, (size_t)len);
+}
+
+/* 有io_uring时不忙等的读走io_uring, 忙等本来就是非阻塞read, 还用原来的实现 */
+static int _SpidevUartRead(SpiTrans *t, uint8_t *buf, int len, int timeout, uint32_t spin_us){
+    if(t->uring && spin_us == 0) return (int)uart_UringRead(t->uring, buf, (size_t)len, timeout);
+    return (int)uart_ReadSpin(t->uart_fd, buf, (size_t)len, timeout, spin_us);
+}
+
+static int _SpidevUartXfer(SpiTrans *t, const uint8_t *tx, int tx_len, uint8_t *rx, int rx_len, int timeout, uint32_t spin_us){
+    if(t->uring && spin_us == 0) return (int)uart_UringWriteRead(t->uring, tx, (size_t)tx_len, rx, (size_t)rx_len, timeout);
+    if(uart_Write(t->uart_fd, (void *)tx, (size_t)tx_len) != tx_len) return -1;
+    return (int)uart_ReadSpin(t->uart_fd, rx, (size_t)rx_len, timeout, spin_us);
+}
+
+static void _SpidevUartInClean(SpiTrans *t){
+    uart_InClean(t->uart_fd);
+}
+
+static int _SpidevUartWait(SpiTrans *t, int timeout){
+    return uart_Wait(t->uart_fd, timeout);
+}
+
+static void _SpidevClose(SpiTrans *t){
+    uart_UringClose(t->uring);
+    t->uring = NULL;
+    close(t->spi_fd);
+    close(t->uart_fd);
+    t->spi_fd = t->uart_fd = -1;
+}
+
+static const SpiTransOps spidev_ops = {
+    .xfer = _SpidevXfer,
+    .uart_write = _SpidevUartWrite,
+    .uart_read = _SpidevUartRead,
+    .uart_xfer = _SpidevUartXfer,
+    .uart_in_clean = _SpidevUartInClean,
+    .uart_wait = _SpidevUartWait,
+    .close = _SpidevClose,
+};
+
+/*============================== Unix socket 代替 spidev ==============================*/
+
+static int _SockWriteAll(int fd, const uint8_t *data, size_t len){
+    ssize_t n;
+    while(len){
+        n = send(fd, data, len, MSG_NOSIGNAL);
+        if(n <= 0) return -1;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int _SockReadAll(int fd, uint8_t *data, size_t len){
+    ssize_t n;
+    while(len){
+        n = recv(fd, data, len, 0);
+        if(n <= 0) return -1;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* 各段拼成一次请求，priv 是 SPI_SOCK_MSG_MAX 大小的缓冲区 */
+static int _SockXfer(SpiTrans *t, struct spi_ioc_transfer *xfer, int n){
+    uint8_t *buf = (uint8_t *)t->priv;
+    SpiSockHdr hdr;
+    size_t total = 0, off = 0;
+    int32_t ret;
+    int i;
+
+    for(i = 0; i < n; i++)
+        total += xfer[i].len;
+    if(total > SPI_SOCK_MSG_MAX) return -1;
+    for(i = 0; i < n; i++){
+        if(xfer[i].tx_buf) memcpy(buf + off, (const void *)(uintptr_t)xfer[i].tx_buf, xfer[i].len);
+        else memset(buf + off, 0, xfer[i].len);
+        off += xfer[i].len;
+    }
+    hdr.magic = SPI_SOCK_MAGIC;
+    hdr.len = (uint32_t)total;
+    hdr.speed_hz = n > 0 ? xfer[0].speed_hz : 0;
+    if(_SockWriteAll(t->spi_fd, (const uint8_t *)&hdr, sizeof(hdr)) < 0 ||
+        _SockWriteAll(t->spi_fd, buf, total) < 0 ||
+        _SockReadAll(t->spi_fd, (uint8_t *)&ret, sizeof(ret)) < 0 ||
+        _SockReadAll(t->spi_fd, buf, total) < 0)
+        return -1;
+    for(i = 0, off = 0; i < n; i++){
+        if(xfer[i].rx_buf) memcpy((void *)(uintptr_t)xfer[i].rx_buf, buf + off, xfer[i].len);
+        off += xfer[i].len;
+    }
+    return ret;
+}
+
+static void _SockClose(SpiTrans *t){
+    _SpidevClose(t);
+    free(t->priv);
+    t->priv = NULL;
+}
+
+static const SpiTransOps sock_ops = {
+    .xfer = _SockXfer,
+    .uart_write = _SpidevUartWrite,
+    .uart_read = _SpidevUartRead,
+    .uart_xfer = _SpidevUartXfer,
+    .uart_in_clean = _SpidevUartInClean,
+    .uart_wait = _SpidevUartWait,
+    .close = _SockClose,
+};
+
+static int _SockOpen(SpiTrans *t, const char *spi_dev){
+    struct sockaddr_un addr;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, spi_dev, sizeof(addr.sun_path) - 1);
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) goto error;
+    t->priv = malloc(SPI_SOCK_MSG_MAX);
+    if(t->priv == NULL) goto error;
+    t->spi_fd = fd;
+    t->max_msg = SPI_SOCK_MSG_MAX;
+    t->ops = &sock_ops;
+    return 0;
+error:
+    close(fd);
+    return -1;
+}
+
+/**
+ * @brief 打开spi设备和握手串口
+ * @param  t                传输
+ * @param  spi_dev          spi设备 如 /dev/spidev3.0，是Unix socket时连接 mcu_emu
+ * @param  uart_dev         串口设备 如 /dev/ttyS1，用 mcu_emu 时是它创建的伪终端
+ * @param  speed            spi时钟频率
+ * @return int              成功0 失败负数
+ */
+int SpiTrans_OpenSpidev(SpiTrans *t, const char *spi_dev, const char *uart_dev, uint32_t speed){
+    char path[256];
+    uint8_t mode = SPI_MODE_3;              // 设置模式为 0
+    uint8_t lsb_first = 0;                  // 设置为 MSB 优先
+    uint8_t bits_per_word = 8;              // 设置数据位数为 8 位
+    struct stat st;
+    int fd, ret;
+
+    memset(t, 0, sizeof(SpiTrans));
+    /* 锁名 spi设备名__串口设备名 */
+    strncpy(path, spi_dev, sizeof(path) - 1);
+    path[sizeof(path) - 1] = '\0';
+    strncat(t->name, basename(path), 40);
+    strncat(t->name, "__", 3);
+    strncpy(path, uart_dev, sizeof(path) - 1);
+    strncat(t->name, basename(path), 40);
+
+    if(stat(spi_dev, &st) == 0 && S_ISSOCK(st.st_mode)){
+        t->uart_fd = uart_Open(uart_dev, UART_SPEED, 8, 1, 'N');
+        if(t->uart_fd < 0) return -1;
+        if(_SockOpen(t, spi_dev) < 0){
+            close(t->uart_fd);
+            return -1;
+        }
+        t->uart_baud = UART_SPEED;
+        t->uring = uart_UringOpen(t->uart_fd);
+        return 0;
+    }
+
+    ret = open(spi_dev, O_RDWR|O_CLOEXEC);  // 打开 SPI 设备文件
+    if(ret < 0) return ret;
+    fd = ret;
+    ret = ioctl(fd, SPI_IOC_WR_MODE, &mode);
+    if ( ret < 0) goto ioctl_error;
+    
+    ret = ioctl(fd, SPI_IOC_WR_LSB_FIRST, &lsb_first);
+    if ( ret < 0) goto ioctl_error;
+
+    ret = ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits_per_word);
+    if ( ret < 0) goto ioctl_error;
+
+    ret = ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed);
+    if ( ret < 0) goto ioctl_error;
+
+    t->uart_fd = uart_Open(uart_dev, UART_SPEED, 8, 1, 'N');
+    if(t->uart_fd < 0) { ret = -1; goto ioctl_error; }
+    t->spi_fd = fd;
+    t->max_msg = _SpidevBufsiz();
+    t->uart_baud = UART_SPEED;
+    t->uring = uart_UringOpen(t->uart_fd);
+    t->ops = &spidev_ops;
+    return 0;
+ioctl_error:
+    close(fd);
+    return ret;
+}